@@ -0,0 +1,72 @@
+// generate_lidar.cpp
+/**
+ * Usage: ./generate_lidar <num_points> <output.txt|output.bin> [options]
+ *
+ * Writes a synthetic, lidar-like scan (see lidar_generator.hpp), as text if
+ * the output ends in .txt, and in the binary format otherwise.
+ *
+ * Options:
+ *   --seed n         for the scene layout and the scan's jitter (default 1)
+ *   --size w h       extent of the scene (default 500 500)
+ *   --buildings n    (default 40)
+ *   --trees n        clusters of vegetation (default 25)
+ *   --water n        bodies of water (default 3)
+ *   --strips n       flight strips (default 6)
+ *   --duplicates f   fraction of points repeated exactly (default 0.01)
+ *
+ * Compile with:
+ *   g++ -std=c++17 -O2 generate_lidar.cpp lidar_generator.cpp -o generate_lidar
+ */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+#include "lidar_generator.hpp"
+
+int main(int argc, char** argv) {
+
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0]
+                  << " <num_points> <output.txt|output.bin> [options]\n";
+        return 2;
+    }
+
+    LidarScene scene;
+    scene.num_points = std::strtoull(argv[1], nullptr, 10);
+    std::string const path = argv[2];
+    for (int i=3; i<argc; i++) {
+        std::string const arg = argv[i];
+        if (arg == "--seed" && i+1 < argc) {
+            scene.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--size" && i+2 < argc) {
+            scene.width = std::atof(argv[++i]);
+            scene.height = std::atof(argv[++i]);
+        } else if (arg == "--buildings" && i+1 < argc) {
+            scene.num_buildings = std::atoi(argv[++i]);
+        } else if (arg == "--trees" && i+1 < argc) {
+            scene.num_tree_clusters = std::atoi(argv[++i]);
+        } else if (arg == "--water" && i+1 < argc) {
+            scene.num_water_bodies = std::atoi(argv[++i]);
+        } else if (arg == "--strips" && i+1 < argc) {
+            scene.num_strips = std::atoi(argv[++i]);
+        } else if (arg == "--duplicates" && i+1 < argc) {
+            scene.duplicate_fraction = std::atof(argv[++i]);
+        } else {
+            std::cout << "Unknown option: " << arg << "\n";
+            return 2;
+        }
+    }
+
+    bool const text = (
+        path.size() >= 4 && path.compare(path.size() - 4, 4, ".txt") == 0
+    );
+    bool const written = text
+        ? write_lidar_text(path, scene)
+        : write_lidar_binary(path, scene);
+    if (!written) {
+        std::cout << "Unable to write \"" << path << "\"\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,331 @@
+// lidar_generator.cpp
+
+#include <cmath>
+#include <cstring>
+#include <charconv>
+#include <fstream>
+#include <algorithm>
+
+#include "lidar_generator.hpp"
+
+namespace {
+
+    double const pi = 3.14159265358979323846;
+
+    double round_cm(double const v) { return std::round(v * 100) / 100; }
+
+}
+
+/**
+ * Lay out the scene, then pick a scan pattern dense enough that a single
+ * pass over the strips comes out at (about) the requested number of points.
+ * If it comes up short, the strips are flown again, halfway between the
+ * first ones, which just makes for more overlap.
+ */
+LidarGenerator::LidarGenerator(LidarScene const& s):
+    scene(s),
+    rng(s.seed),
+    pass(0),
+    strip(0),
+    line(0),
+    pulse(0),
+    generated(0),
+    next_return(0)
+{
+    scene.num_strips = std::max(1u, scene.num_strips);
+    double const scale = std::min(scene.width, scene.height) / 500;
+    for (double& phase : phases) phase = uniform(0, 2 * pi);
+
+    for (unsigned i = 0; i < scene.num_water_bodies; i++) {
+        water.push_back({
+            uniform(0, scene.width), uniform(0, scene.height),
+            uniform(20, 60) * scale, 0
+        });
+    }
+
+    // Buildings go wherever they don't overlap the water or each other
+    for (unsigned i = 0; i < scene.num_buildings; i++) {
+        for (int attempt = 0; attempt < 16; attempt++) {
+            double const w = uniform(8, 30) * scale;
+            double const h = uniform(8, 30) * scale;
+            double const x0 = uniform(0, std::max(0.0, scene.width - w));
+            double const y0 = uniform(0, std::max(0.0, scene.height - h));
+            Building const b = {
+                x0, y0, x0 + w, y0 + h,
+                uniform(4, 20),
+                (uniform(0, 1) < 0.5) ? 0 : uniform(0.3, 0.7)
+            };
+            bool clear = true;
+            for (auto const& lake : water) {
+                double const dx = std::clamp(lake.x, b.x0, b.x1) - lake.x;
+                double const dy = std::clamp(lake.y, b.y0, b.y1) - lake.y;
+                clear &= (dx*dx + dy*dy > lake.radius * lake.radius);
+            }
+            for (auto const& other : buildings) {
+                clear &= (b.x1 < other.x0 || other.x1 < b.x0
+                    || b.y1 < other.y0 || other.y1 < b.y0);
+            }
+            if (clear) {
+                buildings.push_back(b);
+                break;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < scene.num_tree_clusters; i++) {
+        trees.push_back({
+            uniform(0, scene.width), uniform(0, scene.height),
+            uniform(10, 40) * scale, uniform(8, 25)
+        });
+    }
+
+    double top = 0;
+    for (auto const& b : buildings) {
+        top = std::max(top, b.height + b.pitch * (b.y1 - b.y0) / 2);
+    }
+    for (auto const& t : trees) top = std::max(top, t.height);
+    min = {0, 0, round_cm(scene.ground - scene.relief) - 0.01};
+    max = {
+        scene.width, scene.height,
+        round_cm(scene.ground + scene.relief + top) + 0.01
+    };
+
+    // Sample the scene to see how many points a pulse returns on average
+    std::size_t const samples = 4096;
+    std::vector<Point> sampled;
+    for (std::size_t i = 0; i < samples; i++) {
+        hit(uniform(0, scene.width), uniform(0, scene.height), sampled);
+    }
+    double const per_pulse = std::max(
+        double(sampled.size()) / samples * (1 + scene.duplicate_fraction),
+        1.0 / samples
+    );
+
+    // Strips of equal width, each overlapping the next, span the width
+    strip_width = scene.width / (
+        1 + (scene.num_strips - 1) * (1 - scene.strip_overlap)
+    );
+    strip_spacing = strip_width * (1 - scene.strip_overlap);
+    double const per_strip = (
+        scene.num_points / per_pulse / scene.num_strips
+    );
+    // ...with pulses spaced about the same along and across the strips
+    pulses_per_line = std::max<std::size_t>(
+        2, std::lround(std::sqrt(per_strip * strip_width / scene.height))
+    );
+    lines_per_strip = std::max<std::size_t>(
+        1, std::ceil(per_strip / pulses_per_line)
+    );
+}
+
+double LidarGenerator::uniform(double const lo, double const hi) {
+    return std::uniform_real_distribution<double>(lo, hi)(rng);
+}
+
+/**
+ * Rolling hills, within the scene's relief of its ground level.
+ */
+double LidarGenerator::terrain(double const x, double const y) const {
+    double const u = x / scene.width;
+    double const v = y / scene.height;
+    return scene.ground + scene.relief * (
+        0.6 * std::sin(2 * pi * 1.3 * u + phases[0])
+            * std::cos(2 * pi * 0.7 * v + phases[1])
+        + 0.4 * std::sin(2 * pi * 3 * (u + v) + phases[2])
+    );
+}
+
+/**
+ * The points returned by a pulse which lands at (x, y), if any.
+ */
+void LidarGenerator::hit(double x, double y, std::vector<Point>& out) {
+    x = round_cm(x);
+    y = round_cm(y);
+    if (x < 0 || x > scene.width || y < 0 || y > scene.height) return;
+
+    double const ground = terrain(x, y);
+    for (auto const& lake : water) {
+        double const dx = x - lake.x;
+        double const dy = y - lake.y;
+        if (dx*dx + dy*dy < lake.radius * lake.radius) {
+            // Water absorbs almost everything, bar the odd glint
+            if (uniform(0, 1) < 0.02) out.push_back({x, y, round_cm(ground)});
+            return;
+        }
+    }
+
+    for (auto const& b : buildings) {
+        if (x < b.x0 || x > b.x1 || y < b.y0 || y > b.y1) continue;
+        double const edge = std::min({x - b.x0, b.x1 - x, y - b.y0, b.y1 - y});
+        if (edge < 0.3) {
+            // A wall, which the scanner sees all the way down
+            out.push_back({x, y, round_cm(ground + uniform(0, b.height))});
+        } else {
+            double const half = (b.y1 - b.y0) / 2;
+            double const ridge = std::abs(y - (b.y0 + half));
+            out.push_back({
+                x, y, round_cm(ground + b.height + b.pitch * (half - ridge))
+            });
+        }
+        return;
+    }
+
+    for (auto const& t : trees) {
+        double const dx = x - t.x;
+        double const dy = y - t.y;
+        double const d2 = (dx*dx + dy*dy) / (t.radius * t.radius);
+        if (d2 >= 1 || uniform(0, 1) > std::exp(-2 * d2)) continue;
+        // The canopy, maybe some branches, and maybe the ground beneath
+        double const canopy = t.height * (1 - 0.3 * d2) * uniform(0.8, 1);
+        out.push_back({x, y, round_cm(ground + canopy)});
+        if (uniform(0, 1) < 0.6) {
+            out.push_back({x, y, round_cm(ground + uniform(0.5, canopy))});
+        }
+        if (uniform(0, 1) < 0.4) out.push_back({x, y, round_cm(ground)});
+        return;
+    }
+
+    out.push_back({x, y, round_cm(ground)});
+}
+
+/**
+ * Fire the next pulse of the scan, into returns. The scanner sweeps back
+ * and forth across the strip while the aircraft moves along it, so each
+ * sweep is a slanted line, and consecutive sweeps zig-zag.
+ */
+void LidarGenerator::fire() {
+    if (pulse == pulses_per_line) {
+        pulse = 0;
+        line++;
+    }
+    if (line == lines_per_strip) {
+        line = 0;
+        strip++;
+    }
+    if (strip == scene.num_strips) {
+        strip = 0;
+        pass++;
+    }
+
+    double const line_spacing = scene.height / lines_per_strip;
+    double const pulse_spacing = strip_width / (pulses_per_line - 1);
+    double u = double(pulse) / (pulses_per_line - 1);
+    if (line % 2) u = 1 - u;
+    double const offset = (pass % 2) ? strip_spacing / 2 : 0;
+    double const x = offset + strip * strip_spacing + u * strip_width
+        + uniform(-0.25, 0.25) * pulse_spacing;
+    double const y = (line + double(pulse) / pulses_per_line) * line_spacing
+        + uniform(-0.25, 0.25) * line_spacing;
+    pulse++;
+
+    returns.clear();
+    hit(x, y, returns);
+    std::size_t const num_returns = returns.size();
+    for (std::size_t i = 0; i < num_returns; i++) {
+        if (uniform(0, 1) < scene.duplicate_fraction) {
+            returns.push_back(returns[i]);
+        }
+    }
+    next_return = 0;
+}
+
+/**
+ * Fill the buffer with the next chunk of points (overwriting whatever it
+ * held before). Returns false, with an empty buffer, once every point has
+ * been generated.
+ */
+bool LidarGenerator::next_chunk(
+    std::vector<Point>& chunk, std::size_t const chunk_size
+) {
+    chunk.clear();
+    while (chunk.size() < chunk_size && generated < scene.num_points) {
+        if (next_return == returns.size()) {
+            fire();
+            continue;
+        }
+        chunk.push_back(returns[next_return++]);
+        generated++;
+    }
+    return !chunk.empty();
+}
+
+std::size_t LidarGenerator::size() const { return scene.num_points; }
+
+std::array<double, 3> LidarGenerator::get_min() const { return min; }
+
+std::array<double, 3> LidarGenerator::get_max() const { return max; }
+
+/**
+ * Every point of a scene, in memory.
+ */
+std::vector<std::array<double, 3>> generate_lidar(LidarScene const& scene) {
+    LidarGenerator generator(scene);
+    std::vector<std::array<double, 3>> points;
+    points.reserve(scene.num_points);
+    std::vector<std::array<double, 3>> chunk;
+    while (generator.next_chunk(chunk)) {
+        points.insert(points.end(), chunk.begin(), chunk.end());
+    }
+    return points;
+}
+
+/**
+ * Write a scene in the same text format as the python generators (and
+ * LAStools' las2txt), which LidarReader and friends read.
+ * Returns false if the file couldn't be written.
+ */
+bool write_lidar_text(std::string const& path, LidarScene const& scene) {
+    LidarGenerator generator(scene);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.precision(15);
+    auto const min = generator.get_min();
+    auto const max = generator.get_max();
+    out << "% min x y z          " << min[0] << " " << min[1] << " " << min[2]
+        << "\n% max x y z          " << max[0] << " " << max[1] << " " << max[2]
+        << "\n";
+
+    std::vector<std::array<double, 3>> chunk;
+    std::vector<char> text;
+    while (generator.next_chunk(chunk)) {
+        text.resize(chunk.size() * 3 * 24);
+        char* p = text.data();
+        char* const end = text.data() + text.size();
+        for (auto const& point : chunk) {
+            for (int a = 0; a < 3; a++) {
+                p = std::to_chars(
+                    p, end, point[a], std::chars_format::fixed, 2
+                ).ptr;
+                *p++ = (a == 2) ? '\n' : ' ';
+            }
+        }
+        out.write(text.data(), p - text.data());
+    }
+    return bool(out);
+}
+
+/**
+ * Write a scene as a LidarBinaryHeader and the raw coordinates, which is
+ * much smaller and faster to read back than text (see LidarParser).
+ * Returns false if the file couldn't be written.
+ */
+bool write_lidar_binary(std::string const& path, LidarScene const& scene) {
+    LidarGenerator generator(scene);
+    LidarBinaryHeader header;
+    std::memcpy(header.magic, lidar_binary_magic, sizeof(header.magic));
+    header.num_points = generator.size();
+    auto const min = generator.get_min();
+    auto const max = generator.get_max();
+    std::copy(min.begin(), min.end(), header.min);
+    std::copy(max.begin(), max.end(), header.max);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    std::vector<std::array<double, 3>> chunk;
+    while (generator.next_chunk(chunk)) {
+        out.write(
+            reinterpret_cast<char const*>(chunk.data()),
+            chunk.size() * sizeof(chunk[0])
+        );
+    }
+    return bool(out);
+}
@@ -0,0 +1,107 @@
+// lidar_generator.hpp
+
+#include <array>
+#include <vector>
+#include <string>
+#include <random>
+#include <cstdint>
+
+#pragma once
+
+/**
+ * The layout of a synthetic scan. Its extent is [0, width] x [0, height],
+ * and everything else is placed at random (from the seed) within that.
+ */
+struct LidarScene {
+    std::size_t num_points = 1000000;
+    double width = 500;
+    double height = 500;
+    double ground = 50;  // mean terrain height
+    double relief = 10;  // terrain varies by up to this much either way
+    unsigned num_strips = 6;  // flight strips, across the width
+    double strip_overlap = 0.3;  // fraction of a strip shared with the next
+    unsigned num_buildings = 40;
+    unsigned num_tree_clusters = 25;
+    unsigned num_water_bodies = 3;
+    double duplicate_fraction = 0.01;  // of points repeated exactly
+    uint64_t seed = 1;
+};
+
+/**
+ * Binary files are this header, then num_points (x, y, z) doubles, in the
+ * machine's byte order. LidarParser reads them as well as text files.
+ */
+struct LidarBinaryHeader {
+    char magic[8];
+    uint64_t num_points;
+    double min[3];
+    double max[3];
+};
+
+char const lidar_binary_magic[8] = {'L', 'I', 'D', 'A', 'R', 'X', 'Y', 'Z'};
+
+/**
+ * Generates points which look (to an index, anyway) like an airborne scan,
+ * rather than uniform noise. A scanner sweeps zig-zag lines across each
+ * flight strip, so density varies along the sweeps, and doubles where the
+ * strips overlap. Pulses return (almost) nothing from water, one point from
+ * ground and roofs, points at any height from walls, and several points (at
+ * the same x and y) from vegetation, which is clustered into patches.
+ * A fraction of points are also exact duplicates, as from overlapping tiles.
+ * Coordinates are rounded to centimetres, as they would be in a LAS file.
+ *
+ * The points come out in scan order, a chunk at a time, so any number of
+ * them can be written out without holding them all in memory.
+ */
+class LidarGenerator {
+    private:
+        using Point = std::array<double, 3>;
+
+        struct Building {
+            double x0, y0, x1, y1;
+            double height;
+            double pitch;  // of the roof, which is gabled along x (or flat)
+        };
+
+        struct Patch {
+            double x, y, radius;
+            double height;  // of the vegetation (or unused, for water)
+        };
+
+        LidarScene scene;
+        std::mt19937_64 rng;
+        std::vector<Building> buildings;
+        std::vector<Patch> trees;
+        std::vector<Patch> water;
+        std::array<double, 3> phases;  // of the terrain
+        Point min;
+        Point max;
+
+        // The scan pattern, and where it's got to
+        double strip_width;
+        double strip_spacing;
+        std::size_t lines_per_strip;
+        std::size_t pulses_per_line;
+        std::size_t pass, strip, line, pulse;
+        std::size_t generated;
+        std::vector<Point> returns;  // (of the last pulse)
+        std::size_t next_return;
+
+        double uniform(double const lo, double const hi);
+        double terrain(double const x, double const y) const;
+        void hit(double const x, double const y, std::vector<Point>& out);
+        void fire();
+
+    public:
+        LidarGenerator(LidarScene const& scene);
+        bool next_chunk(
+            std::vector<Point>& chunk, std::size_t const chunk_size = 65536
+        );
+        std::size_t size() const;
+        std::array<double, 3> get_min() const;
+        std::array<double, 3> get_max() const;
+};
+
+std::vector<std::array<double, 3>> generate_lidar(LidarScene const& scene);
+bool write_lidar_text(std::string const& path, LidarScene const& scene);
+bool write_lidar_binary(std::string const& path, LidarScene const& scene);
@@ -6,6 +6,12 @@
  * file with some existing library, or write your own .las parser.
  */
 
+#include <cstdlib>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <iostream>
+
 #include "lidar_reader.hpp"
 
 LidarReader::LidarReader(std::string filename) {
@@ -21,21 +27,7 @@ LidarReader::LidarReader(std::string filename) {
     // Parse the file header lines, denoted by '%' at position 0
     while (getline(infile, line)) {
         if (line[0] != '%') break;
-
-        if (line.substr(2, 9).compare("min x y z") == 0) {
-            std::string coords = line.substr(11, line.size() - 11);
-            std::vector<std::string> split_coords = split_string(coords, " ");
-            min[0] = stod(split_coords[0]);
-            min[1] = stod(split_coords[1]); 
-            min[2] = stod(split_coords[2]);      
-        } 
-        else if (line.substr(2, 9).compare("max x y z") == 0) {
-            std::string coords = line.substr(11, line.size() - 11);
-            std::vector<std::string> split_coords = split_string(coords, " ");
-            max[0] = stod(split_coords[0]);
-            max[1] = stod(split_coords[1]);
-            max[2] = stod(split_coords[2]); 
-        }
+        parse_header_line(line, min, max);
     }
 
     // Parse the actual point data (format: "x y z")
@@ -49,12 +41,379 @@ LidarReader::LidarReader(std::string filename) {
     } while (getline(infile, line)); 
 }
 
-std::vector<std::vector<double>> LidarReader::get_point_data() { return point_data; }
+std::vector<std::vector<double>> const& LidarReader::get_point_data() const {
+    return point_data;
+}
 
 std::array<double, 3> LidarReader::get_min() { return min; }
 
 std::array<double, 3> LidarReader::get_max() { return max; }
 
+LidarChunkReader::LidarChunkReader(
+    std::string filename, std::size_t chunk_size, bool prefetch
+):
+    infile(filename),
+    has_line(false),
+    chunk_size(chunk_size),
+    columns(0),
+    skipped(0),
+    prefetch(prefetch),
+    prefetched_skipped(0),
+    full(false),
+    finished(false),
+    stopping(false)
+{
+    if (!infile) {
+        std::cout << "Unable to open data file: \"" << filename << "\"\n";
+        std::cout << "Exiting...\n";
+        exit(1);
+    }
+
+    // The header has to be read up front, for the bounds
+    while ((has_line = bool(getline(infile, line)))) {
+        if (line[0] != '%') break;
+        parse_header_line(line, min, max);
+    }
+
+    if (prefetch) {
+        worker = std::thread(&LidarChunkReader::prefetch_chunks, this);
+    }
+}
+
+LidarChunkReader::~LidarChunkReader() {
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        worker.join();
+    }
+}
+
+/**
+ * Fill the buffer with the next chunk of points (overwriting, rather than
+ * reallocating, whatever points it held before).
+ * Returns false, with an empty buffer, once the file is exhausted.
+ */
+bool LidarChunkReader::next_chunk(std::vector<std::vector<double>>& chunk) {
+    if (!prefetch) {
+        std::size_t chunk_skipped;
+        bool const more = read_chunk(chunk, chunk_skipped);
+        skipped += chunk_skipped;
+        return more;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return full; });
+    skipped += prefetched_skipped;
+    if (finished) {
+        chunk.clear();
+        return false;
+    }
+    chunk.swap(prefetched);  // (the worker gets the old buffer to refill)
+    full = false;
+    ready.notify_all();
+    return true;
+}
+
+/**
+ * Parse up to chunk_size points into chunk, counting the lines which had to
+ * be skipped through chunk_skipped.
+ */
+bool LidarChunkReader::read_chunk(
+    std::vector<std::vector<double>>& chunk,
+    std::size_t& chunk_skipped
+) {
+    std::size_t n = 0;
+    chunk_skipped = 0;
+    while (n < chunk_size && has_line) {
+        if (line.find_first_not_of(" \t\r") != std::string::npos) {
+            if (chunk.size() == n) chunk.emplace_back();
+            bool const ok = parse_point(line, chunk[n]);
+            if (ok && columns == 0) columns = chunk[n].size();
+            if (ok && chunk[n].size() == columns) {
+                n++;
+            } else {
+                chunk_skipped++;
+            }
+        }
+        has_line = bool(getline(infile, line));
+    }
+    chunk.resize(n);
+    return (n > 0);
+}
+
+/**
+ * The worker thread: parse a chunk, wait for the last one to be taken,
+ * hand the new one over, and repeat until the end of the file.
+ */
+void LidarChunkReader::prefetch_chunks() {
+    std::vector<std::vector<double>> buffer;
+    bool more = true;
+    while (more) {
+        std::size_t buffer_skipped;
+        more = read_chunk(buffer, buffer_skipped);
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this] { return !full || stopping; });
+        if (stopping) return;
+        prefetched.swap(buffer);
+        prefetched_skipped = buffer_skipped;
+        full = true;
+        finished = !more;
+        ready.notify_all();
+    }
+}
+
+std::size_t LidarChunkReader::get_skipped() const { return skipped; }
+
+std::array<double, 3> LidarChunkReader::get_min() { return min; }
+
+std::array<double, 3> LidarChunkReader::get_max() { return max; }
+
+namespace {
+
+    bool is_blank(char const c) {
+        return (c == ' ' || c == '\t' || c == '\r');
+    }
+
+    /**
+     * Parse the numbers on the line starting at p (which has to be before
+     * end) onto the back of coords, and return the start of the next line.
+     * Returns the number of columns through n, or 0 if the line is blank,
+     * and false if it doesn't parse.
+     */
+    char const* parse_line(
+        char const* p,
+        char const* const end,
+        std::vector<double>& coords,
+        std::size_t& n,
+        bool& ok
+    ) {
+        n = 0;
+        ok = true;
+        while (true) {
+            while (p != end && is_blank(*p)) p++;
+            if (p == end || *p == '\n') break;
+            double value;
+            auto const [next, error] = std::from_chars(p, end, value);
+            if (error != std::errc()) {
+                ok = false;
+                p = static_cast<char const*>(std::memchr(p, '\n', end - p));
+                if (!p) p = end;
+                break;
+            }
+            coords.push_back(value);
+            n++;
+            p = next;
+        }
+        return (p == end) ? end : p + 1;
+    }
+
+    /**
+     * Parse every line in [p, end) with the given number of columns onto
+     * the back of coords, and return how many lines were skipped.
+     */
+    std::size_t parse_lines(
+        char const* p,
+        char const* const end,
+        std::size_t const columns,
+        std::vector<double>& coords
+    ) {
+        std::size_t skipped = 0;
+        while (p != end) {
+            std::size_t const line_start = coords.size();
+            std::size_t n;
+            bool ok;
+            p = parse_line(p, end, coords, n, ok);
+            if (ok && n == 0) continue;
+            if (!ok || n != columns) {
+                coords.resize(line_start);
+                skipped++;
+            }
+        }
+        return skipped;
+    }
+
+}
+
+LidarParser::LidarParser(std::string filename, unsigned num_threads):
+    columns(0),
+    skipped(0)
+{
+    auto const file = spatial::MappedFile::open(filename);
+    if (!file) {
+        std::cout << "Unable to open data file: \"" << filename << "\"\n";
+        std::cout << "Exiting...\n";
+        exit(1);
+    }
+    char const* p = file->data();
+    char const* const end = p + file->size();
+
+    // Binary files (see lidar_generator.hpp) just need copying out
+    LidarBinaryHeader header;
+    if (file->size() >= sizeof(header)
+        && std::memcmp(p, lidar_binary_magic, sizeof(header.magic)) == 0
+    ) {
+        std::memcpy(&header, p, sizeof(header));
+        std::size_t const num_coords = (
+            (file->size() - sizeof(header)) / sizeof(double)
+        );
+        if (header.num_points > num_coords / 3) {
+            std::cout << "Truncated data file: \"" << filename << "\"\n";
+            std::cout << "Exiting...\n";
+            exit(1);
+        }
+        std::copy(header.min, header.min + 3, min.begin());
+        std::copy(header.max, header.max + 3, max.begin());
+        columns = 3;
+        coords.resize(header.num_points * 3);
+        std::memcpy(
+            coords.data(), p + sizeof(header), coords.size() * sizeof(double)
+        );
+        return;
+    }
+
+    // The header is only a few lines, so gets the usual treatment
+    while (p != end && *p == '%') {
+        char const* eol = static_cast<char const*>(
+            std::memchr(p, '\n', end - p)
+        );
+        if (!eol) eol = end;
+        parse_header_line(std::string(p, eol), min, max);
+        p = (eol == end) ? end : eol + 1;
+    }
+
+    // The first data line decides how many columns there are
+    while (p != end && columns == 0) {
+        std::size_t const line_start = coords.size();
+        std::size_t n;
+        bool ok;
+        p = parse_line(p, end, coords, n, ok);
+        if (ok) {
+            columns = n;
+        } else {
+            coords.resize(line_start);
+            skipped++;
+        }
+    }
+    if (p == end) return;
+
+    // Split the rest into runs of whole lines, one per thread
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::vector<char const*> splits = {p};
+    for (unsigned i = 1; i < num_threads; i++) {
+        char const* split = p + (end - p) * i / num_threads;
+        split = std::max(split, splits.back());
+        if (split != p && split[-1] != '\n') {
+            split = static_cast<char const*>(
+                std::memchr(split, '\n', end - split)
+            );
+            split = split ? split + 1 : end;
+        }
+        splits.push_back(split);
+    }
+    splits.push_back(end);
+
+    // The first run goes straight into coords, the others are appended
+    std::vector<std::vector<double>> parts(num_threads);
+    std::vector<std::size_t> part_skipped(num_threads);
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < num_threads; i++) {
+        threads.emplace_back([&, i] () {
+            auto& part = (i == 0) ? coords : parts[i];
+            // (guessing at a few bytes per number, to rarely reallocate)
+            part.reserve(part.size() + (splits[i+1] - splits[i]) / 6);
+            part_skipped[i] = parse_lines(
+                splits[i], splits[i+1], columns, part
+            );
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::size_t total = 0;
+    for (auto const& part : parts) total += part.size();
+    coords.reserve(coords.size() + total);
+    for (unsigned i = 0; i < num_threads; i++) {
+        coords.insert(coords.end(), parts[i].begin(), parts[i].end());
+        std::vector<double>().swap(parts[i]);
+        skipped += part_skipped[i];
+    }
+}
+
+std::vector<double> const& LidarParser::get_coords() const { return coords; }
+
+/**
+ * The points in the same form as LidarReader::get_point_data(), for the
+ * indexes' build() functions.
+ */
+std::vector<std::vector<double>> LidarParser::get_point_data() const {
+    std::vector<std::vector<double>> point_data;
+    point_data.reserve(size());
+    for (std::size_t i = 0; i < coords.size(); i += columns) {
+        point_data.emplace_back(
+            coords.begin() + i, coords.begin() + i + columns
+        );
+    }
+    return point_data;
+}
+
+std::size_t LidarParser::get_columns() const { return columns; }
+
+std::size_t LidarParser::get_skipped() const { return skipped; }
+
+std::size_t LidarParser::size() const {
+    return columns ? coords.size() / columns : 0;
+}
+
+std::array<double, 3> LidarParser::get_min() { return min; }
+
+std::array<double, 3> LidarParser::get_max() { return max; }
+
+/**
+ * Pick the bounds out of a header line, if it holds either of them.
+ */
+void parse_header_line(
+    std::string const& line,
+    std::array<double, 3>& min,
+    std::array<double, 3>& max
+) {
+    if (line.substr(2, 9).compare("min x y z") == 0) {
+        std::string coords = line.substr(11, line.size() - 11);
+        std::vector<std::string> split_coords = split_string(coords, " ");
+        min[0] = stod(split_coords[0]);
+        min[1] = stod(split_coords[1]); 
+        min[2] = stod(split_coords[2]);      
+    } 
+    else if (line.substr(2, 9).compare("max x y z") == 0) {
+        std::string coords = line.substr(11, line.size() - 11);
+        std::vector<std::string> split_coords = split_string(coords, " ");
+        max[0] = stod(split_coords[0]);
+        max[1] = stod(split_coords[1]);
+        max[2] = stod(split_coords[2]); 
+    }
+}
+
+/**
+ * Parse every number on a line into coords, reusing its storage.
+ * Returns false if anything other than numbers and blanks is left over.
+ */
+bool parse_point(std::string const& line, std::vector<double>& coords) {
+    coords.clear();
+    char const* start = line.c_str();
+    char* end;
+    for (double value = strtod(start, &end); end != start;
+        value = strtod(start, &end)
+    ) {
+        coords.push_back(value);
+        start = end;
+    }
+    while (is_blank(*start)) start++;
+    return (*start == '\0');
+}
+
 // This function is bad
 std::vector<std::string> split_string(std::string s, std::string delim) {
     std::vector<std::string> v;
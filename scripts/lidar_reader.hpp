@@ -2,9 +2,22 @@
 
 #include <array>
 #include <vector>
+#include <string>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "../src/storage.hpp"
+#include "lidar_generator.hpp"
 
 std::vector<std::string> split_string(std::string s, std::string delim);
+void parse_header_line(
+    std::string const& line,
+    std::array<double, 3>& min,
+    std::array<double, 3>& max
+);
+bool parse_point(std::string const& line, std::vector<double>& coords);
 
 class LidarReader {
     private:
@@ -14,7 +27,93 @@ class LidarReader {
 
     public:
         LidarReader(std::string filename);
-        std::vector<std::vector<double>> get_point_data();
+        std::vector<std::vector<double>> const& get_point_data() const;
+        std::array<double, 3> get_min();
+        std::array<double, 3> get_max();
+};
+
+/**
+ * Reads the same files as LidarReader, but a chunk of points at a time,
+ * into a buffer which the caller passes back in (and which keeps its
+ * capacity), so memory use doesn't grow with the size of the file.
+ * The bounds from the header are available as soon as it's constructed.
+ *
+ * With prefetch, a background thread parses the next chunk while the
+ * caller works on the current one.
+ *
+ * The first data line decides how many columns there are, as with
+ * LidarParser, and lines which don't parse (or have the wrong number of
+ * columns) are skipped, and counted.
+ */
+class LidarChunkReader {
+    private:
+        std::ifstream infile;
+        std::array<double, 3> min;
+        std::array<double, 3> max;
+        std::string line;  // the next line to be parsed
+        bool has_line;
+        std::size_t chunk_size;
+        std::size_t columns;  // (only touched by whichever thread parses)
+        std::size_t skipped;  // ...in the chunks handed out so far
+
+        // Prefetching state, shared with the worker thread
+        bool prefetch;
+        std::thread worker;
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::vector<std::vector<double>> prefetched;
+        std::size_t prefetched_skipped;
+        bool full;  // prefetched holds a chunk which hasn't been taken yet
+        bool finished;  // ...and that chunk is the (empty) end of the file
+        bool stopping;
+
+        bool read_chunk(
+            std::vector<std::vector<double>>& chunk,
+            std::size_t& chunk_skipped
+        );
+        void prefetch_chunks();
+
+    public:
+        LidarChunkReader(
+            std::string filename,
+            std::size_t chunk_size = 65536,
+            bool prefetch = false
+        );
+        ~LidarChunkReader();
+        bool next_chunk(std::vector<std::vector<double>>& chunk);
+        std::size_t get_skipped() const;
+        std::array<double, 3> get_min();
+        std::array<double, 3> get_max();
+};
+
+
+/**
+ * Parses the same files as LidarReader, with every line holding any (but
+ * the same) number of columns, much faster: the file is mapped rather than
+ * read, split into one run of whole lines per thread, and parsed in place
+ * with std::from_chars. The points end up in one contiguous array, with
+ * point i's coordinates at [i*columns, (i+1)*columns).
+ *
+ * Blank lines are ignored, and lines which don't parse (or have the wrong
+ * number of columns) are skipped, and counted.
+ *
+ * It also reads the binary files written by write_lidar_binary().
+ */
+class LidarParser {
+    private:
+        std::vector<double> coords;
+        std::size_t columns;
+        std::size_t skipped;
+        std::array<double, 3> min;
+        std::array<double, 3> max;
+
+    public:
+        LidarParser(std::string filename, unsigned num_threads = 0);
+        std::vector<double> const& get_coords() const;
+        std::vector<std::vector<double>> get_point_data() const;
+        std::size_t get_columns() const;
+        std::size_t get_skipped() const;
+        std::size_t size() const;
         std::array<double, 3> get_min();
         std::array<double, 3> get_max();
-};
\ No newline at end of file
+};
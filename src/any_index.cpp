@@ -0,0 +1,192 @@
+// any_index.cpp
+
+#include "any_index.hpp"
+
+using coord_t = spatial::coord_t;
+using index_t = spatial::index_t;
+
+namespace {
+
+    /**
+     * Build any index the usual way, except the R-tree, whose fastest build
+     * for a static data set is a packed bulk load, and a Z-grid with its
+     * resolution set.
+     */
+    template<typename Index, typename T>
+    void build_index(
+        Index& index,
+        std::vector<T> const& raw_data,
+        spatial::IndexConfig const&
+    ) {
+        index.build(raw_data);
+    }
+
+    template<typename T, int D, int M>
+    void build_index(
+        spatial::Rtree<T, D, M>& rtree,
+        std::vector<T> const& raw_data,
+        spatial::IndexConfig const& config
+    ) {
+        rtree.bulk_load(raw_data, config.curve);
+        rtree.pack();
+    }
+
+    template<typename T, typename S, int D>
+    void build_index(
+        spatial::Zgrid<T, S, D>& zgrid,
+        std::vector<T> const& raw_data,
+        spatial::IndexConfig const& config
+    ) {
+        if (config.resolution > 0) zgrid.build(raw_data, config.resolution);
+        else zgrid.build(raw_data);
+    }
+
+    template<typename T, int D, int L>
+    std::unique_ptr<spatial::AnyIndex<T, D>> make_quadtree(
+        spatial::IndexConfig const& config,
+        spatial::RectangleND<D> const bounds,
+        std::pmr::memory_resource* const resource
+    ) {
+        using Quadtree = spatial::Quadtree<T, spatial::coord_t, D, L>;
+        return std::make_unique<spatial::IndexModel<Quadtree, T, D>>(
+            config, bounds, config.curve, resource
+        );
+    }
+
+    template<typename T, int D, int M>
+    std::unique_ptr<spatial::AnyIndex<T, D>> make_rtree(
+        spatial::IndexConfig const& config,
+        std::pmr::memory_resource* const resource
+    ) {
+        using Rtree = spatial::Rtree<T, D, M>;
+        return std::make_unique<spatial::IndexModel<Rtree, T, D>>(
+            config, resource
+        );
+    }
+
+}
+
+template<typename T, int D>
+std::vector<T> spatial::AnyIndex<T, D>::query_knn(
+    unsigned const k, coord_t const x, coord_t const y,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    static_assert(D == 2, "Use the Point overload of query_knn() for D != 2");
+    return query_knn(k, (Point){{x, y}}, epsilon, max_visits);
+}
+
+template<typename T, int D>
+std::vector<T> spatial::AnyIndex<T, D>::query_radius(
+    coord_t const x, coord_t const y, coord_t const radius
+) const {
+    static_assert(
+        D == 2, "Use the Point overload of query_radius() for D != 2"
+    );
+    return query_radius((Point){{x, y}}, radius);
+}
+
+template<typename Index, typename T, int D>
+void spatial::IndexModel<Index, T, D>::build(std::vector<T> const& raw_data) {
+    build_index(index, raw_data, config);
+}
+
+template<typename Index, typename T, int D>
+std::vector<T> spatial::IndexModel<Index, T, D>::query_knn(
+    unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    return index.query_knn(k, query_point, epsilon, max_visits);
+}
+
+template<typename Index, typename T, int D>
+std::vector<std::vector<T>> spatial::IndexModel<Index, T, D>::query_knn_batch(
+    unsigned const k,
+    std::vector<Point> const& query_points,
+    Curve const curve
+) const {
+    return index.query_knn_batch(k, query_points, curve);
+}
+
+template<typename Index, typename T, int D>
+std::vector<T> spatial::IndexModel<Index, T, D>::query_radius(
+    Point const center, coord_t const radius
+) const {
+    return index.query_radius(center, radius);
+}
+
+template<typename Index, typename T, int D>
+std::size_t spatial::IndexModel<Index, T, D>::memory_bytes() const {
+    return index.memory_bytes();
+}
+
+template<typename Index, typename T, int D>
+spatial::QueryStats spatial::IndexModel<Index, T, D>::get_stats() const {
+    return index.get_stats();
+}
+
+template<typename Index, typename T, int D>
+void spatial::IndexModel<Index, T, D>::reset_stats() {
+    index.reset_stats();
+}
+
+template<typename Index, typename T, int D>
+spatial::IndexConfig const&
+spatial::IndexModel<Index, T, D>::get_config() const {
+    return config;
+}
+
+/**
+ * An empty index of the configured structure (see index_names) over the
+ * given bounds, which the quadtree and Z-grid need up front, and the R-tree
+ * works out for itself. build() builds it as configured, with the R-tree
+ * bulk loaded and packed. Returns nullptr for a name it doesn't know, or a
+ * capacity which wasn't instantiated (see quadtree_capacities).
+ */
+template<typename T, int D>
+std::unique_ptr<spatial::AnyIndex<T, D>> spatial::make_index(
+    IndexConfig const& config,
+    RectangleND<D> const bounds,
+    std::pmr::memory_resource* const resource
+) {
+    if (config.name == "quadtree") {
+        switch (config.capacity) {
+            case 8: return make_quadtree<T, D, 8>(config, bounds, resource);
+            case 0:
+            case 16: return make_quadtree<T, D, 16>(config, bounds, resource);
+            case 32: return make_quadtree<T, D, 32>(config, bounds, resource);
+            case 64: return make_quadtree<T, D, 64>(config, bounds, resource);
+            default: return nullptr;
+        }
+    }
+    if (config.name == "rtree") {
+        switch (config.capacity) {
+            case 4: return make_rtree<T, D, 4>(config, resource);
+            case 0:
+            case 8: return make_rtree<T, D, 8>(config, resource);
+            case 16: return make_rtree<T, D, 16>(config, resource);
+            default: return nullptr;
+        }
+    }
+    if (config.name == "zgrid" && config.capacity == 0) {
+        return std::make_unique<IndexModel<Zgrid<T, coord_t, D>, T, D>>(
+            config, bounds, config.curve, resource
+        );
+    }
+    return nullptr;
+}
+
+/**
+ * The named structure with its default configuration: Z-order data, bar
+ * the R-tree's Hilbert bulk load, and the Z-grid's suggested resolution.
+ */
+template<typename T, int D>
+std::unique_ptr<spatial::AnyIndex<T, D>> spatial::make_index(
+    std::string const& name,
+    RectangleND<D> const bounds,
+    std::pmr::memory_resource* const resource
+) {
+    IndexConfig const config = {
+        name, (name == "rtree") ? Curve::hilbert : Curve::zorder, 0, 0
+    };
+    return make_index<T, D>(config, bounds, resource);
+}
@@ -0,0 +1,177 @@
+// any_index.hpp
+/**
+ * One interface over every index, so that code which only builds and
+ * queries an index (benchmarks, pipelines) can pick the structure by name
+ * at runtime, rather than being written out once per structure.
+ *
+ * Once constructed, the Quadtree, Rtree and Zgrid all build from a vector
+ * of T, answer k-NN and radius queries, and report their memory use in the
+ * same way (the SpatialIndex concept spells that out, where the compiler
+ * has C++20 concepts). It's only their constructors which differ, and the
+ * R-tree's fastest static build (bulk_load() and pack(), rather than
+ * build()'s one by one insertion), so make_index() hides both of those,
+ * behind an AnyIndex.
+ *
+ * Calls through an AnyIndex are virtual, which is noise next to a k-NN
+ * query, but anything structure-specific (QueryContexts, cursors, saving
+ * and loading) still needs the concrete type.
+ */
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <utility>
+#include <memory_resource>
+
+#include "spatial.hpp"
+#include "quadtree.hpp"
+#include "rtree.hpp"
+#include "zgrid.hpp"
+
+#if defined(__cpp_concepts) && __cpp_concepts >= 201907L
+#include <concepts>
+#endif
+
+#pragma once
+
+namespace spatial {
+
+#if defined(__cpp_concepts) && __cpp_concepts >= 201907L
+    /**
+     * An index over T in D dimensions, with everything that AnyIndex needs.
+     */
+    template<typename Index, typename T, int D = 2>
+    concept SpatialIndex = requires(
+        Index& index,
+        Index const& built,
+        std::vector<T> const& raw_data,
+        unsigned const k,
+        PointND<D> const p,
+        coord_t const radius
+    ) {
+        index.build(raw_data);
+        { built.query_knn(k, p) } -> std::same_as<std::vector<T>>;
+        { built.query_radius(p, radius) } -> std::same_as<std::vector<T>>;
+        { built.memory_bytes() } -> std::convertible_to<std::size_t>;
+    };
+#endif
+
+    /**
+     * The names which make_index() knows, one per structure.
+     */
+    char const* const index_names[] = {"quadtree", "rtree", "zgrid"};
+
+    /**
+     * The quadtree leaf capacities (L) and R-tree fan-outs (M) which
+     * make_index() has instantiated, and so can build at runtime.
+     */
+    int const quadtree_capacities[] = {8, 16, 32, 64};
+    int const rtree_capacities[] = {4, 8, 16};
+
+    /**
+     * Everything make_index() needs to construct and build an index, other
+     * than its bounds: which structure, the curve its data is laid out (or
+     * for the R-tree, bulk loaded) along, and for the Z-grid, its
+     * resolution, or 0 for Zgrid::resolution() of the points it's built on.
+     * The capacity is the quadtree's L or the R-tree's M (one of those
+     * above), or 0 for their defaults. The Z-grid has none.
+     */
+    struct IndexConfig {
+        std::string name;
+        Curve curve = Curve::zorder;
+        int resolution = 0;
+        int capacity = 0;
+    };
+
+    template<typename T, int D = 2>
+    class AnyIndex {
+        public:
+            using Point = PointND<D>;
+
+            virtual ~AnyIndex() = default;
+            virtual void build(std::vector<T> const& raw_data) = 0;
+            virtual std::vector<T> query_knn(
+                unsigned const k, Point const query_point,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const = 0;
+            virtual std::vector<std::vector<T>> query_knn_batch(
+                unsigned const k, std::vector<Point> const& query_points,
+                Curve const curve = Curve::zorder
+            ) const = 0;
+            virtual std::vector<T> query_radius(
+                Point const center, coord_t const radius
+            ) const = 0;
+            virtual std::size_t memory_bytes() const = 0;
+            virtual QueryStats get_stats() const = 0;
+            virtual void reset_stats() = 0;
+            virtual IndexConfig const& get_config() const = 0;
+
+            std::vector<T> query_knn(
+                unsigned const k, coord_t const x, coord_t const y,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
+            std::vector<T> query_radius(
+                coord_t const x, coord_t const y, coord_t const radius
+            ) const;
+    };
+
+    /**
+     * An AnyIndex which forwards everything to an Index, constructed from
+     * whatever arguments the IndexModel is (after the config it's built
+     * with).
+     */
+    template<typename Index, typename T, int D = 2>
+    class IndexModel : public AnyIndex<T, D> {
+        private:
+            using Point = PointND<D>;
+
+            IndexConfig config;
+            Index index;
+
+        public:
+            using AnyIndex<T, D>::query_knn;
+            using AnyIndex<T, D>::query_radius;
+
+            template<typename... Args>
+            explicit IndexModel(IndexConfig const& c, Args&&... args):
+                config(c),
+                index(std::forward<Args>(args)...)
+            { }
+
+            Index& get() { return index; }
+            Index const& get() const { return index; }
+
+            void build(std::vector<T> const& raw_data) override;
+            std::vector<T> query_knn(
+                unsigned const k, Point const query_point,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const override;
+            std::vector<std::vector<T>> query_knn_batch(
+                unsigned const k, std::vector<Point> const& query_points,
+                Curve const curve = Curve::zorder
+            ) const override;
+            std::vector<T> query_radius(
+                Point const center, coord_t const radius
+            ) const override;
+            std::size_t memory_bytes() const override;
+            QueryStats get_stats() const override;
+            void reset_stats() override;
+            IndexConfig const& get_config() const override;
+    };
+
+    template<typename T, int D = 2>
+    std::unique_ptr<AnyIndex<T, D>> make_index(
+        IndexConfig const& config,
+        RectangleND<D> const bounds,
+        std::pmr::memory_resource* const resource
+            = std::pmr::get_default_resource()
+    );
+    template<typename T, int D = 2>
+    std::unique_ptr<AnyIndex<T, D>> make_index(
+        std::string const& name,
+        RectangleND<D> const bounds,
+        std::pmr::memory_resource* const resource
+            = std::pmr::get_default_resource()
+    );
+
+}
@@ -0,0 +1,166 @@
+// arena.hpp
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <memory_resource>
+
+#pragma once
+
+namespace spatial {
+
+    /**
+     * A bump allocator for tree nodes. Nodes are carved out of large
+     * contiguous blocks, which are only released (all at once) when the
+     * arena is destroyed. There's no per-node free, and no destructors are
+     * ever run, so T has to be trivially destructible.
+     *
+     * allocate() hands out a group of adjacent nodes, e.g., a full set of
+     * siblings, so that expanding a node touches one contiguous run of memory
+     * rather than 2^D scattered heap allocations.
+     *
+     * Blocks start small, so that a small (or empty) index doesn't sit on
+     * a large block it'll never fill, and double in size up to a maximum,
+     * so that a large index still takes few blocks.
+     *
+     * The blocks (and the list of blocks) come from a memory resource,
+     * which is the global heap unless the owning index was given another.
+     */
+    template<typename T>
+    class Arena {
+        private:
+            static_assert(
+                std::is_trivially_destructible<T>::value,
+                "Arena never runs destructors"
+            );
+
+            struct Slot {
+                alignas(T) unsigned char bytes[sizeof(T)];
+            };
+
+            struct Block {
+                Slot* slots;
+                std::size_t size;
+            };
+
+            std::pmr::vector<Block> blocks;
+            std::size_t first_block_size;
+            std::size_t max_block_size;
+            std::size_t block_size;  // of the next block
+            std::size_t used;  // slots handed out from the last block
+
+            Slot* new_block(std::size_t const size) {
+                return static_cast<Slot*>(
+                    blocks.get_allocator().resource()->allocate(
+                        size * sizeof(Slot), alignof(Slot)
+                    )
+                );
+            }
+
+        public:
+            explicit Arena(
+                std::pmr::memory_resource* const resource
+                    = std::pmr::get_default_resource(),
+                std::size_t const first_block_size = 16,
+                std::size_t const max_block_size = 4096
+            ):
+                blocks(resource),
+                first_block_size(first_block_size),
+                max_block_size(std::max(max_block_size, first_block_size)),
+                block_size(first_block_size),
+                used(0)
+            { }
+
+            // The moved-from arena is left empty, and can only be destroyed
+            Arena(Arena&& other) noexcept:
+                blocks(std::move(other.blocks)),
+                first_block_size(other.first_block_size),
+                max_block_size(other.max_block_size),
+                block_size(other.block_size),
+                used(other.used)
+            {
+                other.blocks.clear();
+            }
+
+            Arena(Arena const&) = delete;
+            Arena& operator=(Arena const&) = delete;
+
+            ~Arena() { clear(); }
+
+            /**
+             * Release every block, and with them every node handed out.
+             */
+            void clear() {
+                auto* const resource = blocks.get_allocator().resource();
+                for (auto const& block : blocks) {
+                    resource->deallocate(
+                        block.slots, block.size * sizeof(Slot), alignof(Slot)
+                    );
+                }
+                blocks.clear();
+                block_size = first_block_size;
+                used = 0;
+            }
+
+            /**
+             * Swap contents with another arena using the same resource.
+             */
+            void swap(Arena& other) noexcept {
+                blocks.swap(other.blocks);
+                std::swap(first_block_size, other.first_block_size);
+                std::swap(max_block_size, other.max_block_size);
+                std::swap(block_size, other.block_size);
+                std::swap(used, other.used);
+            }
+
+            /**
+             * Uninitialised storage for n contiguous Ts, to be constructed
+             * with placement new. Groups larger than the next block get a
+             * block of their own.
+             */
+            T* allocate(std::size_t const n) {
+                if (n > block_size) {
+                    if (blocks.empty()) {
+                        blocks.push_back({new_block(n), n});
+                        used = n;
+                        return reinterpret_cast<T*>(blocks.back().slots);
+                    }
+                    // (in front of the last block, which may have room left)
+                    auto const own = blocks.insert(
+                        blocks.end() - 1, {new_block(n), n}
+                    );
+                    return reinterpret_cast<T*>(own->slots);
+                }
+                if (blocks.empty() || used + n > blocks.back().size) {
+                    blocks.push_back({new_block(block_size), block_size});
+                    block_size = std::min(2 * block_size, max_block_size);
+                    used = 0;
+                }
+                T* const group = reinterpret_cast<T*>(
+                    blocks.back().slots + used
+                );
+                used += n;
+                return group;
+            }
+
+            /**
+             * Every byte the arena has taken from its resource, used or not.
+             */
+            std::size_t bytes() const {
+                std::size_t total = blocks.capacity() * sizeof(Block);
+                for (auto const& block : blocks) {
+                    total += block.size * sizeof(Slot);
+                }
+                return total;
+            }
+
+            template<typename... Args>
+            T* create(Args&&... args) {
+                return new (allocate(1)) T(std::forward<Args>(args)...);
+            }
+    };
+
+}
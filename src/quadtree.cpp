@@ -1,16 +1,11 @@
 // quadtree.cpp
 
 #include <queue>
+#include <limits>
+#include <algorithm>
 
 #include "quadtree.hpp"
 
-/**
- * These two constants are mutually exclusive:
- *  LEAF_CAPACITY is used for insert-based construction
- *  TARGET_DEPTH is used for bulk loading
- */
-int const LEAF_CAPACITY = 16;
-
 using coord_t = spatial::coord_t;
 using code_t = spatial::code_t;
 using index_t = spatial::index_t;
@@ -19,62 +14,130 @@ using index_t = spatial::index_t;
  * We nudge the maximum bounds of the quadtree by a tiny amount to fix a
  * rare edge case in zorder_hash() where a point is right on the boundary.
  * (a point on the boundary results in a Z-order code outside of the tree)
+ * The curve decides the order in which the leaves' data is laid out.
+ *
+ * Everything the tree keeps (nodes, data, leaf ranges and coordinates) and
+ * the scratch space for its queries is allocated from the memory resource,
+ * e.g., to pin the index to huge pages or NUMA-local memory. Temporaries
+ * used while building it, and whatever T itself allocates, are not.
+ * The resource must outlive the tree.
  */
-template<typename T>
-spatial::Quadtree<T>::Quadtree(coord_t x0, coord_t x1, coord_t y0, coord_t y1):
-    root(std::make_unique<Node>(0, 0, (Rectangle){x0, x1+0.01, y0, y1+0.01}))
+template<typename T, typename S, int D, int L>
+spatial::Quadtree<T, S, D, L>::Quadtree(
+    Rectangle const bounds,
+    Curve const c,
+    std::pmr::memory_resource* const resource
+):
+    nodes(resource),
+    root(nodes.create(0, 0, grow_max(bounds, 0.01))),
+    leaves(resource),
+    data(resource),
+    coords(axis_vectors<MappedVector<S>, D>(resource)),
+    quantiser(root->bounds),
+    curve(c)
 { }
 
-template<typename T>
-spatial::Quadtree<T>::Node::Node(int d, code_t c, Rectangle b): 
+template<typename T, typename S, int D, int L>
+spatial::Quadtree<T, S, D, L>::Quadtree(
+    coord_t x0, coord_t x1, coord_t y0, coord_t y1,
+    Curve const c,
+    std::pmr::memory_resource* const resource
+):
+    Quadtree((Rectangle){{x0, y0}, {x1, y1}}, c, resource)
+{
+    static_assert(D == 2, "Use the Rectangle constructor for D != 2");
+}
+
+template<typename T, typename S, int D, int L>
+spatial::Quadtree<T, S, D, L>::Node::Node(
+    int d, code_t c, Rectangle b, Node* p
+):
     depth(d), 
     code(c), 
     bounds(b), 
-    center(midpoint(b)) 
+    center(midpoint(b)),
+    leaf_range({0, 0}),
+    parent(p),
+    children(nullptr)
 { }
 
 /**
  * Now that we have two methods with which to build the quadtree,
  * we'll use build() as an alias for bulk load, for compatibiliy's sake
  */
-template<typename T>
-void spatial::Quadtree<T>::build(std::vector<T> const& raw_data) {
-    root->insert(*this, datumize<T>(raw_data));
+template<typename T, typename S, int D, int L>
+void spatial::Quadtree<T, S, D, L>::build(std::vector<T> const& raw_data) {
+    data.reserve(raw_data.size());
+    for (auto& axis : coords) axis.reserve(raw_data.size());
+    root->insert(*this, datumize<T, D>(raw_data));
 }
 
 /**
  * Recursively insert a collection of data into the quadtree.
  */
-template<typename T>
-spatial::Range spatial::Quadtree<T>::Node::insert(
-    Quadtree<T>& tree, std::vector<Datum<T>> data
+template<typename T, typename S, int D, int L>
+spatial::Range spatial::Quadtree<T, S, D, L>::Node::insert(
+    Quadtree<T, S, D, L>& tree, std::vector<Datum<T, D>> data
 ) {
-    if (data.size() <= LEAF_CAPACITY) {
-        // Create a new leaf node
+    // (more than L coincident points can't be split up, so past the deepest
+    // level that load() accepts, they share an oversized leaf)
+    if (data.size() <= L || depth >= 64 / D) {
+        // Create a new leaf node, and append its data to the tree's arrays
         index_t const leaf_idx = tree.leaves.size();
         this->leaf_range = {leaf_idx, leaf_idx};
-        tree.leaves.push_back(data); 
+        index_t const data_start = tree.data.size();
+        for (auto const& datum : data) {
+            tree.data.push_back(datum);
+            Point const stored = tree.quantiser.to_storage(datum.point);
+            for (int a = 0; a < D; a++) {
+                tree.coords[a].push_back(tree.quantiser.encode(stored[a]));
+            }
+        }
+        tree.leaves.push_back({data_start, tree.data.size()});
         return {leaf_idx, leaf_idx};
     } else {
-        // Partition the data into four quadrants
-        std::array<std::vector<Datum<T>>, 4> partition;
+        // Partition the data into 2^D quadrants (octants, etc.)
+        std::array<std::vector<Datum<T, D>>, (1 << D)> partition;
         for (auto const& datum : data) {
             int const quadrant = get_quadrant(datum.point);
             partition[quadrant].push_back(datum);
         }
-        // Create 4 child-quadrants and recurse with the appropriate partition
-        this->create_children();
+        // Create the children and recurse with the appropriate partition
+        this->create_children(tree.nodes);
+
+        // Recurse on the children in the order of the tree's curve, so that
+        // their leaves (and data) end up laid out along that curve
+        std::array<int, (1 << D)> order;
+        for (int i = 0; i < (1 << D); i++) order[i] = i;
+        if (tree.curve != Curve::zorder) {
+            std::array<code_t, (1 << D)> keys;
+            for (int i = 0; i < (1 << D); i++) {
+                keys[i] = curve_key(
+                    tree.curve, children[i].center, tree.root->bounds
+                );
+            }
+            std::stable_sort(order.begin(), order.end(),
+                [&keys] (int const a, int const b) {
+                    return keys[a] < keys[b];
+                }
+            );
+        }
 
-        // The NW child will contain the leaf with the lowest Z-order code
-        Range child_leaf_range = children[0]->insert(tree, partition[0]);
+        // The first child will contain the leaf with the lowest curve code
+        int const first = order[0];
+        Range child_leaf_range = children[first].insert(
+            tree, partition[first]
+        );
         this->leaf_range.start = child_leaf_range.start;
 
-        // The leaves in the NE and SW children all fall inside this range
-        children[1]->insert(tree, partition[1]);
-        children[2]->insert(tree, partition[2]);
+        // The leaves in the middle children all fall inside this range
+        for (int i = 1; i < (1 << D) - 1; i++) {
+            children[order[i]].insert(tree, partition[order[i]]);
+        }
 
-        // The SE child will contain the leaf with the highest Z-order code
-        child_leaf_range = children[3]->insert(tree, partition[3]);
+        // The last child will contain the leaf with the highest curve code
+        int const last = order[(1 << D) - 1];
+        child_leaf_range = children[last].insert(tree, partition[last]);
         this->leaf_range.end = child_leaf_range.end;
 
         return this->leaf_range;
@@ -83,73 +146,583 @@ spatial::Range spatial::Quadtree<T>::Node::insert(
 
 /**
  * k-nearest neighbour query using our distance browsing algorithm
+ *
+ * With epsilon > 0, the search stops as soon as no unexplored node can hold
+ * a datum more than (1+epsilon) times closer than the current k'th neighbour,
+ * so every returned neighbour is within (1+epsilon) of the true distance.
+ * If max_visits > 0, at most that many nodes are popped, which caps latency
+ * at the cost of any guarantee (and possibly fewer than k results).
+ */
+template<typename T, typename S, int D, int L>
+std::vector<T> spatial::Quadtree<T, S, D, L>::query_knn(
+    unsigned const k, coord_t const x, coord_t const y,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    static_assert(D == 2, "Use the Point overload of query_knn() for D != 2");
+    return query_knn(k, (Point){{x, y}}, epsilon, max_visits);
+}
+
+template<typename T, typename S, int D, int L>
+std::vector<T> spatial::Quadtree<T, S, D, L>::query_knn(
+    unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    QueryContext context(get_resource());
+    query_knn(context, k, query_point, epsilon, max_visits);
+    return std::move(context.results);
+}
+
+/**
+ * k-NN query using the heaps and result storage of a QueryContext, and
+ * starting from wherever the context's previous query ended.
+ * The results are only valid until the next query with the same context.
+ *
+ * The previous query found k neighbours within some radius r of its query
+ * point p, so the k'th neighbour of the new query point q is no farther than
+ * r + |q - p|. Any node whose bounds contain that ball around q therefore
+ * contains all of q's k-nearest neighbours, so we climb from the previous
+ * leaf to the lowest such ancestor and start the best-first search there,
+ * rather than at the root. When the ball doesn't fit inside the tree at all
+ * (or there's no usable previous query), this is just a regular query.
+ *
+ * For spatially coherent queries (e.g., a scanline traversal, or k-NN for
+ * every point in the tree), the climb is usually only a level or two.
  */
-template<typename T>
-std::vector<T> spatial::Quadtree<T>::query_knn(
-    unsigned const k, coord_t const x, coord_t const y
+template<typename T, typename S, int D, int L>
+std::vector<T> const& spatial::Quadtree<T, S, D, L>::query_knn(
+    QueryContext& context, unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
 ) const {
-    Point const query_point = {x, y};
+    Node* start = root;
+    if (context.tree == this && context.generation == generation
+        && context.leaf && k <= context.k
+    ) {
+        // (padded a little, in case of rounding in the triangle inequality)
+        coord_t const radius = (
+            context.radius + distance(query_point, context.point)
+        ) * (1 + 1e-9);
+        Node* ancestor = context.leaf;
+        while (ancestor
+            && !contains_ball(ancestor->bounds, query_point, radius)
+        ) {
+            ancestor = ancestor->parent;
+        }
+        if (ancestor) start = ancestor;
+    }
+
+    DatumPQ& datum_pq = context.datum_pq;
+    QueryStats& stats = context.stats;
+    stats = {};
+    tally(stats.queries);
+    search(
+        start, query_point, k, epsilon, max_visits,
+        context.node_pq, datum_pq, stats
+    );
+    query_totals.add(stats);
+
+    // Remember the leaf containing the query point, for the next query
+    Node* leaf = start;
+    while (!leaf->is_leaf()) {
+        leaf = &leaf->children[leaf->get_quadrant(query_point)];
+    }
+    context.tree = this;
+    context.generation = generation;
+    context.leaf = leaf;
+    context.point = query_point;
+    context.k = k;
+    // A query which came up short gives us no radius to work with
+    if (datum_pq.size() < k) context.leaf = nullptr;
+    else context.radius = datum_pq.peek().dist;
+
+    // Results go far -> close, assigned over the previous query's results
+    // so that (for a fixed k) their storage gets reused as well
+    std::vector<T>& results = context.results;
+    results.resize(datum_pq.size());
+    for (auto& result : results) {
+        result = datum_pq.pop().datum->data;
+    }
+    return results;
+}
 
-    NodePQ node_pq(query_point);
-    node_pq.push(root.get());
-    DatumPQ datum_pq(query_point);
+/**
+ * The distance browsing loop behind every k-NN query, starting from the
+ * subtree rooted at 'start'. Both priority queues are reset first.
+ */
+template<typename T, typename S, int D, int L>
+void spatial::Quadtree<T, S, D, L>::search(
+    Node* const start,
+    Point const query_point,
+    unsigned const k,
+    coord_t const epsilon,
+    index_t const max_visits,
+    NodePQ& node_pq,
+    DatumPQ& datum_pq,
+    QueryStats& stats
+) const {
+    node_pq.reset(query_point);
+    node_pq.push(start);
+    tally(stats.nodes_pushed);
+    datum_pq.reset(query_point);
 
+    index_t visits = 0;
     while (!node_pq.empty() && (
         datum_pq.size() < k
-        || datum_pq.peek().dist > node_pq.peek().dist
+        || datum_pq.peek().dist > (1 + epsilon) * node_pq.peek().dist
     )) {
+        if (max_visits && visits++ == max_visits) break;
         Node* next_node = node_pq.pop().node;
+        tally(stats.nodes_popped);
         if (next_node->is_leaf()) {
-            for (auto const& datum : leaves[next_node->leaf_range.start]) {
-                if (datum_pq.size() < k) {
-                    datum_pq.push(datum);
-                }
-                else {
-                    datum_pq.choose(datum);
+            scan_leaf(
+                leaves[next_node->leaf_range.start], query_point, k,
+                datum_pq, stats
+            );
+        } else {
+            node_pq.expand(next_node);
+            tally(stats.nodes_pushed, 1 << D);
+        }
+    } 
+}
+
+/**
+ * Offer every datum in a leaf to the k-NN priority queue.
+ * Distances are computed in bulk by the SIMD kernel, which filters out
+ * anything farther than the current k'th neighbour before it reaches the heap.
+ */
+template<typename T, typename S, int D, int L>
+void spatial::Quadtree<T, S, D, L>::scan_leaf(
+    Range const leaf,
+    Point const query_point,
+    unsigned const k,
+    DatumPQ& datum_pq,
+    QueryStats& stats
+) const {
+    tally(stats.leaves_scanned);
+    tally(stats.points_tested, leaf.end - leaf.start);
+    auto const kth_dist2 = [this, &datum_pq, k] () {
+        if (datum_pq.size() < k) {
+            return std::numeric_limits<coord_t>::infinity();
+        }
+        return quantiser.bound2(datum_pq.peek().dist);
+    };
+
+    coord_t bound2 = kth_dist2();
+    filter_block(
+        quantiser.to_storage(query_point),
+        block_pointers(coords, leaf.start),
+        leaf.end - leaf.start,
+        bound2,
+        [&] (index_t const i, coord_t const dist2) {
+            Datum<T, D> const& datum = data[leaf.start + i];
+            // Quantised distances only filter, the heap gets exact ones
+            coord_t const dist = Quantiser<S, D>::exact
+                ? std::sqrt(dist2)
+                : distance(query_point, datum.point);
+            if (datum_pq.size() < k) {
+                datum_pq.push(datum, dist);
+            } else if (datum_pq.choose(datum, dist)) {
+                tally(stats.heap_replacements);
+            }
+            bound2 = kth_dist2();
+        }
+    );
+}
+
+/**
+ * Answer a batch of k-NN queries, with results in the same order as the
+ * queries. Internally, the queries are run in the order of their Morton
+ * (or Hilbert) keys, so that consecutive queries tend to walk the same
+ * nodes and leaves while they're still in cache.
+ */
+template<typename T, typename S, int D, int L>
+std::vector<std::vector<T>> spatial::Quadtree<T, S, D, L>::query_knn_batch(
+    unsigned const k,
+    std::vector<Point> const& query_points,
+    Curve const curve
+) const {
+    // Consecutive queries are close together, so warm start each one
+    QueryContext context(get_resource());
+    std::vector<std::vector<T>> results(query_points.size());
+    for (index_t const i : curve_sort(query_points, curve)) {
+        results[i] = query_knn(context, k, query_points[i]);
+    }
+    return results;
+}
+
+/**
+ * Every datum within 'radius' of (x,y), inclusive, in no particular order.
+ */
+template<typename T, typename S, int D, int L>
+std::vector<T> spatial::Quadtree<T, S, D, L>::query_radius(
+    coord_t const x, coord_t const y, coord_t const radius
+) const {
+    static_assert(
+        D == 2, "Use the Point overload of query_radius() for D != 2"
+    );
+    return query_radius((Point){{x, y}}, radius);
+}
+
+/**
+ * A depth-first walk of the nodes which touch the ball, with the leaves
+ * filtered by the same SIMD kernel as k-NN leaf scans, but against a fixed
+ * bound. As with k-NN queries, the kernel's (possibly quantised) distances
+ * only filter, and the results are decided at full precision.
+ */
+template<typename T, typename S, int D, int L>
+std::vector<T> spatial::Quadtree<T, S, D, L>::query_radius(
+    Point const center, coord_t const radius
+) const {
+    std::vector<T> results;
+    if (data.empty() || !(radius >= 0)) return results;
+
+    // The kernel's squared distances may round differently to distance()
+    // (and it only keeps points strictly inside), so its bound is padded,
+    // and whatever passes is checked again
+    coord_t const bound2 = std::nextafter(
+        quantiser.bound2(radius) * (1 + 1e-9),
+        std::numeric_limits<coord_t>::infinity()
+    );
+    Point const stored_center = quantiser.to_storage(center);
+    std::vector<Node*> stack = {root};
+    while (!stack.empty()) {
+        Node* const node = stack.back();
+        stack.pop_back();
+        if (distance(center, node->bounds) > radius) continue;
+        if (!node->is_leaf()) {
+            for (int i = 0; i < (1 << D); i++) {
+                stack.push_back(&node->children[i]);
+            }
+            continue;
+        }
+
+        Range const leaf = leaves[node->leaf_range.start];
+        coord_t leaf_bound2 = bound2;
+        filter_block(
+            stored_center,
+            block_pointers(coords, leaf.start),
+            leaf.end - leaf.start,
+            leaf_bound2,
+            [&] (index_t const i, coord_t) {
+                Datum<T, D> const& datum = data[leaf.start + i];
+                if (distance(center, datum.point) <= radius) {
+                    results.push_back(datum.data);
                 }
             }
+        );
+    }
+    return results;
+}
+
+/**
+ * Start an incremental k-NN query around (x,y).
+ * Unlike query_knn(), k doesn't need to be known up front.
+ */
+template<typename T, typename S, int D, int L>
+typename spatial::Quadtree<T, S, D, L>::Cursor
+spatial::Quadtree<T, S, D, L>::browse(coord_t const x, coord_t const y) const {
+    static_assert(D == 2, "Use the Point overload of browse() for D != 2");
+    return browse((Point){{x, y}});
+}
+
+template<typename T, typename S, int D, int L>
+typename spatial::Quadtree<T, S, D, L>::Cursor
+spatial::Quadtree<T, S, D, L>::browse(Point const p) const {
+    return Cursor(*this, p);
+}
+
+template<typename T, typename S, int D, int L>
+spatial::Quadtree<T, S, D, L>::Cursor::Cursor(
+    Quadtree<T, S, D, L> const& t, Point p
+):
+    tree(t),
+    origin(p),
+    node_pq(p, tree.get_resource()),
+    datum_pq(Closer(), tree.get_resource())
+{
+    node_pq.push(tree.root);
+}
+
+/**
+ * Expand nodes until the closest buffered datum is at least as close as
+ * every unexplored node, i.e., until it's safe to yield that datum.
+ */
+template<typename T, typename S, int D, int L>
+void spatial::Quadtree<T, S, D, L>::Cursor::advance() {
+    while (!node_pq.empty() && (
+        datum_pq.empty()
+        || datum_pq.top().dist > node_pq.peek().dist
+    )) {
+        Node* next_node = node_pq.pop().node;
+        if (next_node->is_leaf()) {
+            Range const leaf = tree.leaves[next_node->leaf_range.start];
+            for (index_t i = leaf.start; i < leaf.end; i++) {
+                Datum<T, D> const& datum = tree.data[i];
+                datum_pq.push((Element){datum, distance(origin, datum.point)});
+            }
         } else {
             node_pq.expand(next_node);
         }
-    } 
+    }
+}
+
+template<typename T, typename S, int D, int L>
+bool spatial::Quadtree<T, S, D, L>::Cursor::empty() {
+    advance();
+    return datum_pq.empty();
+}
+
+/**
+ * Distance to the datum which will be returned by the next call to next().
+ * Assumes the cursor isn't empty.
+ */
+template<typename T, typename S, int D, int L>
+coord_t spatial::Quadtree<T, S, D, L>::Cursor::peek_dist() {
+    advance();
+    return datum_pq.top().dist;
+}
+
+template<typename T, typename S, int D, int L>
+T spatial::Quadtree<T, S, D, L>::Cursor::next() {
+    advance();
+    T const nearest = datum_pq.top().datum.data;
+    datum_pq.pop();
+    return nearest;
+}
 
-    std::vector<T> query_bucket;
-    query_bucket.reserve(k);
-    while (!datum_pq.empty()) {
-        query_bucket.push_back(datum_pq.pop().datum.data);
+/**
+ * Bit a of the quadrant index is set if p is in the upper half along axis a,
+ * so in 2d the quadrants are numbered SW, SE, NW, NE (i.e., Z-order).
+ */
+template<typename T, typename S, int D, int L>
+int spatial::Quadtree<T, S, D, L>::Node::get_quadrant(Point const p) const {
+    int quadrant = 0;
+    for (int a = 0; a < D; a++) {
+        quadrant |= (p[a] > center[a]) << a;
     }
-    return query_bucket;
+    return quadrant;
 }
 
 /**
- * A note on the differing comparison operators: Z-ordering 0 is to the NW,
- * but the geographic coordinate (0,0) is in the SW. So, while it looks weird,
- * this is just converting from geographic coordinates to Z-ordering.
+ * Save the tree as an index file (see storage.hpp), which load() can map
+ * straight back in. The nodes are saved in preorder, children in index
+ * order, and only need their leaf ranges: everything else about a node
+ * follows from its position in the tree.
+ * Returns false if the file couldn't be written.
  */
-template<typename T>
-int spatial::Quadtree<T>::Node::get_quadrant(Point const p) const {
-    return ((p.x > center.x) + ((p.y > center.y) << 1));
+template<typename T, typename S, int D, int L>
+bool spatial::Quadtree<T, S, D, L>::save(std::string const& path) const {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Only trivially copyable data can be saved"
+    );
+    std::vector<Range> node_ranges;
+    std::vector<Node const*> stack = {root};
+    while (!stack.empty()) {
+        Node const* const node = stack.back();
+        stack.pop_back();
+        node_ranges.push_back(node->leaf_range);
+        if (!node->is_leaf()) {
+            for (int i = (1 << D) - 1; i >= 0; i--) {
+                stack.push_back(&node->children[i]);
+            }
+        }
+    }
+    FileMeta const meta = {root->bounds, static_cast<uint64_t>(curve)};
+
+    IndexWriter writer;
+    writer.add(&meta, 1);
+    writer.add(node_ranges.data(), node_ranges.size());
+    writer.add(leaves.data(), leaves.size());
+    writer.add(data.data(), data.size());
+    for (auto const& axis : coords) writer.add(axis.data(), axis.size());
+    return writer.write(path, FileHeader::describe(
+        IndexKind::quadtree, D, sizeof(S), sizeof(Datum<T, D>), 4 + D
+    ));
 }
 
-template<typename T>
-int spatial::Quadtree<T>::num_leaves() const { return leaves.size(); }
+/**
+ * Replace the tree with one saved by save(). The leaves, data and
+ * coordinates are mapped rather than read, so this only has to rebuild the
+ * nodes (a small fraction of the file), and the rest is paged in on demand.
+ * The file stays mapped for the lifetime of the tree (or until a later
+ * modification copies an array out of it), and mustn't be changed meanwhile.
+ *
+ * Returns false, leaving the tree as it was, if the file is missing, corrupt
+ * or was saved from a different type of tree. With verify, the checksum over
+ * the whole file is checked as well, which means reading all of it.
+ */
+template<typename T, typename S, int D, int L>
+bool spatial::Quadtree<T, S, D, L>::load(
+    std::string const& path, bool const verify
+) {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Only trivially copyable data can be loaded"
+    );
+    auto file = IndexFile::open(path, FileHeader::describe(
+        IndexKind::quadtree, D, sizeof(S), sizeof(Datum<T, D>), 4 + D
+    ), verify);
+    if (!file) return false;
 
-template<typename T>
-void spatial::Quadtree<T>::Node::create_children() {
-    Rectangle const SW_bounds = {bounds.xmin, center.x, bounds.ymin, center.y};
-    children[0] = std::make_unique<Node>(depth+1, (code << 2) + 0, SW_bounds);
+    auto const [meta, num_meta] = file->section<FileMeta>(0);
+    auto const [node_ranges, num_nodes] = file->section<Range>(1);
+    auto const [leaf_ranges, num_leaves] = file->section<Range>(2);
+    auto const [datums, num_data] = file->section<Datum<T, D>>(3);
+    if (num_meta != 1 || num_nodes == 0 || !leaf_ranges || !datums) {
+        return false;
+    }
+    std::array<S const*, D> axes;
+    for (int a = 0; a < D; a++) {
+        auto const [axis, num_coords] = file->section<S>(4 + a);
+        if (num_coords != num_data) return false;
+        axes[a] = axis;
+    }
+    for (index_t i = 0; i < num_leaves; i++) {
+        Range const leaf = leaf_ranges[i];
+        if (leaf.start > leaf.end || leaf.end > num_data) return false;
+    }
 
-    Rectangle const SE_bounds = {center.x, bounds.xmax, bounds.ymin, center.y};
-    children[1] = std::make_unique<Node>(depth+1, (code << 2) + 1, SE_bounds);
+    // Rebuild the nodes off to the side, in case the file doesn't add up
+    Arena<Node> new_nodes(get_resource());
+    Node* const new_root = new_nodes.create(0, 0, meta->bounds);
+    index_t next_node = 0;
+    if (!restore_nodes(
+            new_root, new_nodes, node_ranges, num_nodes, num_leaves, next_node
+        ) || next_node != num_nodes
+    ) {
+        return false;
+    }
 
-    Rectangle const NW_bounds = {bounds.xmin, center.x, center.y, bounds.ymax};
-    children[2] = std::make_unique<Node>(depth+1, (code << 2) + 2, NW_bounds);
+    nodes.swap(new_nodes);
+    root = new_root;
+    generation = new_generation();  // (warm starts hold the old nodes)
+    leaves.map(leaf_ranges, num_leaves);
+    data.map(datums, num_data);
+    for (int a = 0; a < D; a++) coords[a].map(axes[a], num_data);
+    quantiser = Quantiser<S, D>(root->bounds);
+    curve = static_cast<Curve>(meta->curve);
+    mapping = file->release();
+    return true;
+}
+
+/**
+ * Recreate a node (and its subtree) from the preorder node array written by
+ * save(), checking that the ranges are consistent with the leaves as we go.
+ */
+template<typename T, typename S, int D, int L>
+bool spatial::Quadtree<T, S, D, L>::restore_nodes(
+    Node* const node,
+    Arena<Node>& arena,
+    Range const* const node_ranges,
+    index_t const num_nodes,
+    index_t const num_leaves,
+    index_t& next_node
+) {
+    if (next_node == num_nodes) return false;
+    node->leaf_range = node_ranges[next_node++];
+    Range const range = node->leaf_range;
+    if (node->is_leaf()) {
+        // (a tree which was never built has one leaf, and no leaf ranges)
+        return (range.start < num_leaves || num_leaves == 0);
+    }
+    if (range.start > range.end || range.end >= num_leaves) return false;
+    if (node->depth >= 64 / D) return false;  // codes would overflow
+
+    node->create_children(arena);
+    for (int i = 0; i < (1 << D); i++) {
+        if (!restore_nodes(
+            &node->children[i], arena,
+            node_ranges, num_nodes, num_leaves, next_node
+        )) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename T, typename S, int D, int L>
+int spatial::Quadtree<T, S, D, L>::num_leaves() const { return leaves.size(); }
+
+/**
+ * Verify that every leaf holds no more than L points, unless it sits at the
+ * deepest level, where build() stops splitting (so that the codes don't
+ * overflow) however many points are left.
+ */
+template<typename T, typename S, int D, int L>
+bool spatial::Quadtree<T, S, D, L>::check_leaves() const {
+    if (leaves.size() == 0) return true;  // (never built)
+    std::vector<Node const*> stack = {root};
+    while (!stack.empty()) {
+        Node const* const node = stack.back();
+        stack.pop_back();
+        if (!node->is_leaf()) {
+            for (int i = 0; i < (1 << D); i++) {
+                stack.push_back(&node->children[i]);
+            }
+            continue;
+        }
+        Range const leaf = leaves[node->leaf_range.start];
+        if (leaf.end - leaf.start > L && node->depth < 64 / D) return false;
+    }
+    return true;
+}
 
-    Rectangle const NE_bounds = {center.x, bounds.xmax, center.y, bounds.ymax};
-    children[3] = std::make_unique<Node>(depth+1, (code << 2) + 3, NE_bounds);
+/**
+ * The memory resource which all of the index's internal storage comes from.
+ */
+template<typename T, typename S, int D, int L>
+std::pmr::memory_resource* spatial::Quadtree<T, S, D, L>::get_resource() const {
+    return data.get_allocator().resource();
+}
+
+/**
+ * Roughly how much memory the tree holds: its nodes, data, leaf ranges and
+ * coordinates (by capacity), plus the whole file for a loaded tree, though
+ * only the pages which queries have touched are actually resident.
+ * Anything which T itself allocates isn't counted.
+ */
+template<typename T, typename S, int D, int L>
+std::size_t spatial::Quadtree<T, S, D, L>::memory_bytes() const {
+    std::size_t total = sizeof(*this) + nodes.bytes() + leaves.bytes()
+        + data.bytes();
+    for (auto const& axis : coords) total += axis.bytes();
+    if (mapping) total += mapping->size();
+    return total;
+}
+
+/**
+ * The work done by every k-NN query on this tree since it was created (or
+ * since reset_stats()), on any thread. Always zero without -DSPATIAL_STATS.
+ * The per-query stats are in each query's QueryContext.
+ */
+template<typename T, typename S, int D, int L>
+spatial::QueryStats spatial::Quadtree<T, S, D, L>::get_stats() const {
+    return query_totals.get();
+}
+
+template<typename T, typename S, int D, int L>
+void spatial::Quadtree<T, S, D, L>::reset_stats() {
+    query_totals.reset();
+}
+
+template<typename T, typename S, int D, int L>
+void spatial::Quadtree<T, S, D, L>::Node::create_children(Arena<Node>& nodes) {
+    // The siblings are allocated as one group, in child index order
+    children = nodes.allocate(1 << D);
+    for (int i = 0; i < (1 << D); i++) {
+        Rectangle child_bounds = bounds;
+        for (int a = 0; a < D; a++) {
+            if ((i >> a) & 1) {
+                child_bounds.min[a] = center[a];
+            } else {
+                child_bounds.max[a] = center[a];
+            }
+        }
+        new (&children[i]) Node(depth+1, (code << D) + i, child_bounds, this);
+    }
 }
 
-template<typename T>
-bool spatial::Quadtree<T>::Node::is_leaf() const { 
+template<typename T, typename S, int D, int L>
+bool spatial::Quadtree<T, S, D, L>::Node::is_leaf() const { 
     return (leaf_range.start == leaf_range.end);
 }
@@ -1,59 +1,217 @@
 // rtree.cpp
 
 #include <memory>
+#include <limits>
+#include <algorithm>
 
 #include "rtree.hpp"
 
 using coord_t = spatial::coord_t;
+using code_t = spatial::code_t;
 using area_t = spatial::area_t;
 using index_t = spatial::index_t;
 
-int const M = 8;
-
-template<typename T>
-spatial::Rtree<T>::Rtree():
+/**
+ * Everything the tree keeps (nodes, entries, data and packed MBBs) and the
+ * scratch space for its queries is allocated from the memory resource,
+ * which must outlive the tree. Temporaries used while building it, and
+ * whatever T itself allocates, are not.
+ */
+template<typename T, int D, int M>
+spatial::Rtree<T, D, M>::Rtree(std::pmr::memory_resource* const resource):
     root_entry(std::make_unique<Entry>(
-        (Rectangle){0,0,0,0}, 
-        std::make_shared<Node>()
-    ))
+        (Rectangle){}, 
+        make_node(resource)
+    )),
+    data(resource),
+    packed(false)
 { }
 
-template<typename T>
-spatial::Rtree<T>::~Rtree() { }
+template<typename T, int D, int M>
+spatial::Rtree<T, D, M>::~Rtree() { }
 
-template<typename T>
-spatial::Rtree<T>::Node::Node(): 
-    load(0)
+template<typename T, int D, int M>
+spatial::Rtree<T, D, M>::Node::Node(
+    std::pmr::memory_resource* const resource
+):
+    load(0),
+    entries(resource),
+    packed_mbbs(nullptr)
 { }
 
-template<typename T>
-spatial::Rtree<T>::Node::~Node() { }
+/**
+ * Nodes and data are shared between entries, so their control blocks come
+ * from the memory resource along with them.
+ */
+template<typename T, int D, int M>
+std::shared_ptr<typename spatial::Rtree<T, D, M>::Node>
+spatial::Rtree<T, D, M>::make_node(std::pmr::memory_resource* const resource) {
+    return std::allocate_shared<Node>(
+        std::pmr::polymorphic_allocator<Node>(resource), resource
+    );
+}
+
+template<typename T, int D, int M>
+std::shared_ptr<spatial::Datum<T, D>> spatial::Rtree<T, D, M>::make_datum(
+    Datum<T, D> const& datum, std::pmr::memory_resource* const resource
+) {
+    return std::allocate_shared<Datum<T, D>>(
+        std::pmr::polymorphic_allocator<Datum<T, D>>(resource), datum
+    );
+}
+
+template<typename T, int D, int M>
+std::pmr::memory_resource* spatial::Rtree<T, D, M>::get_resource() const {
+    return data.get_allocator().resource();
+}
+
+/**
+ * Roughly how much memory the tree holds: its nodes, their entries and
+ * packed MBBs, and the data (both the sorted copy and each leaf entry's),
+ * by capacity. The shared_ptr control blocks and any allocator overhead
+ * aren't counted, nor is anything which T itself allocates.
+ */
+template<typename T, int D, int M>
+std::size_t spatial::Rtree<T, D, M>::memory_bytes() const {
+    std::size_t total = sizeof(*this) + sizeof(Entry)
+        + data.capacity() * sizeof(Datum<T, D>);
+    std::vector<Node const*> stack = {root_entry->get_node().get()};
+    while (!stack.empty()) {
+        Node const& node = *stack.back();
+        stack.pop_back();
+        total += sizeof(Node) + node.entries.capacity() * sizeof(Entry);
+        if (node.packed_mbbs) total += sizeof(RectangleBlock<D, M>);
+        for (auto const& entry : node.entries) {
+            if (entry.is_leaf_entry()) {
+                total += sizeof(Datum<T, D>);
+            } else {
+                stack.push_back(entry.get_node().get());
+            }
+        }
+    }
+    return total;
+}
+
+/**
+ * The work done by every k-NN query on this tree since it was created (or
+ * since reset_stats()), on any thread. Always zero without -DSPATIAL_STATS.
+ * The per-query stats are in each query's QueryContext.
+ */
+template<typename T, int D, int M>
+spatial::QueryStats spatial::Rtree<T, D, M>::get_stats() const {
+    return query_totals.get();
+}
+
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::reset_stats() {
+    query_totals.reset();
+}
+
+template<typename T, int D, int M>
+spatial::Rtree<T, D, M>::Node::~Node() {
+    if (packed_mbbs) {
+        std::pmr::polymorphic_allocator<RectangleBlock<D, M>>(
+            entries.get_allocator().resource()
+        ).deallocate(packed_mbbs, 1);
+    }
+}
 
 /**
  * Construct an R-tree from the given point data.
  * Currently, this is just doing point-by-point insertion
  */
-template<typename T>
-void spatial::Rtree<T>::build(std::vector<T> const& raw_data) {
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::build(std::vector<T> const& raw_data) {
+    std::vector<Datum<T, D>> const new_data = datumize<T, D>(raw_data);
+
     // Pick an inital bounding box for the root
-    Rectangle initial_seed = {
-        raw_data[0][0], raw_data[0][0],
-        raw_data[0][1], raw_data[0][1]
-    };
+    Rectangle const initial_seed = {new_data[0].point, new_data[0].point};
     root_entry->set_mbb(initial_seed);
 
     // Insert each data point into the R-tree
     data.reserve(raw_data.size());
-    for (auto const& raw_datum : raw_data) {
-        Point const new_point = {raw_datum[0], raw_datum[1]};
-        Datum<T> const new_datum = {raw_datum, new_point};
+    for (auto const& new_datum : new_data) {
         insert(new_datum);
     } 
 }
 
-template<typename T>
-void spatial::Rtree<T>::insert(Datum<T> const& new_datum) {
+/**
+ * Bulk load an R-tree by sorting the data along a space filling curve, then
+ * packing runs of M consecutive points into full leaves (and runs of M
+ * consecutive nodes into full parents, and so on up to the root).
+ * Along a Hilbert curve each run stays spatially compact, which gives much
+ * tighter MBBs than point-by-point insertion, in a fraction of the time.
+ * This replaces anything which was already in the tree.
+ */
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::bulk_load(
+    std::vector<T> const& raw_data, Curve const curve
+) {
+    std::vector<Datum<T, D>> const new_data = datumize<T, D>(raw_data);
+    if (new_data.empty()) return;
+
+    Rectangle bounds = {new_data[0].point, new_data[0].point};
+    for (auto const& datum : new_data) {
+        bounds = min_bounding_box(bounds, datum.point);
+    }
+
+    // Sort by curve key, falling back on the input order to break ties
+    std::vector<std::pair<code_t, index_t>> keys;
+    keys.reserve(new_data.size());
+    for (index_t i = 0; i < new_data.size(); i++) {
+        keys.push_back({curve_key(curve, new_data[i].point, bounds), i});
+    }
+    std::sort(keys.begin(), keys.end());
+
+    data.clear();
+    data.reserve(new_data.size());
+    for (auto const& key : keys) {
+        data.push_back(new_data[key.second]);
+    }
+
+    // The leaf level
+    std::vector<Entry> level;
+    for (index_t start = 0; start < data.size(); start += M) {
+        auto const node = make_node(get_resource());
+        Rectangle mbb = {data[start].point, data[start].point};
+        index_t const end = std::min<index_t>(start + M, data.size());
+        for (index_t i = start; i < end; i++) {
+            Point const p = data[i].point;
+            node->entries.push_back(Entry(
+                (Rectangle){p, p},
+                make_datum(data[i], get_resource())
+            ));
+            mbb = min_bounding_box(mbb, p);
+            node->load++;
+        }
+        level.push_back(Entry(mbb, node));
+    }
+
+    // Each internal level, until we're left with only the root
+    while (level.size() > 1) {
+        std::vector<Entry> parents;
+        for (index_t start = 0; start < level.size(); start += M) {
+            auto const node = make_node(get_resource());
+            Rectangle mbb = level[start].get_mbb();
+            index_t const end = std::min<index_t>(start + M, level.size());
+            for (index_t i = start; i < end; i++) {
+                node->entries.push_back(level[i]);
+                mbb = min_bounding_box(mbb, level[i].get_mbb());
+                node->load += level[i].get_node()->load;
+            }
+            parents.push_back(Entry(mbb, node));
+        }
+        level.swap(parents);
+    }
+
+    root_entry = std::make_unique<Entry>(level[0]);
+    packed = false;
+}
+
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::insert(Datum<T, D> const& new_datum) {
     data.push_back(new_datum);
+    packed = false;  // any packed MBBs are now stale
 
     // Expand the root's bounding box if necessary
     root_entry->set_mbb(min_bounding_box(
@@ -68,40 +226,449 @@ void spatial::Rtree<T>::insert(Datum<T> const& new_datum) {
 
 /**
  * Greedy k-NN query using distance browsing.
+ *
+ * With epsilon > 0, the search stops as soon as no unexplored entry can hold
+ * a datum more than (1+epsilon) times closer than the current k'th neighbour,
+ * so every returned neighbour is within (1+epsilon) of the true distance.
+ * If max_visits > 0, at most that many entries are popped, which caps latency
+ * at the cost of any guarantee (and possibly fewer than k results).
  */
-template<typename T>
-std::vector<T> spatial::Rtree<T>::query_knn(
-    unsigned const k, coord_t const x, coord_t const y
+template<typename T, int D, int M>
+std::vector<T> spatial::Rtree<T, D, M>::query_knn(
+    unsigned const k, coord_t const x, coord_t const y,
+    coord_t const epsilon, index_t const max_visits
 ) const {
-    Point const query_point = {x,y};
+    static_assert(D == 2, "Use the Point overload of query_knn() for D != 2");
+    return query_knn(k, (Point){{x, y}}, epsilon, max_visits);
+}
 
-    EntryPQ entry_pq(query_point);
-    entry_pq.push(*root_entry);
-    DatumPQ datum_pq(query_point);
+template<typename T, int D, int M>
+std::vector<T> spatial::Rtree<T, D, M>::query_knn(
+    unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    QueryContext context(get_resource());
+    query_knn(context, k, query_point, epsilon, max_visits);
+    return std::move(context.results);
+}
 
-    while (
+/**
+ * k-NN query using the heaps and result storage of a QueryContext.
+ * The results are only valid until the next query with the same context.
+ */
+template<typename T, int D, int M>
+std::vector<T> const& spatial::Rtree<T, D, M>::query_knn(
+    QueryContext& context, unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    EntryPQ& entry_pq = context.entry_pq;
+    entry_pq.reset(query_point);
+    entry_pq.push(*root_entry);
+    DatumPQ& datum_pq = context.datum_pq;
+    datum_pq.reset(query_point);
+    QueryStats& stats = context.stats;
+    stats = {};
+    tally(stats.queries);
+    tally(stats.nodes_pushed);
+
+    index_t visits = 0;
+    while (!entry_pq.empty() && (
         datum_pq.size() < k
-        || datum_pq.peek().dist > entry_pq.peek().dist
-    ) {
-        Entry const next_entry = entry_pq.pop().entry;
-        if (next_entry.get_node()->is_leaf()) {
-            for (auto const& leaf_entry : next_entry.get_node()->entries) {
+        || datum_pq.peek().dist > (1 + epsilon) * entry_pq.peek().dist
+    )) {
+        if (max_visits && visits++ == max_visits) break;
+        Entry const& next_entry = *entry_pq.pop().entry;
+        Node const& next_node = *next_entry.get_node();
+        tally(stats.nodes_popped);
+        if (packed) {
+            expand_packed(
+                next_node, query_point, k, epsilon, entry_pq, datum_pq, stats
+            );
+        } else if (next_node.is_leaf()) {
+            tally(stats.leaves_scanned);
+            tally(stats.points_tested, next_node.entries.size());
+            for (auto const& leaf_entry : next_node.entries) {
                 if (datum_pq.size() < k) {
                     datum_pq.push(*(leaf_entry.get_datum()));
-                } else {
-                    datum_pq.choose(*(leaf_entry.get_datum()));
+                } else if (datum_pq.choose(*(leaf_entry.get_datum()))) {
+                    tally(stats.heap_replacements);
                 } 
             }
         } else {
             entry_pq.expand(next_entry);
+            tally(stats.nodes_pushed, next_node.entries.size());
+        }
+    }
+    query_totals.add(stats);
+
+    // Far -> close, reusing the previous query's result storage
+    std::vector<T>& results = context.results;
+    results.resize(datum_pq.size());
+    for (auto& result : results) {
+        result = datum_pq.pop().datum->data;
+    }
+    return results;
+}
+
+/**
+ * Switch to the packed query mode, in which every node keeps a copy of its
+ * entries' MBBs in structure-of-arrays layout. Node expansion can then
+ * compute all of the children's distances in one SIMD pass, and drop any
+ * child which can't beat the current k'th neighbour before it's ever pushed.
+ *
+ * Inserting into the R-tree afterwards switches back to the regular mode,
+ * so pack() should be called again once the tree is done changing.
+ */
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::pack() {
+    root_entry->get_node()->pack();
+    packed = true;
+}
+
+/**
+ * Unpacked nodes don't carry a block at all, so one is allocated the first
+ * time a node is packed, and reused from then on.
+ */
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::Node::pack() {
+    if (!packed_mbbs) {
+        packed_mbbs = new (
+            std::pmr::polymorphic_allocator<RectangleBlock<D, M>>(
+                entries.get_allocator().resource()
+            ).allocate(1)
+        ) RectangleBlock<D, M>();
+    }
+    packed_mbbs->clear();
+    for (auto const& entry : entries) {
+        packed_mbbs->push_back(entry.get_mbb());
+        if (!entry.is_leaf_entry()) {
+            entry.get_node()->pack();
+        }
+    }
+}
+
+/**
+ * Save the tree as an index file (see storage.hpp): a record per node, in
+ * preorder, and the data in the order that it appears in the leaves.
+ * Returns false if the file couldn't be written.
+ */
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::save(std::string const& path) const {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Only trivially copyable data can be saved"
+    );
+    std::vector<NodeRecord> records;
+    std::vector<Datum<T, D>> datums;
+    datums.reserve(get_load());
+    std::vector<Entry const*> stack = {root_entry.get()};
+    while (!stack.empty()) {
+        Entry const* const entry = stack.back();
+        stack.pop_back();
+        Node const& node = *entry->get_node();
+        records.push_back({
+            entry->get_mbb(), node.entries.size(), node.is_leaf()
+        });
+        if (node.is_leaf()) {
+            for (auto const& child : node.entries) {
+                datums.push_back(*child.get_datum());
+            }
+        } else {
+            for (auto child = node.entries.rbegin();
+                child != node.entries.rend(); child++
+            ) {
+                stack.push_back(&*child);
+            }
+        }
+    }
+    FileMeta const meta = {packed};
+
+    IndexWriter writer;
+    writer.add(&meta, 1);
+    writer.add(records.data(), records.size());
+    writer.add(datums.data(), datums.size());
+    return writer.write(path, FileHeader::describe(
+        IndexKind::rtree, D, sizeof(coord_t), sizeof(Datum<T, D>), 3
+    ));
+}
+
+/**
+ * Replace the tree with one saved by save().
+ * Unlike the quadtree and Z-grid, the R-tree is rebuilt from the file
+ * rather than mapped, since its nodes and data are individually allocated
+ * (and shared) objects. That's still a single linear pass, with none of the
+ * sorting or splitting of building the tree from scratch.
+ *
+ * Returns false, leaving the tree as it was, if the file is missing, corrupt
+ * or was saved from a different type of tree. With verify, the checksum over
+ * the whole file is checked as well.
+ */
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::load(std::string const& path, bool const verify) {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Only trivially copyable data can be loaded"
+    );
+    auto const file = IndexFile::open(path, FileHeader::describe(
+        IndexKind::rtree, D, sizeof(coord_t), sizeof(Datum<T, D>), 3
+    ), verify);
+    if (!file) return false;
+
+    auto const [meta, num_meta] = file->section<FileMeta>(0);
+    auto const [records, num_records] = file->section<NodeRecord>(1);
+    auto const [datums, num_data] = file->section<Datum<T, D>>(2);
+    if (num_meta != 1 || num_records == 0 || !datums) return false;
+
+    index_t next_record = 0;
+    index_t next_datum = 0;
+    auto const root_node = restore_node(
+        records, num_records, datums, num_data,
+        next_record, next_datum, get_resource()
+    );
+    if (!root_node || next_record != num_records || next_datum != num_data) {
+        return false;
+    }
+
+    root_entry = std::make_unique<Entry>(records[0].mbb, root_node);
+    data.assign(datums, datums + num_data);
+    packed = false;
+    if (meta->packed) pack();
+    return true;
+}
+
+/**
+ * Recreate a node (and its subtree) from the preorder records written by
+ * save(), or return nullptr if the records don't describe a valid tree.
+ */
+template<typename T, int D, int M>
+std::shared_ptr<typename spatial::Rtree<T, D, M>::Node>
+spatial::Rtree<T, D, M>::restore_node(
+    NodeRecord const* const records,
+    index_t const num_records,
+    Datum<T, D> const* const datums,
+    index_t const num_data,
+    index_t& next_record,
+    index_t& next_datum,
+    std::pmr::memory_resource* const resource
+) {
+    if (next_record == num_records) return nullptr;
+    NodeRecord const record = records[next_record++];
+    if (record.num_entries > M || (!record.is_leaf && !record.num_entries)) {
+        return nullptr;
+    }
+
+    auto const node = make_node(resource);
+    node->entries.reserve(record.num_entries);
+    for (uint64_t i = 0; i < record.num_entries; i++) {
+        if (record.is_leaf) {
+            if (next_datum == num_data) return nullptr;
+            Datum<T, D> const& datum = datums[next_datum++];
+            node->entries.push_back(Entry(
+                (Rectangle){datum.point, datum.point},
+                make_datum(datum, resource)
+            ));
+            node->load++;
+        } else {
+            index_t const child_record = next_record;
+            auto const child = restore_node(
+                records, num_records, datums, num_data,
+                next_record, next_datum, resource
+            );
+            if (!child) return nullptr;
+            node->entries.push_back(Entry(records[child_record].mbb, child));
+            node->load += child->load;
         }
     }
-    std::vector<T> query_bucket;
-    query_bucket.reserve(k);
-    while (!datum_pq.empty()) {
-        query_bucket.push_back(datum_pq.pop().datum.data);
+    return node;
+}
+
+/**
+ * Packed mode node expansion. For leaf nodes the "MBBs" are just the data
+ * points, so the same kernel doubles as a filtered leaf scan.
+ */
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::expand_packed(
+    Node const& node,
+    Point const query_point,
+    unsigned const k,
+    coord_t const epsilon,
+    EntryPQ& entry_pq,
+    DatumPQ& datum_pq,
+    QueryStats& stats
+) const {
+    auto const kth_dist = [&datum_pq, k] () {
+        if (datum_pq.size() < k) {
+            return std::numeric_limits<coord_t>::infinity();
+        }
+        return datum_pq.peek().dist;
+    };
+
+    if (node.is_leaf()) {
+        tally(stats.leaves_scanned);
+        tally(stats.points_tested, node.entries.size());
+        coord_t bound2 = kth_dist() * kth_dist();
+        mindist_block(query_point, *node.packed_mbbs, bound2,
+            [&] (index_t const i, coord_t const dist2) {
+                Datum<T, D> const& datum = *(node.entries[i].get_datum());
+                if (datum_pq.size() < k) {
+                    datum_pq.push(datum, std::sqrt(dist2));
+                } else if (datum_pq.choose(datum, std::sqrt(dist2))) {
+                    tally(stats.heap_replacements);
+                }
+                bound2 = kth_dist() * kth_dist();
+            }
+        );
+    } else {
+        // A child is only worth visiting if it passes the query's stop test
+        coord_t const bound = kth_dist() / (1 + epsilon);
+        coord_t bound2 = bound * bound;
+        mindist_block(query_point, *node.packed_mbbs, bound2,
+            [&] (index_t const i, coord_t const dist2) {
+                entry_pq.push(node.entries[i], std::sqrt(dist2));
+                tally(stats.nodes_pushed);
+            }
+        );
+    }
+}
+
+/**
+ * Answer a batch of k-NN queries, with results in the same order as the
+ * queries. Internally, the queries are run in the order of their Morton
+ * (or Hilbert) keys, so that consecutive queries tend to walk the same
+ * nodes and leaves while they're still in cache.
+ */
+template<typename T, int D, int M>
+std::vector<std::vector<T>> spatial::Rtree<T, D, M>::query_knn_batch(
+    unsigned const k,
+    std::vector<Point> const& query_points,
+    Curve const curve
+) const {
+    QueryContext context(get_resource());
+    std::vector<std::vector<T>> results(query_points.size());
+    for (index_t const i : curve_sort(query_points, curve)) {
+        results[i] = query_knn(context, k, query_points[i]);
     }
-    return query_bucket;
+    return results;
+}
+
+/**
+ * Every datum within 'radius' of (x,y), inclusive, in no particular order.
+ */
+template<typename T, int D, int M>
+std::vector<T> spatial::Rtree<T, D, M>::query_radius(
+    coord_t const x, coord_t const y, coord_t const radius
+) const {
+    static_assert(
+        D == 2, "Use the Point overload of query_radius() for D != 2"
+    );
+    return query_radius((Point){{x, y}}, radius);
+}
+
+/**
+ * A depth-first walk of the entries whose MBBs touch the ball. This works
+ * the same whether or not the tree is packed.
+ */
+template<typename T, int D, int M>
+std::vector<T> spatial::Rtree<T, D, M>::query_radius(
+    Point const center, coord_t const radius
+) const {
+    std::vector<T> results;
+    if (!(radius >= 0)) return results;
+
+    std::vector<Node const*> stack = {root_entry->get_node().get()};
+    while (!stack.empty()) {
+        Node const& node = *stack.back();
+        stack.pop_back();
+        for (auto const& entry : node.entries) {
+            if (entry.is_leaf_entry()) {
+                Datum<T, D> const& datum = *entry.get_datum();
+                if (distance(center, datum.point) <= radius) {
+                    results.push_back(datum.data);
+                }
+            } else if (distance(center, entry.get_mbb()) <= radius) {
+                stack.push_back(entry.get_node().get());
+            }
+        }
+    }
+    return results;
+}
+
+/**
+ * Start an incremental k-NN query around (x,y).
+ * Unlike query_knn(), k doesn't need to be known up front.
+ */
+template<typename T, int D, int M>
+typename spatial::Rtree<T, D, M>::Cursor spatial::Rtree<T, D, M>::browse(
+    coord_t const x, coord_t const y
+) const {
+    static_assert(D == 2, "Use the Point overload of browse() for D != 2");
+    return browse((Point){{x, y}});
+}
+
+template<typename T, int D, int M>
+typename spatial::Rtree<T, D, M>::Cursor spatial::Rtree<T, D, M>::browse(
+    Point const p
+) const {
+    return Cursor(*root_entry, p, get_resource());
+}
+
+template<typename T, int D, int M>
+spatial::Rtree<T, D, M>::Cursor::Cursor(
+    Entry const& root, Point p, std::pmr::memory_resource* const resource
+):
+    query_point(p),
+    entry_pq(p, resource),
+    datum_pq(Closer(), resource)
+{
+    entry_pq.push(root);
+}
+
+/**
+ * Expand entries until the closest buffered datum is at least as close as
+ * every unexplored entry, i.e., until it's safe to yield that datum.
+ */
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::Cursor::advance() {
+    while (!entry_pq.empty() && (
+        datum_pq.empty()
+        || datum_pq.top().dist > entry_pq.peek().dist
+    )) {
+        Entry const& next_entry = *entry_pq.pop().entry;
+        if (next_entry.get_node()->is_leaf()) {
+            for (auto const& leaf_entry : next_entry.get_node()->entries) {
+                Datum<T, D> const& datum = *(leaf_entry.get_datum());
+                datum_pq.push(
+                    (CursorPQE){datum, distance(query_point, datum.point)}
+                );
+            }
+        } else {
+            entry_pq.expand(next_entry);
+        }
+    }
+}
+
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::Cursor::empty() {
+    advance();
+    return datum_pq.empty();
+}
+
+/**
+ * Distance to the datum which will be returned by the next call to next().
+ * Assumes the cursor isn't empty.
+ */
+template<typename T, int D, int M>
+coord_t spatial::Rtree<T, D, M>::Cursor::peek_dist() {
+    advance();
+    return datum_pq.top().dist;
+}
+
+template<typename T, int D, int M>
+T spatial::Rtree<T, D, M>::Cursor::next() {
+    advance();
+    T const nearest = datum_pq.top().datum.data;
+    datum_pq.pop();
+    return nearest;
 }
 
 /**
@@ -109,14 +676,14 @@ std::vector<T> spatial::Rtree<T>::query_knn(
  * If a node exceeds M entries, we return 'true' to indicate that a split
  * is required, since splitting happens at the parent's level.  
  */
-template<typename T>
-bool spatial::Rtree<T>::Node::insert(Datum<T> const& datum) {
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::Node::insert(Datum<T, D> const& datum) {
     Point const p = datum.point;
     if (this->is_leaf()) {
         // add the point to the current node
         entries.push_back(Entry(
-            (Rectangle){p.x, p.x, p.y, p.y},
-            std::make_shared<Datum<T>>(datum)
+            (Rectangle){p, p},
+            make_datum(datum, entries.get_allocator().resource())
         ));
     } else {
         // we're in an internal node, and need to descend further
@@ -141,12 +708,12 @@ bool spatial::Rtree<T>::Node::insert(Datum<T> const& datum) {
  * When the root node overflows, we need some special logic, 
  * since it has no parent node.
  */
-template<typename T>
-void spatial::Rtree<T>::split_root() {
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::split_root() {
     // make a new root, with the old root being its only entry
     auto other_entry = std::make_unique<Entry>(
         root_entry->get_mbb(),
-        std::make_shared<Node>()
+        make_node(get_resource())
     );
     root_entry.swap(other_entry);
     // other_entry now contains the OLD root entry
@@ -161,8 +728,8 @@ void spatial::Rtree<T>::split_root() {
  * Note that the object we're calling split() on is the PARENT of the node
  * to be split, not the node itself.
  */
-template<typename T>
-void spatial::Rtree<T>::Node::split(int const branch_idx) {
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::Node::split(int const branch_idx) {
     // pop the overflowing branch from the 'entries' vector
     auto const overflowing_node = entries[branch_idx].get_node();
     entries.erase(entries.begin() + branch_idx);
@@ -178,12 +745,12 @@ void spatial::Rtree<T>::Node::split(int const branch_idx) {
  * Pick a number of "good" seed MBBs from the given choices.
  * Currently, this function uses the quadratic split heuristic.
  */
-template<typename T>
-void spatial::Rtree<T>::Node::pick_seeds(
-    std::vector<Entry> const& entry_choices
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::Node::pick_seeds(
+    std::pmr::vector<Entry> const& entry_choices
 ) {
-    unsigned best_e1 = -1, best_e2 = -1;
-    area_t max_d = -1;
+    unsigned best_e1 = 0, best_e2 = 1;
+    area_t max_d = std::numeric_limits<area_t>::lowest();
     for (unsigned i=0; i<entry_choices.size(); i++) {
         Entry const e1 = entry_choices[i];
         for (unsigned j=i+1; j<entry_choices.size(); j++) {
@@ -199,22 +766,23 @@ void spatial::Rtree<T>::Node::pick_seeds(
     }
     // create two new entries corresponding to the above seed MBBs
     // this should probably be done inside of split()
+    auto* const resource = entries.get_allocator().resource();
     entries.push_back(Entry(
         entry_choices[best_e1].get_mbb(),
-        std::make_shared<Node>()
+        make_node(resource)
     ));
     entries.push_back(Entry(
         entry_choices[best_e2].get_mbb(),
-        std::make_shared<Node>()
+        make_node(resource)
     ));
 }
 
 /**
  * Distribute leftover entries after splitting an overflowing node.
  */
-template<typename T>
-void spatial::Rtree<T>::Node::distribute(
-    std::vector<Entry>& leftover_entries
+template<typename T, int D, int M>
+void spatial::Rtree<T, D, M>::Node::distribute(
+    std::pmr::vector<Entry>& leftover_entries
 ) {
     // our two "groups" are the child nodes that were just created
     Entry& g1 = entries[entries.size()-1];
@@ -233,8 +801,12 @@ void spatial::Rtree<T>::Node::distribute(
             g2.get_mbb(), next_entry.get_mbb()
         );
 
-        area_t const g1_expansion = area(g1_expanded_mbb) - area(g1.get_mbb());
-        area_t const g2_expansion = area(g2_expanded_mbb) - area(g2.get_mbb());
+        area_t const g1_expansion = enlargement(
+            g1.get_mbb(), next_entry.get_mbb()
+        );
+        area_t const g2_expansion = enlargement(
+            g2.get_mbb(), next_entry.get_mbb()
+        );
 
         // distribute to the group which requires the least expansion
         auto is_smaller = [&g1, &g2] (
@@ -247,7 +819,13 @@ void spatial::Rtree<T>::Node::distribute(
             }
         };
 
-        if (is_smaller(g1_expansion, g2_expansion)) {
+        // Neither group can take more than M, e.g. when ties would send a
+        // run of duplicate points all the same way
+        bool const to_g1 = (g2.get_node()->entries.size() == M) || (
+            g1.get_node()->entries.size() < M
+            && is_smaller(g1_expansion, g2_expansion)
+        );
+        if (to_g1) {
             g1.set_mbb(g1_expanded_mbb);
             g1.get_node()->entries.push_back(next_entry);
             if (next_entry.is_leaf_entry()) {
@@ -270,9 +848,9 @@ void spatial::Rtree<T>::Node::distribute(
 /**
  * Pick the "best" leftover entry to distribute next.
  */
-template<typename T>
-int spatial::Rtree<T>::Node::pick_next(
-    std::vector<Entry> const& leftover_entries
+template<typename T, int D, int M>
+int spatial::Rtree<T, D, M>::Node::pick_next(
+    std::pmr::vector<Entry> const& leftover_entries
 ) const {
     Entry const& g1 = entries[entries.size()-1];
     Entry const& g2 = entries[entries.size()-2];
@@ -280,13 +858,8 @@ int spatial::Rtree<T>::Node::pick_next(
     area_t max_diff = 0;
     int pos = 0, best_choice = 0;
     for (auto const& entry : leftover_entries) {
-        area_t const d1 = area(
-            min_bounding_box(g1.get_mbb(), entry.get_mbb())      
-        ) - area(g1.get_mbb());
-
-        area_t const d2 = area(
-            min_bounding_box(g2.get_mbb(), entry.get_mbb())      
-        ) - area(g2.get_mbb());
+        area_t const d1 = enlargement(g1.get_mbb(), entry.get_mbb());
+        area_t const d2 = enlargement(g2.get_mbb(), entry.get_mbb());
 
         if (std::abs(d1 - d2) > max_diff) {
             max_diff = std::abs(d1 - d2);
@@ -302,17 +875,12 @@ int spatial::Rtree<T>::Node::pick_next(
  * Specifically, we pick the bounding box which requires the
  * smallest area expansion to accommodate the new point.
  */
-template<typename T>
-int spatial::Rtree<T>::Node::choose_branch(Point const p) const {
+template<typename T, int D, int M>
+int spatial::Rtree<T, D, M>::Node::choose_branch(Point const p) const {
     area_t min_expansion = -1;
     int pos = 0, best_choice = -1;
     for (auto const& entry : entries) {
-        Rectangle const expanded_bb = min_bounding_box(
-            entry.get_mbb(), p
-        );
-        coord_t const current_expansion = (
-            area(expanded_bb) - area(entry.get_mbb())
-        );
+        coord_t const current_expansion = enlargement(entry.get_mbb(), p);
         if (best_choice == -1 || current_expansion < min_expansion) {
             min_expansion = current_expansion;
             best_choice = pos;
@@ -329,16 +897,16 @@ int spatial::Rtree<T>::Node::choose_branch(Point const p) const {
     return best_choice;
 }
 
-template<typename T>
-spatial::index_t spatial::Rtree<T>::get_load() const { 
+template<typename T, int D, int M>
+spatial::index_t spatial::Rtree<T, D, M>::get_load() const { 
     return root_entry->get_node()->load; 
 }
 
 /**
  * This isn't great, and can probably be done better with type traits
  */
-template<typename T>
-bool spatial::Rtree<T>::Node::is_leaf() const { 
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::Node::is_leaf() const { 
     return (
         entries.empty()
         || entries[0].is_leaf_entry()
@@ -347,10 +915,11 @@ bool spatial::Rtree<T>::Node::is_leaf() const {
 
 /**
  * Verify that for each node in the R-tree, that node's load
- * is equal to the sum of its childrens' loads.
+ * is equal to the sum of its childrens' loads, and that it has
+ * no more than M children.
  */
-template<typename T>
-bool spatial::Rtree<T>::check_load() const {
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::check_load() const {
     return root_entry->get_node()->check_load();
 }
 
@@ -358,17 +927,19 @@ bool spatial::Rtree<T>::check_load() const {
  * Verify that for each entry in the R-tree, that entry's MBB
  * contains all child entries' MBBs.
  */
-template<typename T>
-bool spatial::Rtree<T>::check_mbbs() const {
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::check_mbbs() const {
     return root_entry->check_mbbs();
 }
 
 /**
  * Recursive check_load
  */
-template<typename T>
-bool spatial::Rtree<T>::Node::check_load() const {
-    if (this->is_leaf()) {
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::Node::check_load() const {
+    if (entries.size() > M) {
+        return false;
+    } else if (this->is_leaf()) {
         return true;
     } else {
         index_t sum_loads = 0;
@@ -392,8 +963,8 @@ bool spatial::Rtree<T>::Node::check_load() const {
 /**
  * Recursive check_mbbs
  */
-template<typename T>
-bool spatial::Rtree<T>::Entry::check_mbbs() const {
+template<typename T, int D, int M>
+bool spatial::Rtree<T, D, M>::Entry::check_mbbs() const {
     if (this->is_leaf_entry()) {
         return true; 
     } else {
@@ -4,31 +4,59 @@
 #include <memory>
 #include <vector>
 #include <variant>
+#include <algorithm>
+#include <string>
+#include <memory_resource>
 
 #include "spatial.hpp" 
+#include "simd.hpp"
+#include "storage.hpp"
 
 #pragma once
 
 namespace spatial {
 
-    template<typename T>
+    /**
+     * T is the type of the data being indexed, and D is the number of
+     * dimensions of the points (taken from the first D coordinates of T).
+     * M is the fan-out: the most entries a node holds before it's split,
+     * and how many each node gets from bulk_load().
+     *
+     * pack() gives each node a block of its children's MBBs, padded out to
+     * M, so a node's SIMD expansion is a fixed length loop. With the default
+     * of 8, each axis' mins (or maxes) fill one cache line.
+     */
+    template<typename T, int D = 2, int M = 8>
     class Rtree {
         private:
+            static_assert(M > 1, "Nodes need room for at least two entries");
+
+            using Point = PointND<D>;
+            using Rectangle = RectangleND<D>;
+
             class Entry;
 
             class Node {
                 public:
                     index_t load;
-                    std::vector<Entry> entries;
+                    std::pmr::vector<Entry> entries;
+                    RectangleBlock<D, M>* packed_mbbs;  // see pack()
 
-                    Node();
+                    Node(std::pmr::memory_resource* const resource);
+                    Node(Node const&) = delete;
+                    Node& operator=(Node const&) = delete;
                     ~Node();
-                    bool insert(Datum<T> const& datum);
+                    void pack();
+                    bool insert(Datum<T, D> const& datum);
                     void split(int const branch_idx);
                     int choose_branch(Point const p) const;
-                    void pick_seeds(std::vector<Entry> const& entry_choices);
-                    void distribute(std::vector<Entry>& leftovers);
-                    int pick_next(std::vector<Entry> const& leftovers) const;
+                    void pick_seeds(
+                        std::pmr::vector<Entry> const& entry_choices
+                    );
+                    void distribute(std::pmr::vector<Entry>& leftovers);
+                    int pick_next(
+                        std::pmr::vector<Entry> const& leftovers
+                    ) const;
                     bool is_leaf() const; 
                     bool check_load() const;
             };
@@ -42,12 +70,12 @@ namespace spatial {
                 private:
                     Rectangle _bounding_box;
                     std::variant<
-                        std::shared_ptr<Datum<T>>, 
+                        std::shared_ptr<Datum<T, D>>, 
                         std::shared_ptr<Node>
                     > _contents;
 
                 public:
-                    Entry(Rectangle rect, std::shared_ptr<Datum<T>> datum): 
+                    Entry(Rectangle rect, std::shared_ptr<Datum<T, D>> datum): 
                         _bounding_box(rect),
                         _contents(datum)
                     { }
@@ -63,13 +91,14 @@ namespace spatial {
                         _bounding_box = rect; 
                     }
 
-                    std::shared_ptr<Datum<T>> get_datum() const { 
-                        return std::get<std::shared_ptr<Datum<T>>>(
+                    // (by reference, to spare the reference count updates)
+                    std::shared_ptr<Datum<T, D>> const& get_datum() const { 
+                        return std::get<std::shared_ptr<Datum<T, D>>>(
                             _contents
                         );
                 }
 
-                    std::shared_ptr<Node> get_node() const { 
+                    std::shared_ptr<Node> const& get_node() const { 
                         return std::get<std::shared_ptr<Node>>(
                             _contents
                         );
@@ -77,7 +106,7 @@ namespace spatial {
 
                     bool is_leaf_entry() const {
                         return std::holds_alternative
-                            <std::shared_ptr<Datum<T>>>(
+                            <std::shared_ptr<Datum<T, D>>>(
                                 _contents
                             );
                     }
@@ -86,13 +115,15 @@ namespace spatial {
             };
 
             /**
-             * A thin wrapper around a std::priority_queue for Entries.
-             * Helps to simplify the distance browsing code.
+             * A min-heap of Entries on distance, for distance browsing.
+             * Elements point into the tree rather than copying Entries (and
+             * bumping their shared_ptr reference counts), and the heap is a
+             * plain vector so a QueryContext can reset() and reuse it.
              */
             class EntryPQ {
                 private:
                     struct EntryPQE {
-                        Entry entry;
+                        Entry const* entry;
                         coord_t dist;
                     };
 
@@ -102,50 +133,70 @@ namespace spatial {
                         }
                     };
 
-                    std::priority_queue<
-                        EntryPQE, 
-                        std::vector<EntryPQE>, 
-                        Closer
-                    > pq;
-
+                    std::pmr::vector<EntryPQE> heap;
                     Point query_point;
 
                 public:
-                    EntryPQ(Point p):
+                    EntryPQ(
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource)
+                    { }
+
+                    EntryPQ(
+                        Point p,
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource),
                         query_point(p)
                     { }
 
-                    void push(Entry e) {
-                        pq.push(
-                            (EntryPQE){e, distance(query_point, e.get_mbb())}
-                        );
+                    void reset(Point const p) {
+                        heap.clear();
+                        query_point = p;
+                    }
+
+                    void push(Entry const& e) {
+                        push(e, distance(query_point, e.get_mbb()));
+                    }
+
+                    void push(Entry const& e, coord_t const dist) {
+                        heap.push_back((EntryPQE){&e, dist});
+                        std::push_heap(heap.begin(), heap.end(), Closer());
                     }
 
                     EntryPQE pop() {
-                        auto const pqe = pq.top();
-                        pq.pop();
+                        std::pop_heap(heap.begin(), heap.end(), Closer());
+                        auto const pqe = heap.back();
+                        heap.pop_back();
                         return pqe;
                     }
 
-                    EntryPQE const& peek() const { return pq.top(); }
+                    EntryPQE const& peek() const { return heap.front(); }
 
                     /**
                      * Push all of an entry's children onto the priority queue.
                      */
-                    void expand(Entry e) {
+                    void expand(Entry const& e) {
                         for (auto const& child : e.get_node()->entries) {
                             push(child);
                         }
                     }
+
+                    unsigned size() { return heap.size(); }
+
+                    bool empty() { return heap.empty(); }
             };
 
             /**
-             * Similar to above class, but with Datum elements. 
+             * Similar to above class, but a max-heap of Datum pointers.
              */
             class DatumPQ {
                 private:
                     struct DatumPQE {
-                        Datum<T> datum;
+                        Datum<T, D> const* datum;
                         coord_t dist;
                     };
 
@@ -155,63 +206,218 @@ namespace spatial {
                         }
                     };
 
-                    std::priority_queue<
-                        DatumPQE, 
-                        std::vector<DatumPQE>, 
-                        Farther
-                    > pq;
-
+                    std::pmr::vector<DatumPQE> heap;
                     Point query_point;
 
                 public:
-                    DatumPQ(Point p):
-                        query_point(p)
+                    DatumPQ(
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource)
                     { }
-                
-                    void push(Datum<T> d) {
-                        pq.push(
-                            (DatumPQE){d, distance(query_point, d.point)}
-                        );
+
+                    void reset(Point const p) {
+                        heap.clear();
+                        query_point = p;
+                    }
+
+                    void push(Datum<T, D> const& d) {
+                        push(d, distance(query_point, d.point));
+                    }
+
+                    void push(Datum<T, D> const& d, coord_t const dist) {
+                        heap.push_back((DatumPQE){&d, dist});
+                        std::push_heap(heap.begin(), heap.end(), Farther());
                     }
 
                     DatumPQE pop() {
-                        auto const pqe = pq.top();
-                        pq.pop();
+                        std::pop_heap(heap.begin(), heap.end(), Farther());
+                        auto const pqe = heap.back();
+                        heap.pop_back();
                         return pqe;
                     }
 
-                    DatumPQE const& peek() const { return pq.top(); }
+                    DatumPQE const& peek() const { return heap.front(); }
 
                     /**
                      * Conditionally push a datum onto the priority queue,
                      * if it's closer than the top (furthest) element.
+                     * Returns whether it was.
                      */
-                    void choose(Datum<T> d) {
-                        coord_t const new_dist = distance(query_point, d.point);
+                    bool choose(Datum<T, D> const& d) {
+                        return choose(d, distance(query_point, d.point));
+                    }
+
+                    bool choose(Datum<T, D> const& d, coord_t const new_dist) {
                         if (peek().dist > new_dist) {
-                            pq.pop();
-                            pq.push((DatumPQE){d, new_dist});
+                            // Replace the farthest candidate in place
+                            std::pop_heap(heap.begin(), heap.end(), Farther());
+                            heap.back() = (DatumPQE){&d, new_dist};
+                            std::push_heap(heap.begin(), heap.end(), Farther());
+                            return true;
                         }
+                        return false;
                     }
 
-                    unsigned size() { return pq.size(); }
+                    unsigned size() { return heap.size(); }
 
-                    bool empty() { return (pq.size() == 0); }
+                    bool empty() { return heap.empty(); }
             };
 
             std::unique_ptr<Entry> root_entry;
-            std::vector<Datum<T>> data;
+            std::pmr::vector<Datum<T, D>> data;
+            bool packed;
+            mutable QueryTotals query_totals;  // (with -DSPATIAL_STATS)
 
+            /**
+             * The file format (see save()) has one record per node, in
+             * preorder, with the MBB of the entry that points at it.
+             */
+            struct NodeRecord {
+                Rectangle mbb;
+                uint64_t num_entries;
+                uint64_t is_leaf;
+            };
+
+            struct FileMeta {
+                uint64_t packed;
+            };
+
+            static std::shared_ptr<Node> make_node(
+                std::pmr::memory_resource* const resource
+            );
+            static std::shared_ptr<Datum<T, D>> make_datum(
+                Datum<T, D> const& datum,
+                std::pmr::memory_resource* const resource
+            );
+            static std::shared_ptr<Node> restore_node(
+                NodeRecord const* const records,
+                index_t const num_records,
+                Datum<T, D> const* const datums,
+                index_t const num_data,
+                index_t& next_record,
+                index_t& next_datum,
+                std::pmr::memory_resource* const resource
+            );
             void split_root();
+            void expand_packed(
+                Node const& node,
+                Point const query_point,
+                unsigned const k,
+                coord_t const epsilon,
+                EntryPQ& entry_pq,
+                DatumPQ& datum_pq,
+                QueryStats& stats
+            ) const;
 
         public:
-            Rtree();
+            /**
+             * Scratch space for k-NN queries, which callers can keep around
+             * (one per thread) to avoid allocating for every query: the heaps
+             * and the result vector are reset, but keep their capacity.
+             */
+            class QueryContext {
+                private:
+                    friend class Rtree;
+
+                    EntryPQ entry_pq;
+                    DatumPQ datum_pq;
+                    std::vector<T> results;  // (handed back to the caller)
+                    QueryStats stats;  // of the last query
+
+                public:
+                    QueryContext(
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        entry_pq(resource),
+                        datum_pq(resource)
+                    { }
+
+                    QueryStats const& get_stats() const { return stats; }
+            };
+
+            /**
+             * A resumable distance browsing query. Each call to next()
+             * yields the next nearest datum, without restarting the search.
+             */
+            class Cursor {
+                private:
+                    struct CursorPQE {
+                        Datum<T, D> datum;
+                        coord_t dist;
+                    };
+
+                    struct Closer {
+                        bool operator()(CursorPQE const a, CursorPQE const b) {
+                            return (a.dist > b.dist);
+                        }
+                    };
+
+                    Point query_point;
+                    EntryPQ entry_pq;
+                    std::priority_queue<
+                        CursorPQE,
+                        std::pmr::vector<CursorPQE>,
+                        Closer
+                    > datum_pq;
+
+                    void advance();
+
+                public:
+                    Cursor(
+                        Entry const& root, Point p,
+                        std::pmr::memory_resource* const resource
+                    );
+                    bool empty();
+                    coord_t peek_dist();
+                    T next();
+            };
+
+            explicit Rtree(
+                std::pmr::memory_resource* const resource
+                    = std::pmr::get_default_resource()
+            );
             ~Rtree();
             void build(std::vector<T> const& raw_data);
-            void insert(Datum<T> const& new_datum);
+            void bulk_load(
+                std::vector<T> const& raw_data,
+                Curve const curve = Curve::hilbert
+            );
+            void insert(Datum<T, D> const& new_datum);
+            std::vector<T> query_knn(
+                unsigned const k, coord_t const x, coord_t const y,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
             std::vector<T> query_knn(
-                unsigned const k, coord_t const x, coord_t const y
+                unsigned const k, Point const query_point,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
+            std::vector<T> const& query_knn(
+                QueryContext& context,
+                unsigned const k, Point const query_point,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
+            std::vector<std::vector<T>> query_knn_batch(
+                unsigned const k, std::vector<Point> const& query_points,
+                Curve const curve = Curve::zorder
+            ) const;
+            std::vector<T> query_radius(
+                coord_t const x, coord_t const y, coord_t const radius
+            ) const;
+            std::vector<T> query_radius(
+                Point const center, coord_t const radius
             ) const;
+            Cursor browse(coord_t const x, coord_t const y) const;
+            Cursor browse(Point const p) const;
+            std::pmr::memory_resource* get_resource() const;
+            std::size_t memory_bytes() const;
+            QueryStats get_stats() const;
+            void reset_stats();
+            void pack();
+            bool save(std::string const& path) const;
+            bool load(std::string const& path, bool const verify = false);
             index_t get_load() const;
             bool check_load() const;
             bool check_mbbs() const;
@@ -0,0 +1,392 @@
+// simd.hpp
+/**
+ * Vectorised kernels for scanning blocks of points and rectangles stored in
+ * structure-of-arrays layout (i.e., a separate, contiguous array per axis).
+ *
+ * The AVX-512 and AVX2 paths are only compiled in when the compiler targets
+ * those instruction sets (e.g., -mavx2 or -march=native), otherwise we fall
+ * back on a plain scalar loop.
+ */
+
+#include <array>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include <vector>
+#include <utility>
+#include <memory_resource>
+
+#include "spatial.hpp"
+
+#pragma once
+
+namespace spatial {
+
+    template<typename V, std::size_t... A>
+    std::array<V, sizeof...(A)> axis_vectors(
+        std::pmr::memory_resource* const resource, std::index_sequence<A...>
+    ) {
+        return {{((void)A, V(resource))...}};
+    }
+
+    /**
+     * N empty per-axis arrays of type V (e.g., a pmr vector), which all
+     * allocate from the given resource. (a pmr vector keeps the resource it
+     * was constructed with, even when something else is assigned to it, so
+     * we can't just fill them in later)
+     */
+    template<typename V, std::size_t N>
+    std::array<V, N> axis_vectors(std::pmr::memory_resource* const resource) {
+        return axis_vectors<V>(resource, std::make_index_sequence<N>());
+    }
+
+    /**
+     * A collection of rectangles in structure-of-arrays layout,
+     * i.e., one contiguous array per axis for each of min and max.
+     */
+    template<int D>
+    struct RectangleArrays {
+        std::array<std::pmr::vector<coord_t>, D> min, max;
+
+        RectangleArrays(
+            std::pmr::memory_resource* const resource
+                = std::pmr::get_default_resource()
+        ):
+            min(axis_vectors<std::pmr::vector<coord_t>, D>(resource)),
+            max(axis_vectors<std::pmr::vector<coord_t>, D>(resource))
+        { }
+
+        void push_back(RectangleND<D> const rect) {
+            for (int a = 0; a < D; a++) {
+                min[a].push_back(rect.min[a]);
+                max[a].push_back(rect.max[a]);
+            }
+        }
+
+        void clear() {
+            for (int a = 0; a < D; a++) {
+                min[a].clear();
+                max[a].clear();
+            }
+        }
+
+        index_t size() const { return min[0].size(); }
+    };
+
+    /**
+     * Up to N rectangles in structure-of-arrays layout, like RectangleArrays,
+     * but inline and of a fixed size. The unused slots hold inverted, infinite
+     * rectangles, which are infinitely far from every point, so mindist_block()
+     * always scans all N of them, in a loop the compiler can fully unroll.
+     */
+    template<int D, int N>
+    struct RectangleBlock {
+        std::array<std::array<coord_t, N>, D> min, max;
+        index_t count;
+
+        RectangleBlock() { clear(); }
+
+        void push_back(RectangleND<D> const rect) {
+            for (int a = 0; a < D; a++) {
+                min[a][count] = rect.min[a];
+                max[a][count] = rect.max[a];
+            }
+            count++;
+        }
+
+        void clear() {
+            for (int a = 0; a < D; a++) {
+                min[a].fill(std::numeric_limits<coord_t>::infinity());
+                max[a].fill(-std::numeric_limits<coord_t>::infinity());
+            }
+            count = 0;
+        }
+
+        index_t size() const { return count; }
+    };
+
+    /**
+     * How many rectangles mindist_block() has to scan.
+     */
+    template<int D>
+    index_t scan_length(RectangleArrays<D> const& rects) {
+        return rects.size();
+    }
+
+    template<int D, int N>
+    constexpr index_t scan_length(RectangleBlock<D, N> const&) {
+        return N;
+    }
+
+    /**
+     * Pointers to the element at 'offset' of each per-axis array.
+     */
+    template<typename V, std::size_t N>
+    std::array<typename V::value_type const*, N> block_pointers(
+        std::array<V, N> const& arrays, index_t const offset
+    ) {
+        std::array<typename V::value_type const*, N> pointers;
+        for (std::size_t a = 0; a < N; a++) {
+            pointers[a] = arrays[a].data() + offset;
+        }
+        return pointers;
+    }
+
+    /**
+     * Compute the squared distance from q to each of the n points in
+     * coords (one array per axis), and call visit(i, dist2) for every
+     * point i which is strictly closer than the squared distance bound2.
+     *
+     * bound2 is re-read before each vector of points, so visit() is free to
+     * tighten it (e.g., as a k-NN heap fills up) to filter the rest of the
+     * block more aggressively.
+     *
+     * The per-axis sums start from the first axis rather than from zero, so
+     * in 2d the arithmetic is exactly dx*dx + dy*dy, as in distance().
+     */
+    template<int D, std::size_t N, typename Visitor>
+    void filter_block(
+        PointND<D> const q,
+        std::array<coord_t const*, N> const& coords,
+        index_t const n,
+        coord_t& bound2,
+        Visitor&& visit
+    ) {
+        static_assert(N == D, "Need one coordinate array per axis");
+        index_t i = 0;
+
+#if defined(__AVX512F__)
+        __m512d q8[D];
+        for (int a = 0; a < D; a++) q8[a] = _mm512_set1_pd(q[a]);
+        for (; i + 8 <= n; i += 8) {
+            __m512d d2;
+            for (int a = 0; a < D; a++) {
+                __m512d const delta = _mm512_sub_pd(
+                    _mm512_loadu_pd(coords[a] + i), q8[a]
+                );
+                __m512d const sq = _mm512_mul_pd(delta, delta);
+                d2 = (a == 0) ? sq : _mm512_add_pd(d2, sq);
+            }
+            __mmask8 mask = _mm512_cmp_pd_mask(
+                d2, _mm512_set1_pd(bound2), _CMP_LT_OQ
+            );
+            if (!mask) continue;
+
+            alignas(64) coord_t dists[8];
+            _mm512_store_pd(dists, d2);
+            while (mask) {
+                int const lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                // bound2 may have shrunk since the comparison above
+                if (dists[lane] < bound2) visit(i + lane, dists[lane]);
+            }
+        }
+#endif
+
+#if defined(__AVX2__)
+        __m256d q4[D];
+        for (int a = 0; a < D; a++) q4[a] = _mm256_set1_pd(q[a]);
+        for (; i + 4 <= n; i += 4) {
+            __m256d d2;
+            for (int a = 0; a < D; a++) {
+                __m256d const delta = _mm256_sub_pd(
+                    _mm256_loadu_pd(coords[a] + i), q4[a]
+                );
+                __m256d const sq = _mm256_mul_pd(delta, delta);
+                d2 = (a == 0) ? sq : _mm256_add_pd(d2, sq);
+            }
+            int mask = _mm256_movemask_pd(_mm256_cmp_pd(
+                d2, _mm256_set1_pd(bound2), _CMP_LT_OQ
+            ));
+            if (!mask) continue;
+
+            alignas(32) coord_t dists[4];
+            _mm256_store_pd(dists, d2);
+            while (mask) {
+                int const lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (dists[lane] < bound2) visit(i + lane, dists[lane]);
+            }
+        }
+#endif
+
+        // Scalar fallback, and the tail end of the vectorised loops
+        for (; i < n; i++) {
+            coord_t d2 = 0;
+            for (int a = 0; a < D; a++) {
+                coord_t const delta = coords[a][i] - q[a];
+                d2 += delta*delta;
+            }
+            if (d2 < bound2) visit(i, d2);
+        }
+    }
+
+
+    /**
+     * filter_block() for points stored as some other type S, e.g., float or
+     * quantised integers (see Quantiser). Here q and bound2 are expected to be
+     * in storage space, and the resulting distances are only approximate.
+     *
+     * float and uint16_t blocks are vectorised 8-wide in single precision
+     * (uint16_t converts exactly), anything else takes the scalar path.
+     */
+    template<typename S, int D, std::size_t N, typename Visitor>
+    void filter_block(
+        PointND<D> const q,
+        std::array<S const*, N> const& coords,
+        index_t const n,
+        coord_t& bound2,
+        Visitor&& visit
+    ) {
+        static_assert(N == D, "Need one coordinate array per axis");
+        index_t i = 0;
+
+#if defined(__AVX2__)
+        constexpr bool single_precision = (
+            std::is_same<S, float>::value || std::is_same<S, uint16_t>::value
+        );
+        if constexpr (single_precision) {
+            auto const load8 = [] (S const* p) {
+                if constexpr (std::is_same<S, float>::value) {
+                    return _mm256_loadu_ps(p);
+                } else {
+                    return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+                        _mm_loadu_si128(reinterpret_cast<__m128i const*>(p))
+                    ));
+                }
+            };
+
+            __m256 q8[D];
+            for (int a = 0; a < D; a++) q8[a] = _mm256_set1_ps(q[a]);
+            for (; i + 8 <= n; i += 8) {
+                __m256 d2;
+                for (int a = 0; a < D; a++) {
+                    __m256 const delta = _mm256_sub_ps(
+                        load8(coords[a] + i), q8[a]
+                    );
+                    __m256 const sq = _mm256_mul_ps(delta, delta);
+                    d2 = (a == 0) ? sq : _mm256_add_ps(d2, sq);
+                }
+                int mask = _mm256_movemask_ps(_mm256_cmp_ps(
+                    d2, _mm256_set1_ps(bound2), _CMP_LT_OQ
+                ));
+                if (!mask) continue;
+
+                alignas(32) float dists[8];
+                _mm256_store_ps(dists, d2);
+                while (mask) {
+                    int const lane = __builtin_ctz(mask);
+                    mask &= mask - 1;
+                    if (dists[lane] < bound2) visit(i + lane, dists[lane]);
+                }
+            }
+        }
+#endif
+
+        for (; i < n; i++) {
+            coord_t d2 = 0;
+            for (int a = 0; a < D; a++) {
+                coord_t const delta = coords[a][i] - q[a];
+                d2 += delta*delta;
+            }
+            if (d2 < bound2) visit(i, d2);
+        }
+    }
+
+    /**
+     * The rectangle equivalent of filter_block(): compute the squared
+     * minimum distance from q to each rectangle in rects, and call
+     * visit(i, dist2) for every rectangle i strictly closer than bound2.
+     * rects may be RectangleArrays or a RectangleBlock.
+     */
+    template<int D, typename Rects, typename Visitor>
+    void mindist_block(
+        PointND<D> const q,
+        Rects const& rects,
+        coord_t& bound2,
+        Visitor&& visit
+    ) {
+        index_t const n = scan_length(rects);
+        index_t i = 0;
+
+#if defined(__AVX512F__)
+        __m512d q8[D];
+        for (int a = 0; a < D; a++) q8[a] = _mm512_set1_pd(q[a]);
+        __m512d const zero8 = _mm512_setzero_pd();
+        for (; i + 8 <= n; i += 8) {
+            __m512d d2;
+            for (int a = 0; a < D; a++) {
+                __m512d delta = _mm512_max_pd(
+                    _mm512_sub_pd(_mm512_loadu_pd(&rects.min[a][i]), q8[a]),
+                    _mm512_sub_pd(q8[a], _mm512_loadu_pd(&rects.max[a][i]))
+                );
+                delta = _mm512_max_pd(delta, zero8);
+                __m512d const sq = _mm512_mul_pd(delta, delta);
+                d2 = (a == 0) ? sq : _mm512_add_pd(d2, sq);
+            }
+            __mmask8 mask = _mm512_cmp_pd_mask(
+                d2, _mm512_set1_pd(bound2), _CMP_LT_OQ
+            );
+            if (!mask) continue;
+
+            alignas(64) coord_t dists[8];
+            _mm512_store_pd(dists, d2);
+            while (mask) {
+                int const lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (dists[lane] < bound2) visit(i + lane, dists[lane]);
+            }
+        }
+#endif
+
+#if defined(__AVX2__)
+        __m256d q4[D];
+        for (int a = 0; a < D; a++) q4[a] = _mm256_set1_pd(q[a]);
+        __m256d const zero4 = _mm256_setzero_pd();
+        for (; i + 4 <= n; i += 4) {
+            __m256d d2;
+            for (int a = 0; a < D; a++) {
+                __m256d delta = _mm256_max_pd(
+                    _mm256_sub_pd(_mm256_loadu_pd(&rects.min[a][i]), q4[a]),
+                    _mm256_sub_pd(q4[a], _mm256_loadu_pd(&rects.max[a][i]))
+                );
+                delta = _mm256_max_pd(delta, zero4);
+                __m256d const sq = _mm256_mul_pd(delta, delta);
+                d2 = (a == 0) ? sq : _mm256_add_pd(d2, sq);
+            }
+            int mask = _mm256_movemask_pd(_mm256_cmp_pd(
+                d2, _mm256_set1_pd(bound2), _CMP_LT_OQ
+            ));
+            if (!mask) continue;
+
+            alignas(32) coord_t dists[4];
+            _mm256_store_pd(dists, d2);
+            while (mask) {
+                int const lane = __builtin_ctz(mask);
+                mask &= mask - 1;
+                if (dists[lane] < bound2) visit(i + lane, dists[lane]);
+            }
+        }
+#endif
+
+        for (; i < n; i++) {
+            coord_t d2 = 0;
+            for (int a = 0; a < D; a++) {
+                coord_t delta = std::max(
+                    rects.min[a][i] - q[a], q[a] - rects.max[a][i]
+                );
+                delta = std::max(delta, 0.0);
+                d2 += delta*delta;
+            }
+            if (d2 < bound2) visit(i, d2);
+        }
+    }
+
+}
@@ -1,9 +1,17 @@
 // spatial.hpp
 /**
- * A header file containing some simple 2d structures and functions
+ * A header file containing some simple d-dimensional structures and functions.
+ * The dimension D is a compile time constant everywhere, so every loop over
+ * the axes below unrolls into the same code as a hand written 2d version.
  */
 
+#include <array>
+#include <vector>
 #include <cmath>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <mutex>
 
 #pragma once
 
@@ -12,127 +20,379 @@ namespace spatial {
     // Type aliases!
     using coord_t = double;  // Needs to fit whatever numbers are used for data
     using area_t = coord_t;  // Better semantics for area calculations
-    using code_t = long long int;  // Needs at least 2*(quadtree height) bits
+    using code_t = long long int;  // Needs at least D*(quadtree height) bits
     using index_t = unsigned long int;  // Needs to fit the total # of leaves
- 
+
     struct Range { index_t start, end; };
-    struct Rectangle { coord_t xmin, xmax, ymin, ymax; };
-    struct Point { coord_t x, y; };
 
-    Point midpoint(Rectangle const rect) {
-        coord_t const xmedian = (rect.xmin + rect.xmax) / 2;
-        coord_t const ymedian = (rect.ymin + rect.ymax) / 2;
-        return {xmedian, ymedian};
+    template<int D>
+    struct PointND {
+        std::array<coord_t, D> coords;
+
+        coord_t& operator[](int const axis) { return coords[axis]; }
+        coord_t operator[](int const axis) const { return coords[axis]; }
+    };
+
+    template<int D>
+    struct RectangleND { PointND<D> min, max; };
+
+    using Point = PointND<2>;
+    using Rectangle = RectangleND<2>;
+
+    template<int D>
+    PointND<D> midpoint(RectangleND<D> const rect) {
+        PointND<D> median;
+        for (int a = 0; a < D; a++) {
+            median[a] = (rect.min[a] + rect.max[a]) / 2;
+        }
+        return median;
     }
 
-    coord_t distance(Point const p, Point const q) {
-        coord_t const dx = p.x - q.x;
-        coord_t const dy = p.y - q.y;
-        return std::sqrt(dx*dx + dy*dy);
+    template<int D>
+    coord_t distance(PointND<D> const p, PointND<D> const q) {
+        coord_t sum = 0;
+        for (int a = 0; a < D; a++) {
+            coord_t const d = p[a] - q[a];
+            sum += d*d;
+        }
+        return std::sqrt(sum);
     }
 
-    coord_t distance(Point const p, Rectangle const rect) {
-        coord_t dx = std::max(rect.xmin - p.x, p.x - rect.xmax);
-        coord_t dy = std::max(rect.ymin - p.y, p.y - rect.ymax);
-        dx = std::max(dx, 0.0);
-        dy = std::max(dy, 0.0);
-        return std::sqrt(dx*dx + dy*dy);
+    template<int D>
+    coord_t distance(PointND<D> const p, RectangleND<D> const rect) {
+        coord_t sum = 0;
+        for (int a = 0; a < D; a++) {
+            coord_t d = std::max(rect.min[a] - p[a], p[a] - rect.max[a]);
+            d = std::max(d, 0.0);
+            sum += d*d;
+        }
+        return std::sqrt(sum);
     }
 
-    area_t area(Rectangle const rect) {
-        return (rect.xmax - rect.xmin)*(rect.ymax - rect.ymin);
+    /**
+     * Area for D = 2, and more generally the D-dimensional volume.
+     */
+    template<int D>
+    area_t area(RectangleND<D> const rect) {
+        area_t product = 1;
+        for (int a = 0; a < D; a++) {
+            product *= (rect.max[a] - rect.min[a]);
+        }
+        return product;
     }
 
     /**
      * Calculate the minimum bounding box of a rectangle and a point.
      */
-    Rectangle min_bounding_box(Rectangle const rect, Point const p) {
-        return (Rectangle) {
-            std::min(rect.xmin, p.x),
-            std::max(rect.xmax, p.x),
-            std::min(rect.ymin, p.y),
-            std::max(rect.ymax, p.y)
-        };
+    template<int D>
+    RectangleND<D> min_bounding_box(
+        RectangleND<D> const rect, PointND<D> const p
+    ) {
+        RectangleND<D> mbb;
+        for (int a = 0; a < D; a++) {
+            mbb.min[a] = std::min(rect.min[a], p[a]);
+            mbb.max[a] = std::max(rect.max[a], p[a]);
+        }
+        return mbb;
     }
 
     /**
      * Calculate the minimum bounding box of two rectangles.
      */
-    Rectangle min_bounding_box(Rectangle const r1, Rectangle const r2) {
-        return (Rectangle) {
-            std::min(r1.xmin, r2.xmin),
-            std::max(r1.xmax, r2.xmax),
-            std::min(r1.ymin, r2.ymin),
-            std::max(r1.ymax, r2.ymax)
-        };
+    template<int D>
+    RectangleND<D> min_bounding_box(
+        RectangleND<D> const r1, RectangleND<D> const r2
+    ) {
+        RectangleND<D> mbb;
+        for (int a = 0; a < D; a++) {
+            mbb.min[a] = std::min(r1.min[a], r2.min[a]);
+            mbb.max[a] = std::max(r1.max[a], r2.max[a]);
+        }
+        return mbb;
     }
 
     /**
      * Verify whether one rectangle contains another.
      */
-    bool contains(Rectangle const outer, Rectangle const inner) {
-        return (
-            outer.xmin <= inner.xmin 
-            && outer.xmax >= inner.xmax 
-            && outer.ymin <= inner.ymin 
-            && outer.ymax >= inner.ymax
-        );
+    template<int D>
+    bool contains(RectangleND<D> const outer, RectangleND<D> const inner) {
+        for (int a = 0; a < D; a++) {
+            if (outer.min[a] > inner.min[a] || outer.max[a] < inner.max[a]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template<int D>
+    bool contains(RectangleND<D> const rect, PointND<D> const p) {
+        for (int a = 0; a < D; a++) {
+            if (rect.min[a] > p[a] || rect.max[a] < p[a]) return false;
+        }
+        return true;
+    }
+
+    /**
+     * Verify whether a rectangle strictly contains the ball of the given
+     * radius around p (i.e., the ball doesn't touch the boundary either).
+     */
+    template<int D>
+    bool contains_ball(
+        RectangleND<D> const rect, PointND<D> const p, coord_t const radius
+    ) {
+        for (int a = 0; a < D; a++) {
+            if (p[a] - radius <= rect.min[a] || p[a] + radius >= rect.max[a]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * The increase in area needed for rect to also cover p. A covered point
+     * reports exactly zero growth, which isn't otherwise guaranteed if the
+     * compiler contracts the area subtraction into a fused multiply-add.
+     */
+    template<int D>
+    area_t enlargement(RectangleND<D> const rect, PointND<D> const p) {
+        if (contains(rect, p)) return 0;
+        return area(min_bounding_box(rect, p)) - area(rect);
     }
 
-    bool contains(Rectangle const rect, Point const p) {
-        return (
-            rect.xmin <= p.x
-            && rect.xmax >= p.x 
-            && rect.ymin <= p.y 
-            && rect.ymax >= p.y
-        );
+    /**
+     * The increase in area needed for r1 to also cover r2 (see above).
+     */
+    template<int D>
+    area_t enlargement(RectangleND<D> const r1, RectangleND<D> const r2) {
+        if (contains(r1, r2)) return 0;
+        return area(min_bounding_box(r1, r2)) - area(r1);
+    }
+
+    /**
+     * Push the maximum corner of a rectangle out by 'amount' along every axis.
+     */
+    template<int D>
+    RectangleND<D> grow_max(RectangleND<D> rect, coord_t const amount) {
+        for (int a = 0; a < D; a++) {
+            rect.max[a] += amount;
+        }
+        return rect;
     }
 
     void print_range(Range const r) {
         std::cout << "[ " << r.start << ", " << r.end << " ]\n";
     }
 
-    void print_rect(Rectangle const rect) {
-        std::cout << std::fixed << std::setprecision(2) 
-                  << "x[" << rect.xmin << ", " << rect.xmax << "]  ";
+    template<int D>
+    void print_rect(RectangleND<D> const rect) {
+        char const axis_names[] = "xyz";
+        for (int a = 0; a < D; a++) {
+            if (a < 3) {
+                std::cout << axis_names[a];
+            } else {
+                std::cout << "axis" << a;
+            }
+            std::cout << std::fixed << std::setprecision(2)
+                      << "[" << rect.min[a] << ", " << rect.max[a] << "]"
+                      << ((a == D-1) ? "\n" : "  ");
+        }
+    }
+
+    /**
+     * Query statistics are only collected when compiled with -DSPATIAL_STATS.
+     * Otherwise every count stays at zero, and tally() compiles away.
+     */
+#if defined(SPATIAL_STATS)
+    constexpr bool collect_stats = true;
+#else
+    constexpr bool collect_stats = false;
+#endif
+
+    /**
+     * The work done by k-NN queries: a single query's, in its QueryContext,
+     * or the running totals over every query made on an index.
+     * Comparing these between indexes (or between settings of one index)
+     * separates how much an index explores from how fast it explores it.
+     */
+    struct QueryStats {
+        index_t queries = 0;
+        index_t nodes_popped = 0;
+        index_t nodes_pushed = 0;
+        index_t leaves_scanned = 0;
+        index_t points_tested = 0;  // (distances computed)
+        index_t heap_replacements = 0;  // (candidates evicted by closer ones)
+
+        QueryStats& operator+=(QueryStats const& other) {
+            queries += other.queries;
+            nodes_popped += other.nodes_popped;
+            nodes_pushed += other.nodes_pushed;
+            leaves_scanned += other.leaves_scanned;
+            points_tested += other.points_tested;
+            heap_replacements += other.heap_replacements;
+            return *this;
+        }
+    };
 
-        std::cout << std::fixed << std::setprecision(2) 
-                  << "y[" << rect.ymin << ", " << rect.ymax << "]\n";
+    void tally(index_t& count, index_t const amount = 1) {
+        if constexpr (collect_stats) count += amount;
     }
 
     /**
-     * A single element in a 2d space partitioning tree.
-     * Contains raw data, and an interpetation of that data as a 2d point.
+     * Running totals of QueryStats, for an index to keep. Queries on one
+     * index may run on several threads, so the totals are locked, but only
+     * when stats are being collected (and then only once per query).
      */
-    template<typename T>
+    class QueryTotals {
+        private:
+            mutable std::mutex mutex;
+            QueryStats totals;
+
+        public:
+            QueryTotals() = default;
+
+            QueryTotals(QueryTotals const& other): totals(other.get()) { }
+
+            QueryTotals& operator=(QueryTotals const& other) {
+                QueryStats const copy = other.get();
+                std::lock_guard<std::mutex> lock(mutex);
+                totals = copy;
+                return *this;
+            }
+
+            void add(QueryStats const& stats) {
+                if constexpr (collect_stats) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    totals += stats;
+                }
+            }
+
+            QueryStats get() const {
+                std::lock_guard<std::mutex> lock(mutex);
+                return totals;
+            }
+
+            void reset() {
+                std::lock_guard<std::mutex> lock(mutex);
+                totals = {};
+            }
+    };
+
+    /**
+     * A single element in a d-dimensional space partitioning tree.
+     * Contains raw data, and an interpetation of that data as a point.
+     */
+    template<typename T, int D = 2>
     struct Datum {
         T data;
-        Point point;
+        PointND<D> point;
     };
 
     /**
-     * Build a vector of Datum<T> from a vector of <T>.
+     * Build a vector of Datum<T> from a vector of <T>,
+     * using the first D coordinates of each raw datum.
      */
-    template<typename T>
-    std::vector<Datum<T>> datumize(std::vector<T> const& raw_data) {
-        std::vector<Datum<T>> formatted_data;
+    template<typename T, int D = 2>
+    std::vector<Datum<T, D>> datumize(std::vector<T> const& raw_data) {
+        std::vector<Datum<T, D>> formatted_data;
         formatted_data.reserve(raw_data.size());
         for (auto const& raw_datum : raw_data) {
-            Point const new_point = {raw_datum[0], raw_datum[1]};
-            Datum<T> const new_datum = {raw_datum, new_point};
+            PointND<D> new_point;
+            for (int a = 0; a < D; a++) {
+                new_point[a] = raw_datum[a];
+            }
+            Datum<T, D> const new_datum = {raw_datum, new_point};
             formatted_data.push_back(new_datum);
         }
         return formatted_data;
     }
 
     /**
-     * For a 1d range [min,max] divided into 'dim' equal partitions, 
+     * Maps coordinates onto a (possibly narrower) storage type S.
+     *
+     * Floating point storage keeps offsets from the minimum corner of the
+     * bounds, and integer storage additionally scales those offsets to span
+     * the full range of S (uniformly along every axis, so distances stay
+     * isotropic). Storing coord_t itself is an exact identity mapping.
+     *
+     * Distances between stored points are then only approximate, so
+     * bound2() widens a distance by the worst case quantisation error (and
+     * squares it), for use as a conservative filter before recomputing
+     * exact distances.
+     */
+    template<typename S, int D = 2>
+    class Quantiser {
+        private:
+            PointND<D> origin;
+            coord_t scale;
+            coord_t slack;
+
+        public:
+            static constexpr bool exact = std::is_same<S, coord_t>::value;
+
+            Quantiser(RectangleND<D> const bounds):
+                origin(),
+                scale(1),
+                slack(0)
+            {
+                if (exact) return;
+                origin = bounds.min;
+                coord_t extent = 0;
+                for (int a = 0; a < D; a++) {
+                    extent = std::max(extent, bounds.max[a] - bounds.min[a]);
+                }
+                if (std::is_integral<S>::value) {
+                    scale = std::numeric_limits<S>::max() / extent;
+                    slack = 0.5 * std::sqrt(D);  // rounding to integers
+                } else {
+                    // roughly an ulp of the largest stored offset, per axis
+                    slack = extent * std::sqrt(D)
+                          * std::numeric_limits<S>::epsilon();
+                }
+            }
+
+            /**
+             * Transform a point into storage space, without rounding.
+             */
+            PointND<D> to_storage(PointND<D> const p) const {
+                PointND<D> stored;
+                for (int a = 0; a < D; a++) {
+                    stored[a] = (p[a] - origin[a]) * scale;
+                }
+                return stored;
+            }
+
+            S encode(coord_t const storage_coord) const {
+                if (std::is_integral<S>::value) {
+                    coord_t const max = std::numeric_limits<S>::max();
+                    return static_cast<S>(
+                        std::lround(std::clamp(storage_coord, 0.0, max))
+                    );
+                } else {
+                    return static_cast<S>(storage_coord);
+                }
+            }
+
+            /**
+             * Squared storage space distance which is guaranteed to be at
+             * least as large as any stored distance of a point whose true
+             * distance is under 'dist'. The small relative term covers the
+             * kernels' arithmetic, which may be done in single precision.
+             */
+            coord_t bound2(coord_t const dist) const {
+                if (exact) return dist * dist;
+                coord_t const bound = dist * scale * (1 + 1.0/(1 << 16)) + slack;
+                return bound * bound;
+            }
+    };
+
+    /**
+     * For a 1d range [min,max] divided into 'dim' equal partitions,
      * find the partition (or index) which contains 'coord'.
      */
     int grid_index(
-        coord_t const coord, 
-        coord_t const min, 
-        coord_t const max, 
+        coord_t const coord,
+        coord_t const min,
+        coord_t const max,
         int const dim
     ) {
         return (coord - min) * dim / (max - min);
@@ -140,11 +400,11 @@ namespace spatial {
 
     // Bitstring constants for use in interleaving integers
     uint8_t const _shifts[] = { 1, 2, 4, 8 };
-    uint32_t const _masks[] = { 
-        0x55555555, 
-        0x33333333, 
-        0x0F0F0F0F, 
-        0x00FF00FF 
+    uint32_t const _masks[] = {
+        0x55555555,
+        0x33333333,
+        0x0F0F0F0F,
+        0x00FF00FF
     };
 
     /**
@@ -157,7 +417,7 @@ namespace spatial {
         i = (i | (i << _shifts[1])) & _masks[1];
         return (i | (i << _shifts[0])) & _masks[0];
     }
-    
+
     /**
      * Interleave two 16-bit integers into a 32-bit integer.
      * e.g., (ABCD, EFGH) -> EAFB GCHD
@@ -166,4 +426,193 @@ namespace spatial {
         return space_bits(a) | (space_bits(b) << 1);
     }
 
+    /**
+     * Space 21-bits out into 63-bits, with two zeros inbetween.
+     * e.g., 111 -> 001001001
+     */
+    uint64_t space_bits3(uint32_t const i0) {
+        uint64_t i = i0 & 0x1FFFFF;
+        i = (i | (i << 32)) & 0x001F00000000FFFF;
+        i = (i | (i << 16)) & 0x001F0000FF0000FF;
+        i = (i | (i << 8)) & 0x100F00F00F00F00F;
+        i = (i | (i << 4)) & 0x10C30C30C30C30C3;
+        return (i | (i << 2)) & 0x1249249249249249;
+    }
+
+    /**
+     * Interleave D integers into a single Z-order (Morton) code, with the
+     * first axis in the least significant bit. The 2d and 3d cases use the
+     * bit twiddling above, anything else falls back on a loop over the bits.
+     */
+    template<int D>
+    code_t interleave(std::array<uint32_t, D> const cells) {
+        if constexpr (D == 2) {
+            return interleave(cells[0], cells[1]);
+        } else if constexpr (D == 3) {
+            return (
+                space_bits3(cells[0])
+                | (space_bits3(cells[1]) << 1)
+                | (space_bits3(cells[2]) << 2)
+            );
+        } else {
+            code_t code = 0;
+            for (int bit = 0; bit * D < 63; bit++) {
+                for (int a = 0; a < D && bit * D + a < 63; a++) {
+                    code |= (code_t)((cells[a] >> bit) & 1) << (bit * D + a);
+                }
+            }
+            return code;
+        }
+    }
+
+    /**
+     * The space filling curves which the indexes can lay their data out along.
+     * Z-order is cheaper to compute, but jumps across the whole space at each
+     * quadrant boundary, while consecutive Hilbert cells are always adjacent.
+     */
+    enum class Curve { zorder, hilbert };
+
+    /**
+     * Hilbert curve state machine for 2d, indexed by [state][quadrant] with
+     * quadrants numbered as in the quadtree (bit 0 = upper x, bit 1 = upper y).
+     * The low two bits of each entry are the quadrant's position along the
+     * curve, and the high two bits are the state to use inside the quadrant.
+     * States 0-3 are the identity, transpose, anti-transpose and 180 degree
+     * rotation of the base curve, which traverses SW, NW, NE, SE.
+     */
+    uint8_t const _hilbert_table[4][4] = {
+        { 0x4, 0xB, 0x1, 0x2 },
+        { 0x0, 0x5, 0xF, 0x6 },
+        { 0xA, 0x3, 0x9, 0xC },
+        { 0xE, 0xD, 0x7, 0x8 }
+    };
+
+    /**
+     * Position of the cell (x, y) along a 2d Hilbert curve of the given
+     * order (i.e., through a 2^order x 2^order grid).
+     */
+    code_t hilbert_key(uint32_t const x, uint32_t const y, int const order) {
+        code_t key = 0;
+        int state = 0;
+        for (int level = order - 1; level >= 0; level--) {
+            int const quadrant = ((x >> level) & 1) | (((y >> level) & 1) << 1);
+            uint8_t const entry = _hilbert_table[state][quadrant];
+            key = (key << 2) | (entry & 0x3);
+            state = entry >> 2;
+        }
+        return key;
+    }
+
+    /**
+     * Position of a cell along a D-dimensional Hilbert curve of the given
+     * order. 2d uses the table above, anything else uses Skilling's
+     * transpose algorithm ("Programming the Hilbert curve", 2004).
+     */
+    template<int D>
+    code_t hilbert_key(std::array<uint32_t, D> cells, int const order) {
+        if constexpr (D == 2) {
+            return hilbert_key(cells[0], cells[1], order);
+        } else {
+            if (order == 0) return 0;
+            uint32_t const top = uint32_t(1) << (order - 1);
+            for (uint32_t q = top; q > 1; q >>= 1) {
+                uint32_t const p = q - 1;
+                for (int a = 0; a < D; a++) {
+                    if (cells[a] & q) {
+                        cells[0] ^= p;
+                    } else {
+                        uint32_t const t = (cells[0] ^ cells[a]) & p;
+                        cells[0] ^= t;
+                        cells[a] ^= t;
+                    }
+                }
+            }
+            for (int a = 1; a < D; a++) cells[a] ^= cells[a-1];
+            uint32_t t = 0;
+            for (uint32_t q = top; q > 1; q >>= 1) {
+                if (cells[D-1] & q) t ^= q - 1;
+            }
+            for (int a = 0; a < D; a++) cells[a] ^= t;
+
+            code_t key = 0;
+            for (int level = order - 1; level >= 0; level--) {
+                for (int a = 0; a < D; a++) {
+                    key = (key << 1) | ((cells[a] >> level) & 1);
+                }
+            }
+            return key;
+        }
+    }
+
+    /**
+     * Position of a cell along either curve, in a 2^order per axis grid.
+     */
+    template<int D>
+    code_t curve_key(
+        Curve const curve, std::array<uint32_t, D> const cells, int const order
+    ) {
+        if (curve == Curve::hilbert) {
+            return hilbert_key<D>(cells, order);
+        } else {
+            return interleave<D>(cells);
+        }
+    }
+
+    /**
+     * The finest grid we can key points on with a 64-bit code
+     * (16 bits per axis in 2d, to match the 2d interleave()).
+     */
+    template<int D>
+    constexpr int curve_order() { return (D == 2) ? 16 : 63 / D; }
+
+    /**
+     * Position of a point along either curve, at the finest resolution
+     * which fits in a code_t. Points outside of the bounds are clamped.
+     */
+    template<int D>
+    code_t curve_key(
+        Curve const curve, PointND<D> const p, RectangleND<D> const bounds
+    ) {
+        int const order = curve_order<D>();
+        int const dim = 1 << order;
+        std::array<uint32_t, D> cells;
+        for (int a = 0; a < D; a++) {
+            if (bounds.max[a] <= bounds.min[a]) {
+                cells[a] = 0;  // a flat axis, e.g. a single point
+                continue;
+            }
+            coord_t const clamped = std::clamp(p[a], bounds.min[a], bounds.max[a]);
+            int const cell = grid_index(clamped, bounds.min[a], bounds.max[a], dim);
+            cells[a] = std::min(cell, dim - 1);
+        }
+        return curve_key<D>(curve, cells, order);
+    }
+
+    /**
+     * The order in which to visit a collection of points along a curve,
+     * i.e., a permutation of their indices sorted by curve key (keyed within
+     * the points' own bounding box). Ties keep their original order.
+     */
+    template<int D>
+    std::vector<index_t> curve_sort(
+        std::vector<PointND<D>> const& points, Curve const curve
+    ) {
+        std::vector<index_t> order(points.size());
+        if (points.empty()) return order;
+
+        RectangleND<D> bounds = {points[0], points[0]};
+        for (auto const& p : points) bounds = min_bounding_box(bounds, p);
+
+        std::vector<std::pair<code_t, index_t>> keys;
+        keys.reserve(points.size());
+        for (index_t i = 0; i < points.size(); i++) {
+            keys.push_back({curve_key(curve, points[i], bounds), i});
+        }
+        std::sort(keys.begin(), keys.end());
+        for (index_t i = 0; i < keys.size(); i++) {
+            order[i] = keys[i].second;
+        }
+        return order;
+    }
+
 }
@@ -0,0 +1,414 @@
+// storage.hpp
+/**
+ * Saving indexes to disk, and loading them back without rebuilding.
+ *
+ * An index file is a header, a table of sections, and then the index's
+ * arrays (nodes, leaf ranges, sorted data, per-axis coordinates), each as a
+ * raw section starting on a 64 byte boundary, exactly as laid out in memory.
+ * Loading maps the file and points the index's arrays straight at those
+ * sections, so there's nothing to parse or copy up front, and the pages are
+ * only faulted in as queries touch them.
+ *
+ * Raw sections only work for plain old data, so saving and loading need
+ * a trivially copyable T. The header records the layout of everything
+ * (dimensions, sizes of the coordinate, storage and datum types, byte
+ * order), so a file written with a different T, S or D, or on a different
+ * architecture, is rejected rather than misread.
+ *
+ * Each file carries two checksums: one over the header and section table,
+ * which is always verified, and one over all of the sections, which is only
+ * verified on request (it has to read the whole file, defeating the point of
+ * lazy loading, but it's worth doing for files from untrusted sources).
+ */
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+#include <memory_resource>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "spatial.hpp"
+
+#pragma once
+
+namespace spatial {
+
+    uint32_t const file_version = 1;
+    uint32_t const endian_marker = 0x01020304;
+    uint64_t const section_alignment = 64;
+
+    enum class IndexKind : uint32_t {
+        quadtree = 1, zgrid = 2, rtree = 3, tiles = 4
+    };
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t endian;
+        uint32_t version;
+        uint32_t kind;
+        uint32_t dims;
+        uint32_t coord_bytes;
+        uint32_t storage_bytes;
+        uint32_t datum_bytes;
+        uint32_t num_sections;
+        uint64_t payload_checksum;  // over every section, in order
+        uint64_t header_checksum;  // over the header and section table
+
+        /**
+         * A header describing a particular index type, without checksums.
+         */
+        static FileHeader describe(
+            IndexKind const kind,
+            int const dims,
+            std::size_t const storage_bytes,
+            std::size_t const datum_bytes,
+            std::size_t const num_sections
+        ) {
+            FileHeader header = {};
+            std::memcpy(header.magic, "spatial", 8);
+            header.endian = endian_marker;
+            header.version = file_version;
+            header.kind = static_cast<uint32_t>(kind);
+            header.dims = dims;
+            header.coord_bytes = sizeof(coord_t);
+            header.storage_bytes = storage_bytes;
+            header.datum_bytes = datum_bytes;
+            header.num_sections = num_sections;
+            return header;
+        }
+
+        bool describes_same_index(FileHeader const& other) const {
+            return (std::memcmp(magic, other.magic, 8) == 0
+                && endian == other.endian
+                && version == other.version
+                && kind == other.kind
+                && dims == other.dims
+                && coord_bytes == other.coord_bytes
+                && storage_bytes == other.storage_bytes
+                && datum_bytes == other.datum_bytes
+                && num_sections == other.num_sections
+            );
+        }
+    };
+
+    struct Section { uint64_t offset, bytes; };
+
+    /**
+     * 64-bit FNV-1a, over whole words where possible (for speed) and
+     * then over any bytes left at the end.
+     */
+    inline uint64_t checksum(
+        void const* const p, std::size_t const n,
+        uint64_t hash = 0xcbf29ce484222325ULL
+    ) {
+        uint64_t const prime = 0x100000001b3ULL;
+        unsigned char const* const bytes = static_cast<unsigned char const*>(p);
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; i < n; i++) hash = (hash ^ bytes[i]) * prime;
+        return hash;
+    }
+
+    /**
+     * A read-only view of a whole file, memory mapped where the platform
+     * supports it, and otherwise read into an aligned heap buffer.
+     */
+    class MappedFile {
+        private:
+            char const* bytes = nullptr;
+            std::size_t length = 0;
+            std::unique_ptr<std::max_align_t[]> buffer;  // when not mapped
+
+        public:
+            MappedFile() { }
+            MappedFile(MappedFile const&) = delete;
+            MappedFile& operator=(MappedFile const&) = delete;
+
+            ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+                if (bytes && !buffer && length) {
+                    munmap(const_cast<char*>(bytes), length);
+                }
+#endif
+            }
+
+            /**
+             * Returns nullptr if the file can't be opened (or is empty).
+             */
+            static std::unique_ptr<MappedFile> open(std::string const& path) {
+                auto file = std::make_unique<MappedFile>();
+#if defined(__unix__) || defined(__APPLE__)
+                int const fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) return nullptr;
+                struct stat info;
+                if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+                    close(fd);
+                    return nullptr;
+                }
+                void* const mapping = mmap(
+                    nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0
+                );
+                close(fd);  // (the mapping keeps the file open)
+                if (mapping == MAP_FAILED) return nullptr;
+                file->bytes = static_cast<char const*>(mapping);
+                file->length = info.st_size;
+#else
+                std::ifstream in(path, std::ios::binary | std::ios::ate);
+                if (!in) return nullptr;
+                std::size_t const size = in.tellg();
+                if (size == 0) return nullptr;
+                std::size_t const words = (
+                    (size + sizeof(std::max_align_t) - 1)
+                    / sizeof(std::max_align_t)
+                );
+                file->buffer.reset(new std::max_align_t[words]);
+                in.seekg(0);
+                in.read(reinterpret_cast<char*>(file->buffer.get()), size);
+                if (!in) return nullptr;
+                file->bytes = reinterpret_cast<char const*>(file->buffer.get());
+                file->length = size;
+#endif
+                return file;
+            }
+
+            char const* data() const { return bytes; }
+            std::size_t size() const { return length; }
+    };
+
+    /**
+     * An index file opened for loading, with its header and section table
+     * already validated against the index type which is loading it.
+     */
+    class IndexFile {
+        private:
+            std::unique_ptr<MappedFile> file;
+            FileHeader header;
+            Section const* sections = nullptr;
+
+        public:
+            /**
+             * Returns nullptr if the file is missing, truncated, corrupt, or
+             * was written for a different kind of index (or layout).
+             * With verify, the checksum over the sections is checked too.
+             */
+            static std::unique_ptr<IndexFile> open(
+                std::string const& path,
+                FileHeader const& expected,
+                bool const verify
+            ) {
+                auto index_file = std::make_unique<IndexFile>();
+                index_file->file = MappedFile::open(path);
+                if (!index_file->file) return nullptr;
+                char const* const bytes = index_file->file->data();
+                std::size_t const length = index_file->file->size();
+
+                FileHeader& header = index_file->header;
+                if (length < sizeof(FileHeader)) return nullptr;
+                std::memcpy(&header, bytes, sizeof(FileHeader));
+                if (!header.describes_same_index(expected)) return nullptr;
+
+                std::size_t const table_bytes = (
+                    header.num_sections * sizeof(Section)
+                );
+                if (length < sizeof(FileHeader) + table_bytes) return nullptr;
+                FileHeader unsummed = header;
+                unsummed.header_checksum = 0;
+                uint64_t const header_sum = checksum(
+                    bytes + sizeof(FileHeader), table_bytes,
+                    checksum(&unsummed, sizeof(FileHeader))
+                );
+                if (header_sum != header.header_checksum) return nullptr;
+
+                index_file->sections = reinterpret_cast<Section const*>(
+                    bytes + sizeof(FileHeader)
+                );
+                uint64_t payload_sum = checksum(nullptr, 0);
+                for (uint32_t i = 0; i < header.num_sections; i++) {
+                    Section const s = index_file->sections[i];
+                    if (s.offset % section_alignment != 0
+                        || s.offset > length
+                        || s.bytes > length - s.offset
+                    ) {
+                        return nullptr;
+                    }
+                    if (verify) {
+                        payload_sum = checksum(
+                            bytes + s.offset, s.bytes, payload_sum
+                        );
+                    }
+                }
+                if (verify && payload_sum != header.payload_checksum) {
+                    return nullptr;
+                }
+                return index_file;
+            }
+
+            /**
+             * The i'th section as an array of X, and its length, or nullptr
+             * if the section isn't a whole number of Xs.
+             */
+            template<typename X>
+            std::pair<X const*, std::size_t> section(uint32_t const i) const {
+                Section const s = sections[i];
+                if (s.bytes % sizeof(X) != 0) return {nullptr, 0};
+                return {
+                    reinterpret_cast<X const*>(file->data() + s.offset),
+                    s.bytes / sizeof(X)
+                };
+            }
+
+            /**
+             * Hand over the mapping, which has to outlive anything that
+             * points into its sections.
+             */
+            std::unique_ptr<MappedFile> release() { return std::move(file); }
+    };
+
+    /**
+     * Collects an index's arrays, then writes them out as an index file.
+     * The arrays have to stay alive (and unchanged) until write().
+     */
+    class IndexWriter {
+        private:
+            std::vector<std::pair<char const*, std::size_t>> arrays;
+
+        public:
+            template<typename X>
+            void add(X const* const array, std::size_t const n) {
+                static_assert(
+                    std::is_trivially_copyable<X>::value,
+                    "Index files can only hold trivially copyable types"
+                );
+                arrays.push_back({
+                    reinterpret_cast<char const*>(array), n * sizeof(X)
+                });
+            }
+
+            /**
+             * Returns false if the file couldn't be written.
+             */
+            bool write(std::string const& path, FileHeader header) const {
+                header.num_sections = arrays.size();
+                std::vector<Section> sections;
+                uint64_t offset = (
+                    sizeof(FileHeader) + arrays.size() * sizeof(Section)
+                );
+                header.payload_checksum = checksum(nullptr, 0);
+                for (auto const& [array, bytes] : arrays) {
+                    offset += (section_alignment - offset % section_alignment)
+                        % section_alignment;
+                    sections.push_back({offset, bytes});
+                    offset += bytes;
+                    header.payload_checksum = checksum(
+                        array, bytes, header.payload_checksum
+                    );
+                }
+                header.header_checksum = 0;
+                header.header_checksum = checksum(
+                    sections.data(), sections.size() * sizeof(Section),
+                    checksum(&header, sizeof(FileHeader))
+                );
+
+                std::ofstream out(path, std::ios::binary | std::ios::trunc);
+                if (!out) return false;
+                out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+                out.write(
+                    reinterpret_cast<char const*>(sections.data()),
+                    sections.size() * sizeof(Section)
+                );
+                uint64_t position = (
+                    sizeof(FileHeader) + sections.size() * sizeof(Section)
+                );
+                char const padding[section_alignment] = {};
+                for (std::size_t i = 0; i < arrays.size(); i++) {
+                    out.write(padding, sections[i].offset - position);
+                    out.write(arrays[i].first, arrays[i].second);
+                    position = sections[i].offset + sections[i].bytes;
+                }
+                return bool(out);
+            }
+    };
+
+    /**
+     * One of an index's arrays, which is either its own (a pmr vector), or
+     * a read-only view of a section in a loaded index file.
+     *
+     * Reads go to whichever is current. Anything which modifies the array
+     * first copies a mapped section into the vector, so a loaded index can
+     * still be modified (at the cost of that copy).
+     */
+    template<typename X>
+    class MappedVector {
+        private:
+            std::pmr::vector<X> vec;
+            X const* view = nullptr;
+            std::size_t view_size = 0;
+
+            std::pmr::vector<X>& own() {
+                if (view) {
+                    vec.assign(view, view + view_size);
+                    view = nullptr;
+                    view_size = 0;
+                }
+                return vec;
+            }
+
+        public:
+            using value_type = X;
+
+            MappedVector(
+                std::pmr::memory_resource* const resource
+                    = std::pmr::get_default_resource()
+            ):
+                vec(resource)
+            { }
+
+            /**
+             * Point at n Xs from a mapped file, dropping any owned contents.
+             */
+            void map(X const* const array, std::size_t const n) {
+                std::pmr::vector<X>(vec.get_allocator()).swap(vec);
+                view = array;
+                view_size = n;
+            }
+
+            bool is_mapped() const { return view != nullptr; }
+
+            X const* data() const { return view ? view : vec.data(); }
+            std::size_t size() const { return view ? view_size : vec.size(); }
+            bool empty() const { return (size() == 0); }
+            X const& operator[](std::size_t i) const { return data()[i]; }
+            X const& back() const { return data()[size() - 1]; }
+            X const* begin() const { return data(); }
+            X const* end() const { return data() + size(); }
+            auto get_allocator() const { return vec.get_allocator(); }
+
+            // (a mapped section's bytes belong to the file's mapping)
+            std::size_t bytes() const { return vec.capacity() * sizeof(X); }
+
+            X* data() { return own().data(); }
+            X& operator[](std::size_t i) { return own()[i]; }
+            X& back() { return own().back(); }
+            void push_back(X const& x) { own().push_back(x); }
+            void reserve(std::size_t n) { own().reserve(n); }
+            void resize(std::size_t n) { own().resize(n); }
+            void assign(std::size_t n, X const& x) { own().assign(n, x); }
+            void clear() { own().clear(); }
+    };
+
+}
@@ -0,0 +1,461 @@
+// tiled.cpp
+
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include "tiled.hpp"
+
+using coord_t = spatial::coord_t;
+using code_t = spatial::code_t;
+using index_t = spatial::index_t;
+
+/**
+ * The tiles (and their points) live in the given directory, which is
+ * created if need be. Points outside of the bounds go into the nearest
+ * edge tile. The memory budget covers both the points buffered by add()
+ * and the tiles kept resident for queries.
+ */
+template<typename T, typename Index, int D>
+spatial::TiledIndex<T, Index, D>::TiledIndex(
+    std::string const& dir,
+    Rectangle const b,
+    int const l,
+    std::size_t const budget
+):
+    directory(dir),
+    bounds(b),
+    level(l),
+    memory_budget(budget),
+    tiles(std::size_t(1) << (D * l), Tile{{}, 0}),
+    buffers(std::size_t(1) << (D * l)),
+    buffered(0),
+    resident_bytes(0)
+{
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    // Points are appended to the tiles' point files, so start from scratch,
+    // by listing whichever are there (rather than trying every tile's)
+    std::vector<std::filesystem::path> stale;
+    for (auto const& entry
+        : std::filesystem::directory_iterator(directory, error)
+    ) {
+        std::string const name = entry.path().filename().string();
+        if (name.rfind("tile_", 0) == 0 && entry.path().extension() == ".pts") {
+            stale.push_back(entry.path());
+        }
+    }
+    for (auto const& path : stale) std::filesystem::remove(path, error);
+}
+
+/**
+ * Add a chunk of points, which are buffered per tile, and spilled to the
+ * tiles' point files whenever the buffers outgrow the memory budget.
+ * Returns false if a point file couldn't be written.
+ */
+template<typename T, typename Index, int D>
+bool spatial::TiledIndex<T, Index, D>::add(std::vector<T> const& points) {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Tiles can only hold trivially copyable data"
+    );
+    for (auto const& raw : points) {
+        Point p;
+        for (int a = 0; a < D; a++) p[a] = raw[a];
+        code_t const code = tile_code(p);
+        Tile& tile = tiles[code];
+        tile.bounds = tile.size
+            ? min_bounding_box(tile.bounds, p) : (Rectangle){p, p};
+        tile.size++;
+        buffers[code].push_back(raw);
+        buffered++;
+    }
+    if (buffered * sizeof(T) > memory_budget) return spill();
+    return true;
+}
+
+/**
+ * Append every buffered point to its tile's point file, and free the buffers.
+ */
+template<typename T, typename Index, int D>
+bool spatial::TiledIndex<T, Index, D>::spill() {
+    for (code_t code = 0; code < code_t(buffers.size()); code++) {
+        auto& buffer = buffers[code];
+        if (buffer.empty()) continue;
+        std::ofstream out(
+            tile_path(code, "pts"), std::ios::binary | std::ios::app
+        );
+        out.write(
+            reinterpret_cast<char const*>(buffer.data()),
+            buffer.size() * sizeof(T)
+        );
+        if (!out) return false;
+        std::vector<T>().swap(buffer);
+    }
+    buffered = 0;
+    return true;
+}
+
+/**
+ * Build and save each tile's index, one tile at a time, so only a single
+ * tile's points are ever in memory. build(index, points) is called on an
+ * empty index covering the tile, e.g.,
+ *     [] (auto& zgrid, auto const& points) { zgrid.build(points, 6); }
+ * The point files are removed once their tile has been saved, and a list of
+ * the tiles is saved alongside them, so that load() can reopen them later.
+ * Returns false if any file couldn't be read or written.
+ */
+template<typename T, typename Index, int D>
+template<typename Build>
+bool spatial::TiledIndex<T, Index, D>::finish(Build const& build) {
+    if (!spill()) return false;
+
+    std::vector<T> points;
+    for (code_t code = 0; code < code_t(tiles.size()); code++) {
+        Tile const& tile = tiles[code];
+        if (!tile.size) continue;
+
+        std::string const points_path = tile_path(code, "pts");
+        points.resize(tile.size);
+        std::ifstream in(points_path, std::ios::binary);
+        in.read(reinterpret_cast<char*>(points.data()), tile.size * sizeof(T));
+        if (!in) return false;
+
+        Index index(tile.bounds);
+        build(index, points);
+        if (!index.save(tile_path(code, "idx"))) return false;
+        in.close();
+        std::filesystem::remove(points_path);
+    }
+
+    FileMeta const meta = {bounds, uint64_t(level)};
+    IndexWriter writer;
+    writer.add(&meta, 1);
+    writer.add(tiles.data(), tiles.size());
+    return writer.write(directory + "/tiles.idx", FileHeader::describe(
+        IndexKind::tiles, D, sizeof(coord_t), sizeof(T), 2
+    ));
+}
+
+/**
+ * Reopen the tiles which were finished in this directory earlier,
+ * replacing the bounds and level given to the constructor.
+ * Returns false, leaving the index as it was, if there are none, or if they
+ * weren't built as this type of Index.
+ */
+template<typename T, typename Index, int D>
+bool spatial::TiledIndex<T, Index, D>::load() {
+    auto const file = IndexFile::open(
+        directory + "/tiles.idx",
+        FileHeader::describe(
+            IndexKind::tiles, D, sizeof(coord_t), sizeof(T), 2
+        ),
+        true
+    );
+    if (!file) return false;
+
+    auto const [meta, num_meta] = file->section<FileMeta>(0);
+    auto const [saved_tiles, num_tiles] = file->section<Tile>(1);
+    if (num_meta != 1 || meta->level >= 64 / D
+        || num_tiles != (std::size_t(1) << (D * meta->level))
+    ) {
+        return false;
+    }
+
+    // The list of tiles doesn't say what type of index they are, but the
+    // tiles' own headers do, and they were all built alike
+    for (std::size_t code = 0; code < num_tiles; code++) {
+        if (!saved_tiles[code].size) continue;
+        Index probe(saved_tiles[code].bounds);
+        if (!probe.load(tile_path(code, "idx"))) return false;
+        break;
+    }
+
+    bounds = meta->bounds;
+    level = meta->level;
+    tiles.assign(saved_tiles, saved_tiles + num_tiles);
+    buffers.clear();
+    buffers.resize(num_tiles);
+    buffered = 0;
+    resident.clear();
+    lru.clear();
+    resident_bytes = 0;
+    return true;
+}
+
+/**
+ * The index for a tile, loading it (and evicting the least recently used
+ * tiles to make room) if it isn't already resident.
+ * Returns nullptr if the tile's index file couldn't be loaded.
+ */
+template<typename T, typename Index, int D>
+Index* spatial::TiledIndex<T, Index, D>::fetch(code_t const code) {
+    auto const found = resident.find(code);
+    if (found != resident.end()) {
+        lru.splice(lru.begin(), lru, found->second.lru_position);
+        return found->second.index.get();
+    }
+
+    std::string const path = tile_path(code, "idx");
+    auto index = std::make_unique<Index>(tiles[code].bounds);
+    if (!index->load(path)) return nullptr;
+
+    // Loading rebuilds the nodes on top of the (lazily) mapped file, so the
+    // tile is charged for both, as memory_bytes() counts them
+    std::size_t const bytes = index->memory_bytes();
+    while (!lru.empty() && resident_bytes + bytes > memory_budget) {
+        auto const evicted = resident.find(lru.back());
+        resident_bytes -= evicted->second.bytes;
+        resident.erase(evicted);
+        lru.pop_back();
+    }
+
+    lru.push_front(code);
+    resident_bytes += bytes;
+    Index* const loaded = index.get();
+    resident[code] = {std::move(index), bytes, lru.begin()};
+    return loaded;
+}
+
+template<typename T, typename Index, int D>
+std::vector<T> spatial::TiledIndex<T, Index, D>::query_knn(
+    unsigned const k, coord_t const x, coord_t const y
+) {
+    static_assert(D == 2, "Use the Point overload of query_knn() for D != 2");
+    return query_knn(k, (Point){{x, y}});
+}
+
+/**
+ * k-NN query across tiles. Tiles are visited in order of their distance
+ * from the query point, and each one's k nearest neighbours are merged into
+ * the candidates, until the k'th candidate is closer than any tile left.
+ * The results are ordered far -> close, as for the other indexes.
+ * Returns nothing if a tile which might hold a neighbour can't be loaded,
+ * rather than neighbours which may not be the nearest.
+ *
+ * Rather than measure every tile up front, tiles join the queue a ring of
+ * grid cells at a time, outward from the query point's own cell, and only
+ * once the ring_bound() of those already in it is nearer than any queued
+ * tile. So a query only ever looks at the tiles around it.
+ */
+template<typename T, typename Index, int D>
+std::vector<T> spatial::TiledIndex<T, Index, D>::query_knn(
+    unsigned const k, Point const query_point
+) {
+    // A min-heap of the non-empty tiles on distance
+    std::vector<std::pair<coord_t, code_t>> tile_pq;
+    auto const closer = [] (auto const& a, auto const& b) {
+        return (a.first > b.first);
+    };
+    std::array<int, D> const centre = tile_cells(query_point);
+    int ring = -1;
+    coord_t bound = 0;  // to any tile outside of the rings so far
+    auto const push_ring = [&] () {
+        ring++;
+        for_ring(centre, ring, [&] (std::array<int, D> const& cells) {
+            std::array<uint32_t, D> unsigned_cells;
+            for (int a = 0; a < D; a++) unsigned_cells[a] = cells[a];
+            code_t const code = interleave<D>(unsigned_cells);
+            if (tiles[code].size) {
+                tile_pq.push_back({
+                    distance(query_point, tiles[code].bounds), code
+                });
+                std::push_heap(tile_pq.begin(), tile_pq.end(), closer);
+            }
+        });
+        bound = ring_bound(query_point, centre, ring);
+    };
+    push_ring();
+
+    auto const farther = [] (Candidate const& a, Candidate const& b) {
+        return (a.dist < b.dist);
+    };
+    std::vector<Candidate> candidates;
+    while (true) {
+        coord_t const next_dist = tile_pq.empty()
+            ? std::numeric_limits<coord_t>::infinity() : tile_pq.front().first;
+        if (candidates.size() >= k
+            && candidates.front().dist <= std::min(next_dist, bound)
+        ) {
+            break;
+        }
+        if (bound < next_dist) {
+            push_ring();  // (the next ring might hold a nearer tile)
+            continue;
+        }
+        if (tile_pq.empty()) break;  // (every tile has been visited)
+
+        std::pop_heap(tile_pq.begin(), tile_pq.end(), closer);
+        Index* const index = fetch(tile_pq.back().second);
+        tile_pq.pop_back();
+        if (!index) return {};
+
+        for (auto const& raw : index->query_knn(k, query_point)) {
+            Point p;
+            for (int a = 0; a < D; a++) p[a] = raw[a];
+            coord_t const dist = distance(query_point, p);
+            if (candidates.size() < k) {
+                candidates.push_back({raw, dist});
+                std::push_heap(candidates.begin(), candidates.end(), farther);
+            } else if (dist < candidates.front().dist) {
+                std::pop_heap(candidates.begin(), candidates.end(), farther);
+                candidates.back() = {raw, dist};
+                std::push_heap(candidates.begin(), candidates.end(), farther);
+            }
+        }
+    }
+
+    std::vector<T> results;
+    results.reserve(candidates.size());
+    while (!candidates.empty()) {
+        std::pop_heap(candidates.begin(), candidates.end(), farther);
+        results.push_back(candidates.back().data);
+        candidates.pop_back();
+    }
+    return results;
+}
+
+/**
+ * The grid cell of the tile containing a point, along each axis.
+ */
+template<typename T, typename Index, int D>
+std::array<int, D> spatial::TiledIndex<T, Index, D>::tile_cells(
+    Point const p
+) const {
+    int const dim = 1 << level;
+    std::array<int, D> cells;
+    for (int a = 0; a < D; a++) {
+        if (bounds.max[a] <= bounds.min[a]) {
+            cells[a] = 0;
+            continue;
+        }
+        coord_t const clamped = std::clamp(p[a], bounds.min[a], bounds.max[a]);
+        int const cell = grid_index(clamped, bounds.min[a], bounds.max[a], dim);
+        cells[a] = std::min(cell, dim - 1);
+    }
+    return cells;
+}
+
+/**
+ * The tile containing a point, as the Morton code of its grid cell.
+ */
+template<typename T, typename Index, int D>
+code_t spatial::TiledIndex<T, Index, D>::tile_code(Point const p) const {
+    std::array<int, D> const cells = tile_cells(p);
+    std::array<uint32_t, D> unsigned_cells;
+    for (int a = 0; a < D; a++) unsigned_cells[a] = cells[a];
+    return interleave<D>(unsigned_cells);
+}
+
+/**
+ * Call visit(cells) for every grid cell in the given ring around the
+ * centre cell, i.e., whose furthest axis is 'ring' cells away, bar those
+ * off the edge of the grid.
+ */
+template<typename T, typename Index, int D>
+template<typename Visitor>
+void spatial::TiledIndex<T, Index, D>::for_ring(
+    std::array<int, D> const& centre, int const ring, Visitor const& visit
+) const {
+    int const dim = 1 << level;
+    std::array<int, D> cells;
+    for (int a = 0; a < D; a++) cells[a] = centre[a] - ring;
+    while (true) {
+        bool inner_on_ring = false;  // (along any axis but the last)
+        bool on_grid = true;
+        for (int a = 0; a < D; a++) {
+            if (a < D - 1) {
+                inner_on_ring = inner_on_ring
+                    || std::abs(cells[a] - centre[a]) == ring;
+            }
+            on_grid = on_grid && cells[a] >= 0 && cells[a] < dim;
+        }
+        bool const on_ring = inner_on_ring
+            || std::abs(cells[D-1] - centre[D-1]) == ring;
+        if (on_ring && on_grid) visit(cells);
+
+        // Step to the next cell, skipping straight across the ring's
+        // interior along the last axis
+        int a = D - 1;
+        if (!inner_on_ring && ring > 0 && cells[a] == centre[a] - ring) {
+            cells[a] = centre[a] + ring;
+            continue;
+        }
+        while (a >= 0 && cells[a] == centre[a] + ring) {
+            cells[a] = centre[a] - ring;
+            a--;
+        }
+        if (a < 0) return;
+        cells[a]++;
+    }
+}
+
+/**
+ * The least distance from a query point (in the centre cell) to any point
+ * held by a tile beyond the given ring, or infinity if there are none. A
+ * point outside of the bounds is in an edge tile, so it's even further out
+ * than that tile's cell. (The bound is pulled in by a few ulps, in case
+ * grid_index() rounded a point on a cell boundary into the next cell.)
+ */
+template<typename T, typename Index, int D>
+coord_t spatial::TiledIndex<T, Index, D>::ring_bound(
+    Point const query_point, std::array<int, D> const& centre, int const ring
+) const {
+    int const dim = 1 << level;
+    coord_t bound = std::numeric_limits<coord_t>::infinity();
+    for (int a = 0; a < D; a++) {
+        coord_t const extent = bounds.max[a] - bounds.min[a];
+        if (extent <= 0) continue;  // (a flat axis has just the one cell)
+        coord_t const width = extent / dim;
+        coord_t const slack = (
+            4 * extent * std::numeric_limits<coord_t>::epsilon()
+        );
+        int const low = centre[a] - ring;
+        int const high = centre[a] + ring;
+        if (low > 0) {
+            coord_t const edge = bounds.min[a] + low * width;
+            bound = std::min(bound, query_point[a] - edge - slack);
+        }
+        if (high < dim - 1) {
+            coord_t const edge = bounds.min[a] + (high + 1) * width;
+            bound = std::min(bound, edge - query_point[a] - slack);
+        }
+    }
+    return std::max<coord_t>(bound, 0);
+}
+
+template<typename T, typename Index, int D>
+std::string spatial::TiledIndex<T, Index, D>::tile_path(
+    code_t const code, std::string ext
+) const {
+    return directory + "/tile_" + std::to_string(code) + "." + ext;
+}
+
+/**
+ * The total number of points, across all tiles.
+ */
+template<typename T, typename Index, int D>
+index_t spatial::TiledIndex<T, Index, D>::size() const {
+    index_t total = 0;
+    for (auto const& tile : tiles) total += tile.size;
+    return total;
+}
+
+template<typename T, typename Index, int D>
+std::size_t spatial::TiledIndex<T, Index, D>::num_tiles() const {
+    return tiles.size();
+}
+
+template<typename T, typename Index, int D>
+std::size_t spatial::TiledIndex<T, Index, D>::num_resident() const {
+    return resident.size();
+}
+
+template<typename T, typename Index, int D>
+std::size_t spatial::TiledIndex<T, Index, D>::get_resident_bytes() const {
+    return resident_bytes;
+}
@@ -0,0 +1,115 @@
+// tiled.hpp
+
+#include <array>
+#include <list>
+#include <vector>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "spatial.hpp"
+#include "storage.hpp"
+
+#pragma once
+
+namespace spatial {
+
+    /**
+     * An index over more points than fit in memory, split into a grid of
+     * 2^level tiles along each axis. Index is the type of index built over
+     * each tile (a Quadtree or Zgrid, say) with the same T and D.
+     *
+     * Points are streamed in with add(), which spills them into a file per
+     * tile. finish() then builds each tile's index in turn, in Morton order,
+     * and saves it next to the points (see storage.hpp). Queries load tiles
+     * on demand, keeping the most recently used ones resident while they fit
+     * in the memory budget, and carry on into neighbouring tiles until no
+     * other tile could hold a closer point.
+     *
+     * Tiles are saved and loaded as index files, so T must be trivially
+     * copyable. Queries update the tile cache, so a TiledIndex mustn't be
+     * shared between threads.
+     */
+    template<typename T, typename Index, int D = 2>
+    class TiledIndex {
+        private:
+            using Point = PointND<D>;
+            using Rectangle = RectangleND<D>;
+
+            struct Tile {
+                Rectangle bounds;  // of the tile's points, not its grid cell
+                index_t size;
+            };
+
+            struct Resident {
+                std::unique_ptr<Index> index;
+                std::size_t bytes;
+                typename std::list<code_t>::iterator lru_position;
+            };
+
+            /**
+             * Query candidates, as a max-heap on distance (as in the
+             * indexes' own DatumPQs, but holding copies of the data, since
+             * the tiles they came from may be evicted mid-query).
+             */
+            struct Candidate {
+                T data;
+                coord_t dist;
+            };
+
+            struct FileMeta {
+                Rectangle bounds;
+                uint64_t level;
+            };
+
+            std::string directory;
+            Rectangle bounds;
+            int level;
+            std::size_t memory_budget;
+            std::vector<Tile> tiles;  // indexed by Morton code
+            std::vector<std::vector<T>> buffers;  // points not yet spilled
+            index_t buffered;
+
+            std::unordered_map<code_t, Resident> resident;
+            std::list<code_t> lru;  // most recently used first
+            std::size_t resident_bytes;
+
+            std::array<int, D> tile_cells(Point const p) const;
+            code_t tile_code(Point const p) const;
+            template<typename Visitor>
+            void for_ring(
+                std::array<int, D> const& centre,
+                int const ring,
+                Visitor const& visit
+            ) const;
+            coord_t ring_bound(
+                Point const query_point,
+                std::array<int, D> const& centre,
+                int const ring
+            ) const;
+            std::string tile_path(code_t const code, std::string ext) const;
+            bool spill();
+            Index* fetch(code_t const code);
+
+        public:
+            TiledIndex(
+                std::string const& directory,
+                Rectangle const bounds,
+                int const level,
+                std::size_t const memory_budget
+            );
+            bool add(std::vector<T> const& points);
+            template<typename Build>
+            bool finish(Build const& build);
+            bool load();
+            std::vector<T> query_knn(
+                unsigned const k, coord_t const x, coord_t const y
+            );
+            std::vector<T> query_knn(unsigned const k, Point const query_point);
+            index_t size() const;
+            std::size_t num_tiles() const;
+            std::size_t num_resident() const;
+            std::size_t get_resident_bytes() const;
+    };
+
+}
@@ -0,0 +1,351 @@
+// tuner.cpp
+
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+#include "tuner.hpp"
+
+using coord_t = spatial::coord_t;
+using index_t = spatial::index_t;
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    double elapsed_ns(Clock::time_point const start) {
+        return std::chrono::duration<double, std::nano>(
+            Clock::now() - start
+        ).count();
+    }
+
+    /**
+     * A uniformly random sample of m of the points (or all of them, if
+     * there aren't more than m), in their original order, by selection
+     * sampling (Knuth's Algorithm S).
+     */
+    template<typename T>
+    std::vector<T> sample_data(
+        std::vector<T> const& data, index_t const m, uint64_t const seed
+    ) {
+        if (data.size() <= m) return data;
+        std::mt19937_64 rng(seed);
+        std::uniform_real_distribution<double> uniform(0, 1);
+        std::vector<T> sample;
+        sample.reserve(m);
+        index_t const n = data.size();
+        for (index_t i = 0; i < n && sample.size() < m; i++) {
+            if ((n - i) * uniform(rng) < m - sample.size()) {
+                sample.push_back(data[i]);
+            }
+        }
+        return sample;
+    }
+
+    /**
+     * Every configuration worth trying on num_points points: each structure
+     * along either curve, the quadtree and R-tree at each of their built in
+     * capacities, and the Z-grid at resolutions around its default.
+     */
+    template<typename T, int D>
+    std::vector<spatial::IndexConfig> candidates(index_t const num_points) {
+        using spatial::Curve;
+        std::vector<spatial::IndexConfig> configs = {
+            {"quadtree", Curve::hilbert, 0, 0},
+            {"rtree", Curve::zorder, 0, 0},
+            {"zgrid", Curve::hilbert, 0, 0}
+        };
+        for (int const L : spatial::quadtree_capacities) {
+            configs.push_back({"quadtree", Curve::zorder, 0, L});
+        }
+        for (int const M : spatial::rtree_capacities) {
+            configs.push_back({"rtree", Curve::hilbert, 0, M});
+        }
+        int const r = spatial::Zgrid<T, coord_t, D>::resolution(num_points);
+        for (int s = std::max(1, r - 2); s <= std::min(24 / D, r + 2); s++) {
+            configs.push_back({"zgrid", Curve::zorder, s, 0});
+        }
+        return configs;
+    }
+
+    char const* curve_name(spatial::Curve const curve) {
+        return (curve == spatial::Curve::hilbert) ? "hilbert" : "zorder";
+    }
+
+    /**
+     * Whether two positive quantities are within a factor of each other.
+     */
+    bool within_factor(double const a, double const b, double const factor) {
+        if (a <= 0 || b <= 0) return a == b;
+        return std::max(a, b) <= factor * std::min(a, b);
+    }
+
+}
+
+/**
+ * Whether the other data set is close enough to this one, in size, density
+ * and how much of its bounds it covers, for the best index of one to do as
+ * well on the other.
+ */
+bool spatial::DataProfile::similar(DataProfile const& other) const {
+    return dims == other.dims
+        && within_factor(num_points, other.num_points, 2)
+        && within_factor(density, other.density, 1.5)
+        && std::abs(occupancy - other.occupancy) <= 0.1;
+}
+
+template<typename T, int D>
+spatial::DataProfile spatial::profile_data(
+    std::vector<T> const& data, RectangleND<D> const bounds
+) {
+    DataProfile profile;
+    profile.dims = D;
+    profile.num_points = data.size();
+    area_t const volume = area(bounds);
+    if (volume > 0) profile.density = data.size() / volume;
+    if (data.empty()) return profile;
+
+    // (64 x 64 cells in 2d, or 16 x 16 x 16 in 3d)
+    int const cells_per_axis = 1 << (12 / D);
+    std::vector<bool> occupied(std::size_t(1) << (12 / D * D), false);
+    for (auto const& raw : data) {
+        std::size_t cell = 0;
+        for (int a = 0; a < D; a++) {
+            coord_t const width = bounds.max[a] - bounds.min[a];
+            int c = (width > 0)
+                ? int((raw[a] - bounds.min[a]) / width * cells_per_axis) : 0;
+            c = std::clamp(c, 0, cells_per_axis - 1);
+            cell = cell * cells_per_axis + c;
+        }
+        occupied[cell] = true;
+    }
+    profile.occupancy = coord_t(
+        std::count(occupied.begin(), occupied.end(), true)
+    ) / occupied.size();
+    return profile;
+}
+
+/**
+ * Build every candidate configuration (see candidates() above) on a sample
+ * of the data, time the queries on each, and return them all, best (lowest
+ * cost) first, or nothing if there's no data.
+ *
+ * Each query point is queried for every k in options.ks, and every radius
+ * in options.radii, or at the sample's points if there are no queries.
+ * Radii are scaled up for the sample, to return about as many points as
+ * they would from all of the data. The Z-grid resolutions are likewise
+ * those for all of the data, so each result can be passed straight to
+ * make_index().
+ */
+template<typename T, int D>
+std::vector<spatial::TuningResult> spatial::tune_index(
+    std::vector<T> const& data,
+    std::vector<PointND<D>> const& queries,
+    RectangleND<D> const bounds,
+    TuningOptions const& options
+) {
+    std::vector<TuningResult> results;
+    if (data.empty()) return results;
+
+    std::vector<T> const sample = sample_data(
+        data, std::max<index_t>(options.sample_size, 1), options.seed
+    );
+    std::vector<PointND<D>> points = queries;
+    if (points.empty()) {
+        for (auto const& raw : sample) {
+            PointND<D> p;
+            for (int a = 0; a < D; a++) p[a] = raw[a];
+            points.push_back(p);
+        }
+    }
+    index_t const max_queries = std::max<index_t>(options.num_queries, 1);
+    index_t const stride = (points.size() + max_queries - 1) / max_queries;
+    std::vector<PointND<D>> query_points;
+    for (index_t i = 0; i < points.size(); i += stride) {
+        query_points.push_back(points[i]);
+    }
+
+    double const scale = std::pow(double(data.size()) / sample.size(), 1.0/D);
+    std::vector<coord_t> radii;
+    for (coord_t const radius : options.radii) radii.push_back(radius * scale);
+
+    int const shift = Zgrid<T, coord_t, D>::resolution(data.size())
+        - Zgrid<T, coord_t, D>::resolution(sample.size());
+    for (IndexConfig config : candidates<T, D>(sample.size())) {
+        auto const start = Clock::now();
+        auto index = make_index<T, D>(config, bounds);
+        index->build(sample);
+        double const build_ns = elapsed_ns(start);
+
+        // Query until it's taken long enough to time reliably
+        double query_ns = 0;
+        index_t passes = 0;
+        std::size_t filler = 0;
+        do {
+            auto const query_start = Clock::now();
+            for (auto const& p : query_points) {
+                for (unsigned const k : options.ks) {
+                    filler += index->query_knn(k, p).size();
+                }
+                for (coord_t const radius : radii) {
+                    filler += index->query_radius(p, radius).size();
+                }
+            }
+            query_ns += elapsed_ns(query_start);
+            passes++;
+        } while (query_ns < options.min_seconds * 1e9);
+        volatile std::size_t const sink = filler;  // (so they can't be elided)
+        static_cast<void>(sink);
+
+        if (config.resolution > 0) {
+            config.resolution = std::clamp(config.resolution + shift, 1, 24/D);
+        }
+        TuningResult result;
+        result.config = config;
+        result.build_ns = build_ns / sample.size();
+        result.query_ns = query_ns / (passes * query_points.size());
+        result.bytes = double(index->memory_bytes()) / sample.size();
+        result.cost = result.build_ns
+            + options.queries_per_point * result.query_ns;
+        results.push_back(result);
+    }
+
+    std::stable_sort(results.begin(), results.end(),
+        [] (TuningResult const& a, TuningResult const& b) {
+            return a.cost < b.cost;
+        }
+    );
+    return results;
+}
+
+/**
+ * The best configuration for the data and queries: from the cache file, if
+ * it holds one for similar data and the same workload, or else by tuning,
+ * and saving the result there for next time (where possible). If there's no
+ * data, it's the default Z-grid, untimed.
+ */
+template<typename T, int D>
+spatial::TuningResult spatial::choose_index(
+    std::vector<T> const& data,
+    std::vector<PointND<D>> const& queries,
+    RectangleND<D> const bounds,
+    TuningOptions const& options,
+    std::string const& cache_path
+) {
+    DataProfile const profile = profile_data(data, bounds);
+    TuningResult result;
+    if (!cache_path.empty()) {
+        if (load_tuning(cache_path, profile, options, result)) return result;
+    }
+    auto const results = tune_index(data, queries, bounds, options);
+    if (results.empty()) {
+        result.config = {"zgrid", Curve::zorder, 0, 0};
+        return result;
+    }
+    if (!cache_path.empty()) {
+        save_tuning(cache_path, profile, options, results.front());
+    }
+    return results.front();
+}
+
+/**
+ * Save a tuning result as a small text file, of one "key values..." line
+ * per field, along with the profile of the data and the workload it was
+ * tuned for. Returns false if the file couldn't be written.
+ */
+bool spatial::save_tuning(
+    std::string const& path,
+    DataProfile const& profile,
+    TuningOptions const& options,
+    TuningResult const& result
+) {
+    std::ofstream out(path);
+    out.precision(std::numeric_limits<double>::max_digits10);
+    out << "tuning 1\n"
+        << "dims " << profile.dims << "\n"
+        << "num_points " << profile.num_points << "\n"
+        << "density " << profile.density << "\n"
+        << "occupancy " << profile.occupancy << "\n"
+        << "ks";
+    for (unsigned const k : options.ks) out << " " << k;
+    out << "\nradii";
+    for (coord_t const radius : options.radii) out << " " << radius;
+    out << "\nqueries_per_point " << options.queries_per_point << "\n"
+        << "name " << result.config.name << "\n"
+        << "curve " << curve_name(result.config.curve) << "\n"
+        << "resolution " << result.config.resolution << "\n"
+        << "capacity " << result.config.capacity << "\n"
+        << "build_ns " << result.build_ns << "\n"
+        << "query_ns " << result.query_ns << "\n"
+        << "bytes " << result.bytes << "\n"
+        << "cost " << result.cost << "\n";
+    return bool(out);
+}
+
+/**
+ * Load a result saved by save_tuning(), if it was tuned for data similar to
+ * the profile (see DataProfile::similar()), and the same queries per point,
+ * k's and radii as the options. Returns false, leaving the result as it
+ * was, if not, or if the file couldn't be read.
+ */
+bool spatial::load_tuning(
+    std::string const& path,
+    DataProfile const& profile,
+    TuningOptions const& options,
+    TuningResult& result
+) {
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line) || line != "tuning 1") return false;
+
+    DataProfile saved;
+    TuningOptions workload;
+    workload.ks.clear();
+    TuningResult loaded;
+    std::string curve;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        if (key == "ks" || key == "radii") {
+            // (lists, which may be empty, so read to the end of the line)
+            for (coord_t value; fields >> value; ) {
+                if (key == "ks") workload.ks.push_back(unsigned(value));
+                else workload.radii.push_back(value);
+            }
+            if (!fields.eof()) return false;
+            continue;
+        }
+        if (key == "dims") fields >> saved.dims;
+        else if (key == "num_points") fields >> saved.num_points;
+        else if (key == "density") fields >> saved.density;
+        else if (key == "occupancy") fields >> saved.occupancy;
+        else if (key == "queries_per_point") {
+            fields >> workload.queries_per_point;
+        }
+        else if (key == "name") fields >> loaded.config.name;
+        else if (key == "curve") fields >> curve;
+        else if (key == "resolution") fields >> loaded.config.resolution;
+        else if (key == "capacity") fields >> loaded.config.capacity;
+        else if (key == "build_ns") fields >> loaded.build_ns;
+        else if (key == "query_ns") fields >> loaded.query_ns;
+        else if (key == "bytes") fields >> loaded.bytes;
+        else if (key == "cost") fields >> loaded.cost;
+        else return false;
+        if (!fields) return false;
+    }
+    if (curve != "zorder" && curve != "hilbert") return false;
+    loaded.config.curve = (curve == "hilbert") ? Curve::hilbert : Curve::zorder;
+
+    if (!saved.similar(profile)) return false;
+    if (workload.ks != options.ks || workload.radii != options.radii) {
+        return false;
+    }
+    if (workload.queries_per_point != options.queries_per_point) return false;
+    result = loaded;
+    return true;
+}
@@ -0,0 +1,97 @@
+// tuner.hpp
+/**
+ * Choosing an index for a data set and query workload by trying them out.
+ *
+ * Which structure is fastest (and at which Z-grid resolution, or along
+ * which curve) depends on how the points are spread and on the queries, so
+ * rather than guess, tune_index() builds every candidate configuration
+ * (see any_index.hpp) over a random sample of the data, times it on a
+ * sample of the queries, and ranks them. The cost it ranks them by is the
+ * build time per point plus the time for the expected number of queries
+ * per point, so a one-off index favours fast builds, and a long-lived one
+ * fast queries.
+ *
+ * Tuning takes a while (about a second per candidate by default), so
+ * choose_index() can keep the result in a small text file, along with a
+ * DataProfile of the data, and reuse it for any later data set with a
+ * similar profile and the same workload, e.g., the other tiles of a survey.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "spatial.hpp"
+#include "any_index.hpp"
+
+#pragma once
+
+namespace spatial {
+
+    /**
+     * A cheap summary of a data set, for telling whether a tuning result
+     * for one data set is likely to carry over to another.
+     */
+    struct DataProfile {
+        int dims = 0;
+        index_t num_points = 0;
+        coord_t density = 0;  // points per unit area (or volume)
+        coord_t occupancy = 0;  // of a 4096 cell grid over the bounds
+
+        bool similar(DataProfile const& other) const;
+    };
+
+    struct TuningOptions {
+        index_t sample_size = 200000;  // data points to build candidates on
+        index_t num_queries = 2000;  // query points to time them with
+        std::vector<unsigned> ks = {8};  // k-NN queries at each query point
+        std::vector<coord_t> radii;  // and radius queries
+        double queries_per_point = 1;  // over the index's lifetime
+        double min_seconds = 0.2;  // to spend timing each one's queries
+        uint64_t seed = 1;
+    };
+
+    struct TuningResult {
+        IndexConfig config;  // (for the whole data set, not the sample)
+        double build_ns = 0;  // per point
+        double query_ns = 0;  // per query point, for every k and radius
+        double bytes = 0;  // per point
+        double cost = 0;  // build_ns + queries_per_point * query_ns
+    };
+
+    template<typename T, int D>
+    DataProfile profile_data(
+        std::vector<T> const& data, RectangleND<D> const bounds
+    );
+
+    template<typename T, int D>
+    std::vector<TuningResult> tune_index(
+        std::vector<T> const& data,
+        std::vector<PointND<D>> const& queries,
+        RectangleND<D> const bounds,
+        TuningOptions const& options = TuningOptions()
+    );
+
+    template<typename T, int D>
+    TuningResult choose_index(
+        std::vector<T> const& data,
+        std::vector<PointND<D>> const& queries,
+        RectangleND<D> const bounds,
+        TuningOptions const& options = TuningOptions(),
+        std::string const& cache_path = ""
+    );
+
+    bool save_tuning(
+        std::string const& path,
+        DataProfile const& profile,
+        TuningOptions const& options,
+        TuningResult const& result
+    );
+    bool load_tuning(
+        std::string const& path,
+        DataProfile const& profile,
+        TuningOptions const& options,
+        TuningResult& result
+    );
+
+}
@@ -1,119 +1,581 @@
 // zgrid.cpp
 
+#include <limits>
+
 #include "zgrid.hpp"
 
 using coord_t = spatial::coord_t;
 using code_t = spatial::code_t;
 using index_t = spatial::index_t;
 
-template<typename T>
-spatial::Zgrid<T>::Zgrid(coord_t x0, coord_t x1, coord_t y0, coord_t y1):
-    root(std::make_unique<Node>(0, 0, (Rectangle){x0, x1+0.01, y0, y1+0.01}))
+/**
+ * As with the quadtree, the maximum bounds are nudged out a little so that
+ * points right on the boundary still hash to a cell inside the grid.
+ * The curve decides the order in which the cells' data is laid out.
+ * As with the quadtree, everything the grid keeps comes from the memory
+ * resource (which must outlive the grid).
+ */
+template<typename T, typename S, int D>
+spatial::Zgrid<T, S, D>::Zgrid(
+    Rectangle const bounds,
+    Curve const c,
+    std::pmr::memory_resource* const resource
+):
+    nodes(resource),
+    root(nodes.create(0, 0, grow_max(bounds, 0.01))),
+    grid(resource),
+    data(resource),
+    coords(axis_vectors<MappedVector<S>, D>(resource)),
+    quantiser(root->bounds),
+    curve(c)
 { }
 
-template<typename T>
-spatial::Zgrid<T>::Node::Node(code_t c, int d, Rectangle b):
+template<typename T, typename S, int D>
+spatial::Zgrid<T, S, D>::Zgrid(
+    coord_t x0, coord_t x1, coord_t y0, coord_t y1,
+    Curve const c,
+    std::pmr::memory_resource* const resource
+):
+    Zgrid((Rectangle){{x0, y0}, {x1, y1}}, c, resource)
+{
+    static_assert(D == 2, "Use the Rectangle constructor for D != 2");
+}
+
+template<typename T, typename S, int D>
+spatial::Zgrid<T, S, D>::Node::Node(code_t c, int d, Rectangle b):
     code(c),
     depth(d), 
     bounds(b), 
-    center(midpoint(b))
+    center(midpoint(b)),
+    children(nullptr)
 { }
 
-template<typename T>
-void spatial::Zgrid<T>::build(std::vector<T> const& raw_data, int const r) {
-    zgrid_bin(datumize<T>(raw_data), r);
+/**
+ * Build with a grid of 2^r cells along each axis, or without r, with the
+ * resolution() suggested for the number of points.
+ */
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::build(std::vector<T> const& raw_data) {
+    build(raw_data, resolution(raw_data.size()));
+}
+
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::build(
+    std::vector<T> const& raw_data, int const r
+) {
+    zgrid_bin(datumize<T, D>(raw_data), r);
+}
+
+/**
+ * A grid resolution which puts 32-128 points in each cell, on average, for
+ * uniformly spread points (clustered data leaves most cells emptier, and
+ * a few much fuller). Capped at 2^24 cells in all.
+ */
+template<typename T, typename S, int D>
+int spatial::Zgrid<T, S, D>::resolution(index_t const num_points) {
+    coord_t const cells = std::max<coord_t>(num_points / 64.0, 1);
+    return std::clamp<int>(std::lround(std::log2(cells) / D), 1, 24 / D);
 }
 
-template<typename T>
-void spatial::Zgrid<T>::zgrid_bin(std::vector<Datum<T>> const& data, int const r) {
-    grid.resize(std::pow(4,r));
-    for (auto const& datum : data) {
-        code_t zorder_code = zorder_hash(datum.point, r);
-        grid[zorder_code].push_back(datum);
+/**
+ * Bin the data into grid cells with a counting sort on Z-order codes,
+ * so that each cell ends up as a contiguous range of the data arrays.
+ * The cells' ranges are then handed out in the order of the chosen curve.
+ */
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::zgrid_bin(
+    std::vector<Datum<T, D>> const& unsorted_data, int const r
+) {
+    grid.assign(code_t(1) << (D * r), {0, 0});
+    std::vector<code_t> codes;
+    codes.reserve(unsorted_data.size());
+    for (auto const& datum : unsorted_data) {
+        codes.push_back(zorder_hash(datum.point, r));
+        grid[codes.back()].end++;
     }
-    root->populate(r);
+
+    // Turn the cell counts into [start, end) ranges
+    index_t offset = 0;
+    for (code_t const code : cell_order(r)) {
+        index_t const count = grid[code].end;
+        grid[code] = {offset, offset};
+        offset += count;
+    }
+
+    data.resize(unsorted_data.size());
+    for (auto& axis : coords) axis.resize(unsorted_data.size());
+    for (index_t i = 0; i < unsorted_data.size(); i++) {
+        index_t const dest = grid[codes[i]].end++;
+        data[dest] = unsorted_data[i];
+        Point const stored = quantiser.to_storage(unsorted_data[i].point);
+        for (int a = 0; a < D; a++) {
+            coords[a][dest] = quantiser.encode(stored[a]);
+        }
+    }
+    root->populate(r, nodes);
 }
 
-template<typename T>
-std::vector<T> spatial::Zgrid<T>::query_knn(
-    unsigned const k, coord_t const x, coord_t const y
+/**
+ * k-nearest neighbour query using distance browsing algorithm
+ *
+ * With epsilon > 0, the search stops as soon as no unexplored node can hold
+ * a datum more than (1+epsilon) times closer than the current k'th neighbour,
+ * so every returned neighbour is within (1+epsilon) of the true distance.
+ * If max_visits > 0, at most that many nodes are popped, which caps latency
+ * at the cost of any guarantee (and possibly fewer than k results).
+ */
+template<typename T, typename S, int D>
+std::vector<T> spatial::Zgrid<T, S, D>::query_knn(
+    unsigned const k, coord_t const x, coord_t const y,
+    coord_t const epsilon, index_t const max_visits
 ) const {
-    Point const query_point = {x, y};
+    static_assert(D == 2, "Use the Point overload of query_knn() for D != 2");
+    return query_knn(k, (Point){{x, y}}, epsilon, max_visits);
+}
 
-    NodePQ node_pq(query_point);
-    node_pq.push(root.get());
-    DatumPQ datum_pq(query_point);
+template<typename T, typename S, int D>
+std::vector<T> spatial::Zgrid<T, S, D>::query_knn(
+    unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    QueryContext context(get_resource());
+    query_knn(context, k, query_point, epsilon, max_visits);
+    return std::move(context.results);
+}
+
+/**
+ * k-NN query using the heaps and result storage of a QueryContext.
+ * The results are only valid until the next query with the same context.
+ */
+template<typename T, typename S, int D>
+std::vector<T> const& spatial::Zgrid<T, S, D>::query_knn(
+    QueryContext& context, unsigned const k, Point const query_point,
+    coord_t const epsilon, index_t const max_visits
+) const {
+    NodePQ& node_pq = context.node_pq;
+    node_pq.reset(query_point);
+    node_pq.push(root);
+    DatumPQ& datum_pq = context.datum_pq;
+    datum_pq.reset(query_point);
+    QueryStats& stats = context.stats;
+    stats = {};
+    tally(stats.queries);
+    tally(stats.nodes_pushed);
 
+    index_t visits = 0;
     while (!node_pq.empty() && (
         datum_pq.size() < k
-        || datum_pq.peek().dist > node_pq.peek().dist
+        || datum_pq.peek().dist > (1 + epsilon) * node_pq.peek().dist
     )) {
+        if (max_visits && visits++ == max_visits) break;
         Node* next_node = node_pq.pop().node;
+        tally(stats.nodes_popped);
         if (next_node->is_leaf()) {
-            for (auto const& datum : grid[next_node->code]) {
-                if (datum_pq.size() < k) {
-                    datum_pq.push(datum);
-                }
-                else {
-                    datum_pq.choose(datum);
-                }
-            }
+            scan_cell(grid[next_node->code], query_point, k, datum_pq, stats);
         } else {
             node_pq.expand(next_node);
+            tally(stats.nodes_pushed, 1 << D);
         }
     } 
+    query_totals.add(stats);
 
-    std::vector<T> query_bucket;
-    query_bucket.reserve(k);
-    while (!datum_pq.empty()) {
-        query_bucket.push_back(datum_pq.pop().datum.data);
+    // Far -> close, reusing the previous query's result storage
+    std::vector<T>& results = context.results;
+    results.resize(datum_pq.size());
+    for (auto& result : results) {
+        result = datum_pq.pop().datum->data;
     }
-    return query_bucket;
+    return results;
 }
 
-template<typename T>
-code_t spatial::Zgrid<T>::zorder_hash(Point const p, int const r) const {
+/**
+ * Offer every datum in a grid cell to the k-NN priority queue.
+ * Distances are computed in bulk by the SIMD kernel, which filters out
+ * anything farther than the current k'th neighbour before it reaches the heap.
+ */
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::scan_cell(
+    Range const cell,
+    Point const query_point,
+    unsigned const k,
+    DatumPQ& datum_pq,
+    QueryStats& stats
+) const {
+    tally(stats.leaves_scanned);
+    tally(stats.points_tested, cell.end - cell.start);
+    auto const kth_dist2 = [this, &datum_pq, k] () {
+        if (datum_pq.size() < k) {
+            return std::numeric_limits<coord_t>::infinity();
+        }
+        return quantiser.bound2(datum_pq.peek().dist);
+    };
+
+    coord_t bound2 = kth_dist2();
+    filter_block(
+        quantiser.to_storage(query_point),
+        block_pointers(coords, cell.start),
+        cell.end - cell.start,
+        bound2,
+        [&] (index_t const i, coord_t const dist2) {
+            Datum<T, D> const& datum = data[cell.start + i];
+            // Quantised distances only filter, the heap gets exact ones
+            coord_t const dist = Quantiser<S, D>::exact
+                ? std::sqrt(dist2)
+                : distance(query_point, datum.point);
+            if (datum_pq.size() < k) {
+                datum_pq.push(datum, dist);
+            } else if (datum_pq.choose(datum, dist)) {
+                tally(stats.heap_replacements);
+            }
+            bound2 = kth_dist2();
+        }
+    );
+}
+
+/**
+ * Answer a batch of k-NN queries, with results in the same order as the
+ * queries. Internally, the queries are run in the order of their Morton
+ * (or Hilbert) keys, so that consecutive queries tend to walk the same
+ * nodes and leaves while they're still in cache.
+ */
+template<typename T, typename S, int D>
+std::vector<std::vector<T>> spatial::Zgrid<T, S, D>::query_knn_batch(
+    unsigned const k,
+    std::vector<Point> const& query_points,
+    Curve const curve
+) const {
+    QueryContext context(get_resource());
+    std::vector<std::vector<T>> results(query_points.size());
+    for (index_t const i : curve_sort(query_points, curve)) {
+        results[i] = query_knn(context, k, query_points[i]);
+    }
+    return results;
+}
+
+/**
+ * Every datum within 'radius' of (x,y), inclusive, in no particular order.
+ */
+template<typename T, typename S, int D>
+std::vector<T> spatial::Zgrid<T, S, D>::query_radius(
+    coord_t const x, coord_t const y, coord_t const radius
+) const {
+    static_assert(
+        D == 2, "Use the Point overload of query_radius() for D != 2"
+    );
+    return query_radius((Point){{x, y}}, radius);
+}
+
+/**
+ * As with the quadtree: a depth-first walk of the nodes which touch the
+ * ball, with each cell filtered by the SIMD kernel against a fixed bound,
+ * and the results decided at full precision.
+ */
+template<typename T, typename S, int D>
+std::vector<T> spatial::Zgrid<T, S, D>::query_radius(
+    Point const center, coord_t const radius
+) const {
+    std::vector<T> results;
+    if (data.empty() || !(radius >= 0)) return results;
+
+    // The kernel's squared distances may round differently to distance()
+    // (and it only keeps points strictly inside), so its bound is padded,
+    // and whatever passes is checked again
+    coord_t const bound2 = std::nextafter(
+        quantiser.bound2(radius) * (1 + 1e-9),
+        std::numeric_limits<coord_t>::infinity()
+    );
+    Point const stored_center = quantiser.to_storage(center);
+    std::vector<Node*> stack = {root};
+    while (!stack.empty()) {
+        Node* const node = stack.back();
+        stack.pop_back();
+        if (distance(center, node->bounds) > radius) continue;
+        if (!node->is_leaf()) {
+            for (int i = 0; i < (1 << D); i++) {
+                stack.push_back(&node->children[i]);
+            }
+            continue;
+        }
+
+        Range const cell = grid[node->code];
+        coord_t cell_bound2 = bound2;
+        filter_block(
+            stored_center,
+            block_pointers(coords, cell.start),
+            cell.end - cell.start,
+            cell_bound2,
+            [&] (index_t const i, coord_t) {
+                Datum<T, D> const& datum = data[cell.start + i];
+                if (distance(center, datum.point) <= radius) {
+                    results.push_back(datum.data);
+                }
+            }
+        );
+    }
+    return results;
+}
+
+/**
+ * Start an incremental k-NN query around (x,y).
+ * Unlike query_knn(), k doesn't need to be known up front.
+ */
+template<typename T, typename S, int D>
+typename spatial::Zgrid<T, S, D>::Cursor spatial::Zgrid<T, S, D>::browse(
+    coord_t const x, coord_t const y
+) const {
+    static_assert(D == 2, "Use the Point overload of browse() for D != 2");
+    return browse((Point){{x, y}});
+}
+
+template<typename T, typename S, int D>
+typename spatial::Zgrid<T, S, D>::Cursor spatial::Zgrid<T, S, D>::browse(
+    Point const p
+) const {
+    return Cursor(*this, p);
+}
+
+template<typename T, typename S, int D>
+spatial::Zgrid<T, S, D>::Cursor::Cursor(Zgrid<T, S, D> const& z, Point p):
+    zgrid(z),
+    origin(p),
+    node_pq(p, zgrid.get_resource()),
+    datum_pq(Closer(), zgrid.get_resource())
+{
+    node_pq.push(zgrid.root);
+}
+
+/**
+ * Expand nodes until the closest buffered datum is at least as close as
+ * every unexplored node, i.e., until it's safe to yield that datum.
+ */
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::Cursor::advance() {
+    while (!node_pq.empty() && (
+        datum_pq.empty()
+        || datum_pq.top().dist > node_pq.peek().dist
+    )) {
+        Node* next_node = node_pq.pop().node;
+        if (next_node->is_leaf()) {
+            Range const cell = zgrid.grid[next_node->code];
+            for (index_t i = cell.start; i < cell.end; i++) {
+                Datum<T, D> const& datum = zgrid.data[i];
+                datum_pq.push((Element){datum, distance(origin, datum.point)});
+            }
+        } else {
+            node_pq.expand(next_node);
+        }
+    }
+}
+
+template<typename T, typename S, int D>
+bool spatial::Zgrid<T, S, D>::Cursor::empty() {
+    advance();
+    return datum_pq.empty();
+}
+
+/**
+ * Distance to the datum which will be returned by the next call to next().
+ * Assumes the cursor isn't empty.
+ */
+template<typename T, typename S, int D>
+coord_t spatial::Zgrid<T, S, D>::Cursor::peek_dist() {
+    advance();
+    return datum_pq.top().dist;
+}
+
+template<typename T, typename S, int D>
+T spatial::Zgrid<T, S, D>::Cursor::next() {
+    advance();
+    T const nearest = datum_pq.top().datum.data;
+    datum_pq.pop();
+    return nearest;
+}
+
+template<typename T, typename S, int D>
+code_t spatial::Zgrid<T, S, D>::zorder_hash(Point const p, int const r) const {
     Rectangle const& b = root->bounds;
-    int cellx = grid_index(p.x, b.xmin, b.xmax, std::pow(2,r));
-    int celly = grid_index(p.y, b.ymin, b.ymax, std::pow(2,r));
-    return interleave(cellx, celly);
+    std::array<uint32_t, D> cells;
+    for (int a = 0; a < D; a++) {
+        cells[a] = grid_index(p[a], b.min[a], b.max[a], 1 << r);
+    }
+    return interleave<D>(cells);
+}
+
+/**
+ * The Z-order codes of every cell, in the order that they appear along
+ * the grid's curve (which for Z-order is just 0, 1, 2, ...).
+ */
+template<typename T, typename S, int D>
+std::vector<code_t> spatial::Zgrid<T, S, D>::cell_order(int const r) const {
+    code_t const num_cells = code_t(1) << (D * r);
+    std::vector<code_t> order(num_cells);
+    for (code_t i = 0; i < num_cells; i++) {
+        // The cell's coordinates are packed r bits per axis into i
+        std::array<uint32_t, D> cells;
+        for (int a = 0; a < D; a++) {
+            cells[a] = (i >> (a * r)) & ((1 << r) - 1);
+        }
+        order[curve_key<D>(curve, cells, r)] = interleave<D>(cells);
+    }
+    return order;
 }
 
-template<typename T>
-void spatial::Zgrid<T>::Node::populate(int const r) {
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::Node::populate(
+    int const r, Arena<Node>& nodes
+) {
     if (r > 0) {
-        create_children();
-        for (int i=0; i<4; i++) { 
-            children[i]->populate(r-1);
+        create_children(nodes);
+        for (int i=0; i<(1 << D); i++) { 
+            children[i].populate(r-1, nodes);
+        }
+    }
+}
+
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::Node::create_children(Arena<Node>& nodes) {
+    // Bit a of the child index selects the upper half along axis a, and
+    // the siblings are allocated as one group, in child index order
+    children = nodes.allocate(1 << D);
+    for (int i = 0; i < (1 << D); i++) {
+        Rectangle child_bounds = bounds;
+        for (int a = 0; a < D; a++) {
+            if ((i >> a) & 1) {
+                child_bounds.min[a] = center[a];
+            } else {
+                child_bounds.max[a] = center[a];
+            }
         }
+        new (&children[i]) Node((code << D) + i, depth+1, child_bounds);
     }
 }
 
-template<typename T>
-void spatial::Zgrid<T>::Node::create_children() {
-    Rectangle const SW_bounds = {bounds.xmin, center.x, bounds.ymin, center.y};
-    children[0] = std::make_unique<Node>((code << 2) + 0, depth+1, SW_bounds);
+template<typename T, typename S, int D>
+bool spatial::Zgrid<T, S, D>::Node::is_leaf() const {
+    return (children == nullptr);
+}
+
+template<typename T, typename S, int D>
+size_t spatial::Zgrid<T, S, D>::size() {
+    return grid.size();
+}
+
+/**
+ * The memory resource which all of the index's internal storage comes from.
+ */
+template<typename T, typename S, int D>
+std::pmr::memory_resource* spatial::Zgrid<T, S, D>::get_resource() const {
+    return data.get_allocator().resource();
+}
+
+/**
+ * Roughly how much memory the grid holds: its nodes, cell ranges, data and
+ * coordinates (by capacity), plus the whole file for a loaded grid, though
+ * only the pages which queries have touched are actually resident.
+ * Anything which T itself allocates isn't counted.
+ */
+template<typename T, typename S, int D>
+std::size_t spatial::Zgrid<T, S, D>::memory_bytes() const {
+    std::size_t total = sizeof(*this) + nodes.bytes() + grid.bytes()
+        + data.bytes();
+    for (auto const& axis : coords) total += axis.bytes();
+    if (mapping) total += mapping->size();
+    return total;
+}
+
+/**
+ * The work done by every k-NN query on this grid since it was created (or
+ * since reset_stats()), on any thread. Always zero without -DSPATIAL_STATS.
+ * The per-query stats are in each query's QueryContext.
+ */
+template<typename T, typename S, int D>
+spatial::QueryStats spatial::Zgrid<T, S, D>::get_stats() const {
+    return query_totals.get();
+}
+
+template<typename T, typename S, int D>
+void spatial::Zgrid<T, S, D>::reset_stats() {
+    query_totals.reset();
+}
 
-    Rectangle const SE_bounds = {center.x, bounds.xmax, bounds.ymin, center.y};
-    children[1] = std::make_unique<Node>((code << 2) + 1, depth+1, SE_bounds);
 
-    Rectangle const NW_bounds = {bounds.xmin, center.x, center.y, bounds.ymax};
-    children[2] = std::make_unique<Node>((code << 2) + 2, depth+1, NW_bounds);
+/**
+ * Save the grid as an index file (see storage.hpp). The nodes aren't saved
+ * at all, since they're a complete tree which follows from the resolution.
+ * Returns false if the file couldn't be written.
+ */
+template<typename T, typename S, int D>
+bool spatial::Zgrid<T, S, D>::save(std::string const& path) const {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Only trivially copyable data can be saved"
+    );
+    uint64_t r = 0;
+    while (grid.size() > (std::size_t(1) << (D * r))) r++;
+    FileMeta const meta = {root->bounds, static_cast<uint64_t>(curve), r};
 
-    Rectangle const NE_bounds = {center.x, bounds.xmax, center.y, bounds.ymax};
-    children[3] = std::make_unique<Node>((code << 2) + 3, depth+1, NE_bounds);
+    IndexWriter writer;
+    writer.add(&meta, 1);
+    writer.add(grid.data(), grid.size());
+    writer.add(data.data(), data.size());
+    for (auto const& axis : coords) writer.add(axis.data(), axis.size());
+    return writer.write(path, FileHeader::describe(
+        IndexKind::zgrid, D, sizeof(S), sizeof(Datum<T, D>), 3 + D
+    ));
 }
 
-template<typename T>
-bool spatial::Zgrid<T>::Node::is_leaf() const {
-    if (children[0]) {
+/**
+ * Replace the grid with one saved by save(). As with the quadtree, the
+ * cells, data and coordinates are mapped in place (so the file mustn't be
+ * changed while the grid is using it), and only the nodes are rebuilt.
+ *
+ * Returns false, leaving the grid as it was, if the file is missing, corrupt
+ * or was saved from a different type of grid. With verify, the checksum over
+ * the whole file is checked as well.
+ */
+template<typename T, typename S, int D>
+bool spatial::Zgrid<T, S, D>::load(
+    std::string const& path, bool const verify
+) {
+    static_assert(
+        std::is_trivially_copyable<T>::value,
+        "Only trivially copyable data can be loaded"
+    );
+    auto file = IndexFile::open(path, FileHeader::describe(
+        IndexKind::zgrid, D, sizeof(S), sizeof(Datum<T, D>), 3 + D
+    ), verify);
+    if (!file) return false;
+
+    auto const [meta, num_meta] = file->section<FileMeta>(0);
+    auto const [cells, num_cells] = file->section<Range>(1);
+    auto const [datums, num_data] = file->section<Datum<T, D>>(2);
+    if (num_meta != 1 || !cells || !datums) return false;
+    uint64_t const r = meta->r;
+    if (D * r >= 64 || (
+        num_cells != (std::size_t(1) << (D * r))
+        && !(num_cells == 0 && r == 0)
+    )) {
         return false;
-    } else {
-        return true;
     }
-}
+    std::array<S const*, D> axes;
+    for (int a = 0; a < D; a++) {
+        auto const [axis, num_coords] = file->section<S>(3 + a);
+        if (num_coords != num_data) return false;
+        axes[a] = axis;
+    }
+    for (index_t i = 0; i < num_cells; i++) {
+        Range const cell = cells[i];
+        if (cell.start > cell.end || cell.end > num_data) return false;
+    }
 
-template<typename T>
-size_t spatial::Zgrid<T>::size() {
-    return grid.size();
+    nodes.clear();
+    root = nodes.create(0, 0, meta->bounds);
+    root->populate(r, nodes);
+    grid.map(cells, num_cells);
+    data.map(datums, num_data);
+    for (int a = 0; a < D; a++) coords[a].map(axes[a], num_data);
+    quantiser = Quantiser<S, D>(root->bounds);
+    curve = static_cast<Curve>(meta->curve);
+    mapping = file->release();
+    return true;
 }
@@ -4,30 +4,50 @@
 #include <vector>
 #include <memory>
 #include <queue>
+#include <algorithm>
+#include <string>
+#include <memory_resource>
 
 #include "spatial.hpp"
+#include "simd.hpp"
+#include "arena.hpp"
+#include "storage.hpp"
 
 #pragma once
 
 namespace spatial {
 
-    template<typename T>
+    /**
+     * T is the type of the data being indexed, S is the type used to
+     * store point coordinates for leaf scans (see Quantiser), and D is the
+     * number of dimensions. Each node has 2^D children, one per orthant.
+     */
+    template<typename T, typename S = coord_t, int D = 2>
     class Zgrid {
         private:
+            using Point = PointND<D>;
+            using Rectangle = RectangleND<D>;
+
             class Node {
                 public:
                     code_t code;
                     int depth;
                     Rectangle bounds;
                     Point center;
-                    std::array<std::unique_ptr<Node>,4> children;
+                    Node* children;  // 2^D siblings, adjacent in the arena
 
                     Node(code_t code, int depth, Rectangle bounds);
-                    void populate(int const r);
-                    void create_children();
+                    void populate(int const r, Arena<Node>& nodes);
+                    void create_children(Arena<Node>& nodes);
                     bool is_leaf() const;
             };
 
+            /**
+             * The node and datum priority queues keep their heaps in plain
+             * vectors (via std::push_heap and std::pop_heap), so that a
+             * QueryContext can reset() and reuse them without giving up
+             * the capacity they've already grown to.
+             */
             class NodePQ {
                 private:
                     struct Element {
@@ -41,46 +61,67 @@ namespace spatial {
                         }
                     };
 
-                    std::priority_queue<
-                        Element, 
-                        std::vector<Element>, 
-                        Closer
-                    > pq;
+                    std::pmr::vector<Element> heap;
                     Point origin;
 
                 public:
-                    NodePQ(Point p):
+                    NodePQ(
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource)
+                    { }
+
+                    NodePQ(
+                        Point p,
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource),
                         origin(p)
                     { }
 
+                    void reset(Point const p) {
+                        heap.clear();
+                        origin = p;
+                    }
+
                     void push(Node* n) {
-                        pq.push((Element){n, distance(origin, n->bounds)});
+                        heap.push_back(
+                            (Element){n, distance(origin, n->bounds)}
+                        );
+                        std::push_heap(heap.begin(), heap.end(), Closer());
                     }
 
                     Element pop() {
-                        auto const top_element = pq.top();
-                        pq.pop();
+                        std::pop_heap(heap.begin(), heap.end(), Closer());
+                        auto const top_element = heap.back();
+                        heap.pop_back();
                         return top_element;
                     }
 
-                    Element const& peek() const { return pq.top(); }
+                    Element const& peek() const { return heap.front(); }
 
-                    // Assumes n->children is a collection of smart pointers
                     void expand(Node* n) {
-                        for (auto const& child_ptr : n->children) {
-                            push(child_ptr.get());
+                        for (int i = 0; i < (1 << D); i++) {
+                            push(&n->children[i]);
                         }
                     }
 
-                    unsigned size() { return pq.size(); }
+                    unsigned size() { return heap.size(); }
 
-                    bool empty() { return (pq.empty()); }
+                    bool empty() { return (heap.empty()); }
             };
 
+            /**
+             * The k-NN candidates, as a max-heap on distance. Elements point
+             * into the tree's data rather than copying it, so they're cheap
+             * to shuffle around the heap whatever the size of T.
+             */
             class DatumPQ {
                 private:
                     struct Element {
-                        Datum<T> datum;
+                        Datum<T, D> const* datum;
                         coord_t dist;
                     };
 
@@ -90,56 +131,216 @@ namespace spatial {
                         }
                     };
 
-                    std::priority_queue<
-                        Element,
-                        std::vector<Element>, 
-                        Farther
-                    > pq;
+                    std::pmr::vector<Element> heap;
                     Point origin;
 
                 public:
-                    DatumPQ(Point p):
+                    DatumPQ(
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource)
+                    { }
+
+                    DatumPQ(
+                        Point p,
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        heap(resource),
                         origin(p)
                     { }
 
-                    void push(Datum<T> const& d) {
-                        pq.push((Element){d, distance(origin, d.point)});
+                    void reset(Point const p) {
+                        heap.clear();
+                        origin = p;
+                    }
+
+                    void push(Datum<T, D> const& d) {
+                        push(d, distance(origin, d.point));
+                    }
+
+                    void push(Datum<T, D> const& d, coord_t const dist) {
+                        heap.push_back((Element){&d, dist});
+                        std::push_heap(heap.begin(), heap.end(), Farther());
                     }
 
                     Element pop() {
-                        auto const top_element = pq.top();
-                        pq.pop();
+                        std::pop_heap(heap.begin(), heap.end(), Farther());
+                        auto const top_element = heap.back();
+                        heap.pop_back();
                         return top_element;
                     }
 
-                    Element const& peek() const { return pq.top(); }
+                    Element const& peek() const { return heap.front(); }
+
+                    bool choose(Datum<T, D> const& d) {
+                        return choose(d, distance(origin, d.point));
+                    }
 
-                    void choose(Datum<T> const& d) {
-                        coord_t const new_dist = distance(origin, d.point);
+                    bool choose(Datum<T, D> const& d, coord_t const new_dist) {
                         if (peek().dist > new_dist) {
-                            pq.pop();
-                            pq.push((Element){d, new_dist});
+                            // Replace the farthest candidate in place
+                            std::pop_heap(heap.begin(), heap.end(), Farther());
+                            heap.back() = (Element){&d, new_dist};
+                            std::push_heap(heap.begin(), heap.end(), Farther());
+                            return true;
                         }
+                        return false;
                     }
 
-                    unsigned size() { return pq.size(); }
+                    unsigned size() { return heap.size(); }
 
-                    bool empty() { return (pq.empty()); }
+                    bool empty() { return (heap.empty()); }
             };
 
-            std::unique_ptr<Node> root;
-            std::vector<std::vector<Datum<T>>> grid;
+            Arena<Node> nodes;  // every node, freed all at once
+            Node* root;
+
+            /**
+             * All of the data is stored contiguously, sorted by cell along
+             * the chosen curve (though the grid itself is always indexed by
+             * Z-order code). Each grid cell is a [start, end) range into
+             * these arrays, and the point coordinates are duplicated in
+             * structure-of-arrays layout (one array per axis) so that cell
+             * scans only have to stream through the coordinates.
+             * Those coordinates are stored as S, so narrowing S to float or a
+             * quantised integer type shrinks the bytes streamed per point.
+             */
+            MappedVector<Range> grid;
+            MappedVector<Datum<T, D>> data;
+            std::array<MappedVector<S>, D> coords;
+            Quantiser<S, D> quantiser;
+            Curve curve;
+            std::unique_ptr<MappedFile> mapping;  // see load()
+            mutable QueryTotals query_totals;  // (with -DSPATIAL_STATS)
 
-            void zgrid_bin(std::vector<Datum<T>> const& data, int const r);
+            struct FileMeta {
+                Rectangle bounds;
+                uint64_t curve;
+                uint64_t r;
+            };
+
+            void zgrid_bin(std::vector<Datum<T, D>> const& data, int const r);
             code_t zorder_hash(Point const p, int const r) const;
+            std::vector<code_t> cell_order(int const r) const;
+            void scan_cell(
+                Range const cell,
+                Point const query_point,
+                unsigned const k,
+                DatumPQ& datum_pq,
+                QueryStats& stats
+            ) const;
 
         public:
-            Zgrid(coord_t x0, coord_t x1, coord_t y0, coord_t y1);
+            /**
+             * Scratch space for k-NN queries, which callers can keep around
+             * (one per thread) to avoid allocating for every query: the heaps
+             * and the result vector are reset, but keep their capacity.
+             */
+            class QueryContext {
+                private:
+                    friend class Zgrid;
+
+                    NodePQ node_pq;
+                    DatumPQ datum_pq;
+                    std::vector<T> results;  // (handed back to the caller)
+                    QueryStats stats;  // of the last query
+
+                public:
+                    QueryContext(
+                        std::pmr::memory_resource* const resource
+                            = std::pmr::get_default_resource()
+                    ):
+                        node_pq(resource),
+                        datum_pq(resource)
+                    { }
+
+                    QueryStats const& get_stats() const { return stats; }
+            };
+
+            /**
+             * A resumable distance browsing query. Each call to next()
+             * yields the next nearest datum, without restarting the search.
+             */
+            class Cursor {
+                private:
+                    struct Element {
+                        Datum<T, D> datum;
+                        coord_t dist;
+                    };
+
+                    struct Closer {
+                        bool operator()(Element const a, Element const b) {
+                            return (a.dist > b.dist);
+                        }
+                    };
+
+                    Zgrid<T, S, D> const& zgrid;
+                    Point origin;
+                    NodePQ node_pq;
+                    std::priority_queue<
+                        Element,
+                        std::pmr::vector<Element>,
+                        Closer
+                    > datum_pq;
+
+                    void advance();
+
+                public:
+                    Cursor(Zgrid<T, S, D> const& zgrid, Point p);
+                    bool empty();
+                    coord_t peek_dist();
+                    T next();
+            };
+
+            Zgrid(
+                coord_t x0, coord_t x1, coord_t y0, coord_t y1,
+                Curve const curve = Curve::zorder,
+                std::pmr::memory_resource* const resource
+                    = std::pmr::get_default_resource()
+            );
+            Zgrid(
+                Rectangle const bounds,
+                Curve const curve = Curve::zorder,
+                std::pmr::memory_resource* const resource
+                    = std::pmr::get_default_resource()
+            );
+            void build(std::vector<T> const& raw_data);
             void build(std::vector<T> const& raw_data, int const r);
+            static int resolution(index_t const num_points);
             std::vector<T> query_knn(
-                unsigned const k, coord_t const x, coord_t const y
+                unsigned const k, coord_t const x, coord_t const y,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
+            std::vector<T> query_knn(
+                unsigned const k, Point const query_point,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
+            std::vector<T> const& query_knn(
+                QueryContext& context,
+                unsigned const k, Point const query_point,
+                coord_t const epsilon = 0, index_t const max_visits = 0
+            ) const;
+            std::vector<std::vector<T>> query_knn_batch(
+                unsigned const k, std::vector<Point> const& query_points,
+                Curve const curve = Curve::zorder
+            ) const;
+            std::vector<T> query_radius(
+                coord_t const x, coord_t const y, coord_t const radius
+            ) const;
+            std::vector<T> query_radius(
+                Point const center, coord_t const radius
             ) const;
+            Cursor browse(coord_t const x, coord_t const y) const;
+            Cursor browse(Point const p) const;
+            std::pmr::memory_resource* get_resource() const;
+            std::size_t memory_bytes() const;
+            QueryStats get_stats() const;
+            void reset_stats();
             size_t size();
+            bool save(std::string const& path) const;
+            bool load(std::string const& path, bool const verify = false);
     };
 
 }
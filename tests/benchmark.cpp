@@ -0,0 +1,364 @@
+// benchmark.cpp
+/**
+ * Usage: ./benchmark [options] <data1.txt> <query1.txt> <data2.txt> ...
+ *        ./benchmark --compare <baseline.json> <candidate.json> [--threshold t]
+ *
+ * Options:
+ *   --trials n     timed repetitions of every benchmark (default 5)
+ *   --warmup n     untimed repetitions before those (default 1)
+ *   --json path    also write the results as JSON, for --compare
+ *   --counters     also count cycles, instructions, cache, branch and TLB
+ *                  misses (see perf_counters.hpp) over every build and
+ *                  batch of queries, and report them per point or query
+ *
+ * Unlike timing.cpp, which times whole loops to get a quick overview, this
+ * times every build and every single query with steady_clock, over several
+ * trials after warming up, and reports the distribution: percentiles of the
+ * per-query latencies (pooled over the trials), and the spread between the
+ * trials' medians, which is a measure of how noisy the results are.
+ *
+ * --compare reads two JSON files written by --json (by this, or by any of
+ * the other benchmarks built on benchmark_harness.hpp), and flags every
+ * benchmark whose median got slower by more than the threshold (default 5%),
+ * but only if every trial of the candidate was slower than every trial of
+ * the baseline, too. By chance alone, that happens with probability
+ * 2 / (2n choose n) for n trials each (under 1% for the default of 5),
+ * so noisy benchmarks don't raise false alarms.
+ * It exits with status 1 if there were any regressions.
+ *
+ * Compiled with -DSPATIAL_STATS, it also reports how much of each index the
+ * queries explored (see spatial::QueryStats), averaged per query.
+ *
+ * The counters need Linux, and perf_event_paranoid <= 2 (or CAP_PERFMON);
+ * hardware events also need a PMU, which many VMs don't expose. Events which
+ * can't be opened are reported as n/a, and the timings are unaffected either
+ * way, since the counters are only started and stopped around whole trials.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <map>
+
+#include "../src/quadtree.cpp"
+#include "../src/rtree.cpp"
+#include "../src/zgrid.cpp"
+#include "../scripts/lidar_reader.cpp"
+#include "benchmark_harness.hpp"
+
+using coord_t = spatial::coord_t;
+
+template<typename Index>
+void query_benchmarks(
+    std::vector<Result>& results,
+    std::string const& name,
+    Settings const& settings,
+    Index const& index,
+    std::vector<spatial::Point> const& queries
+) {
+    for (unsigned const k : {1, 8, 32}) {
+        results.push_back(time_queries(
+            name + "/knn/k=" + std::to_string(k), settings, index, queries, k
+        ));
+    }
+}
+
+void index_benchmarks(
+    std::vector<Result>& results,
+    Settings const& settings,
+    std::string const& data_file,
+    std::string const& query_file
+) {
+    LidarReader data_reader(data_file);
+    LidarReader query_reader(query_file);
+    auto const min = data_reader.get_min();
+    auto const max = data_reader.get_max();
+    auto const& point_data = data_reader.get_point_data();
+    std::vector<spatial::Point> queries;
+    for (auto const& q : query_reader.get_point_data()) {
+        queries.push_back({q[0], q[1]});
+    }
+    std::string const prefix = (
+        data_file.substr(data_file.rfind('/') + 1) + "/"
+    );
+
+    using Raw = std::vector<coord_t>;
+    auto const build_quadtree = [&] () {
+        auto qt = std::make_unique<spatial::Quadtree<Raw>>(
+            min[0], max[0], min[1], max[1]
+        );
+        qt->build(point_data);
+        return qt;
+    };
+    results.push_back(time_build(
+        prefix + "quadtree/build", settings, point_data.size(), build_quadtree
+    ));
+    query_benchmarks(
+        results, prefix + "quadtree", settings, *build_quadtree(), queries
+    );
+
+    auto const build_quadtree_uint16 = [&] () {
+        auto qt = std::make_unique<spatial::Quadtree<Raw, uint16_t>>(
+            min[0], max[0], min[1], max[1]
+        );
+        qt->build(point_data);
+        return qt;
+    };
+    query_benchmarks(
+        results, prefix + "quadtree_uint16", settings,
+        *build_quadtree_uint16(), queries
+    );
+
+    auto const build_rtree = [&] () {
+        auto rtree = std::make_unique<spatial::Rtree<Raw>>();
+        rtree->bulk_load(point_data);
+        rtree->pack();
+        return rtree;
+    };
+    results.push_back(time_build(
+        prefix + "rtree/build", settings, point_data.size(), build_rtree
+    ));
+    query_benchmarks(
+        results, prefix + "rtree", settings, *build_rtree(), queries
+    );
+
+    auto const build_zgrid = [&] () {
+        auto zgrid = std::make_unique<spatial::Zgrid<Raw>>(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid->build(point_data, 7);
+        return zgrid;
+    };
+    results.push_back(time_build(
+        prefix + "zgrid/build", settings, point_data.size(), build_zgrid
+    ));
+    query_benchmarks(
+        results, prefix + "zgrid", settings, *build_zgrid(), queries
+    );
+}
+
+void print_results(std::vector<Result> const& results) {
+    std::cout << std::left << std::setw(36) << "benchmark" << std::right
+              << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p999 us" << std::setw(10) << "mean us"
+              << std::setw(10) << "spread" << "\n";
+    std::cout << std::fixed << std::setprecision(2);
+    for (auto const& result : results) {
+        Summary const s = summarise(result);
+        std::cout << std::left << std::setw(36) << result.name << std::right
+                  << std::setw(10) << s.p50 / 1000
+                  << std::setw(10) << s.p99 / 1000
+                  << std::setw(10) << s.p999 / 1000
+                  << std::setw(10) << s.mean / 1000
+                  << std::setw(9) << s.spread * 100 << "%\n";
+    }
+}
+
+/**
+ * The counters (averaged over the trials) per point built or query made.
+ */
+void print_counters(std::vector<Result> const& results) {
+    std::cout << "\n" << std::left << std::setw(48) << "counters" << std::right;
+    for (int e = 0; e < PerfCounters::num_events; e++) {
+        std::cout << std::setw(15) << PerfCounters::name(e);
+    }
+    std::cout << "\n" << std::fixed << std::setprecision(2);
+    for (auto const& result : results) {
+        if (!result.units) continue;
+        std::cout << std::left << std::setw(48)
+                  << result.name + " (/" + result.unit + ")" << std::right;
+        for (int e = 0; e < PerfCounters::num_events; e++) {
+            if (std::isnan(result.counts[e])) {
+                std::cout << std::setw(15) << "n/a";
+            } else {
+                std::cout << std::setw(15) << result.counts[e] / result.units;
+            }
+        }
+        std::cout << "\n";
+    }
+}
+
+/**
+ * The traversal stats of the queries, per query.
+ */
+void print_stats(std::vector<Result> const& results) {
+    std::cout << "\n" << std::left << std::setw(36) << "stats (/query)"
+              << std::right << std::setw(10) << "popped"
+              << std::setw(10) << "pushed" << std::setw(10) << "leaves"
+              << std::setw(10) << "points" << std::setw(10) << "replaced"
+              << "\n" << std::fixed << std::setprecision(2);
+    for (auto const& result : results) {
+        spatial::QueryStats const& s = result.stats;
+        if (!s.queries) continue;
+        double const n = s.queries;
+        std::cout << std::left << std::setw(36) << result.name << std::right
+                  << std::setw(10) << s.nodes_popped / n
+                  << std::setw(10) << s.nodes_pushed / n
+                  << std::setw(10) << s.leaves_scanned / n
+                  << std::setw(10) << s.points_tested / n
+                  << std::setw(10) << s.heap_replacements / n << "\n";
+    }
+}
+
+/**
+ * The summaries in a file written by write_json(), by name.
+ * Only the fields which --compare needs are read back.
+ */
+std::map<std::string, Summary> read_json(std::string const& path) {
+    std::map<std::string, Summary> summaries;
+    std::ifstream in(path);
+    std::string line;
+    auto const field = [&line] (char const* key) {
+        std::size_t const at = line.find("\"" + std::string(key) + "\": ");
+        if (at == std::string::npos) return 0.0;
+        return std::strtod(line.c_str() + at + std::strlen(key) + 4, nullptr);
+    };
+    while (getline(in, line)) {
+        std::size_t const at = line.find("{\"name\": \"");
+        if (at == std::string::npos) continue;
+        std::size_t const start = at + 10;
+        std::string const name = line.substr(
+            start, line.find('"', start) - start
+        );
+        Summary s = {};
+        s.p50 = field("p50");
+        s.p99 = field("p99");
+        s.spread = field("spread");
+        std::size_t at_medians = line.find("\"trial_p50s\": [");
+        if (at_medians != std::string::npos) {
+            char const* p = line.c_str() + at_medians + 15;
+            char* end;
+            for (double m = std::strtod(p, &end); end != p;
+                m = std::strtod(p, &end)
+            ) {
+                s.medians.push_back(m);
+                p = end + (*end == ',');
+            }
+        }
+        summaries[name] = s;
+    }
+    return summaries;
+}
+
+/**
+ * Returns the number of regressions.
+ */
+int compare(
+    std::string const& baseline_path,
+    std::string const& candidate_path,
+    double const threshold
+) {
+    auto const baseline = read_json(baseline_path);
+    auto const candidate = read_json(candidate_path);
+    if (baseline.empty() || candidate.empty()) {
+        std::cout << "Couldn't read any results to compare\n";
+        return 1;
+    }
+
+    std::cout << std::left << std::setw(36) << "benchmark" << std::right
+              << std::setw(12) << "base p50 us" << std::setw(12) << "new p50 us"
+              << std::setw(10) << "change" << std::setw(10) << "p99 chg"
+              << "\n" << std::fixed << std::setprecision(2);
+    int regressions = 0;
+    for (auto const& [name, base] : baseline) {
+        auto const found = candidate.find(name);
+        if (found == candidate.end()) {
+            std::cout << std::left << std::setw(36) << name << "  (missing)\n";
+            continue;
+        }
+        Summary const& next = found->second;
+        double const change = next.p50 / base.p50 - 1;
+        double const p99_change = next.p99 / base.p99 - 1;
+        std::cout << std::left << std::setw(36) << name << std::right
+                  << std::setw(12) << base.p50 / 1000
+                  << std::setw(12) << next.p50 / 1000
+                  << std::setw(9) << change * 100 << "%"
+                  << std::setw(9) << p99_change * 100 << "%";
+        bool const separated = (
+            !base.medians.empty() && !next.medians.empty()
+        );
+        if (change > threshold && separated
+            && next.medians.front() > base.medians.back()
+        ) {
+            std::cout << "  REGRESSION";
+            regressions++;
+        } else if (change < -threshold && separated
+            && next.medians.back() < base.medians.front()
+        ) {
+            std::cout << "  improved";
+        }
+        std::cout << "\n";
+    }
+    std::cout << regressions << " regression(s)\n";
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+
+    Settings settings;
+    std::string json_path;
+    std::vector<std::string> files;
+    bool comparing = false;
+    double threshold = 0.05;
+    bool counting = false;
+    for (int i=1; i<argc; i++) {
+        std::string const arg = argv[i];
+        if (arg == "--trials" && i+1 < argc) {
+            settings.trials = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && i+1 < argc) {
+            settings.warmup = std::atoi(argv[++i]);
+        } else if (arg == "--json" && i+1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--threshold" && i+1 < argc) {
+            threshold = std::atof(argv[++i]);
+        } else if (arg == "--compare") {
+            comparing = true;
+        } else if (arg == "--counters") {
+            counting = true;
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    if (comparing) {
+        if (files.size() != 2) {
+            std::cout << "--compare needs a baseline and a candidate file\n";
+            return 2;
+        }
+        return compare(files[0], files[1], threshold) ? 1 : 0;
+    }
+
+    std::unique_ptr<PerfCounters> counters;
+    if (counting) {
+        counters = std::make_unique<PerfCounters>();
+        if (counters->available()) {
+            settings.counters = counters.get();
+            for (int e = 0; e < PerfCounters::num_events; e++) {
+                if (!counters->available(e)) {
+                    std::cout << "(" << PerfCounters::name(e)
+                              << " isn't available here)\n";
+                }
+            }
+        } else {
+            std::cout << "(No performance counters are available here)\n";
+        }
+    }
+
+    std::vector<Result> results;
+    for (std::size_t i=0; i+1<files.size(); i+=2) {
+        index_benchmarks(results, settings, files[i], files[i+1]);
+    }
+    print_results(results);
+    if (settings.counters) print_counters(results);
+    if (spatial::collect_stats) print_stats(results);
+    if (!json_path.empty() && !write_json(json_path, settings, results)) {
+        std::cout << "Unable to write \"" << json_path << "\"\n";
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,337 @@
+// benchmark_harness.hpp
+/**
+ * The timing shared by the benchmark programs: every build and every single
+ * query is timed with steady_clock, over several trials (after some untimed
+ * warm up runs), and kept as a Result, which print and write_json() summarise
+ * with percentiles. Results written with write_json() can be compared
+ * between versions by ./benchmark --compare (see benchmark.cpp), whichever
+ * program wrote them.
+ *
+ * It also has the odds and ends which every benchmark needs: keep(), so
+ * that the compiler can't drop work whose result is never used, built(), and
+ * make_uniform(), for uniformly random points to compare against the real
+ * (or realistic) data.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "../src/spatial.hpp"
+#include "perf_counters.hpp"
+
+#pragma once
+
+using Clock = std::chrono::steady_clock;
+
+struct Settings {
+    unsigned trials = 5;
+    unsigned warmup = 1;
+    PerfCounters* counters = nullptr;
+};
+
+/**
+ * Every timing (in nanoseconds) taken for one benchmark, by trial, and the
+ * counters summed over the trials, with the number of points or queries
+ * they cover (zero if they weren't counted).
+ */
+struct Result {
+    std::string name;
+    std::vector<std::vector<double>> trials;
+    PerfCounters::Counts counts;
+    double units;
+    char const* unit;  // ("point" or "query")
+    spatial::QueryStats stats;  // over every timed query
+};
+
+struct Summary {
+    std::size_t samples;
+    double mean, min, p50, p99, p999, max;
+    std::vector<double> medians;  // of each trial, in ascending order
+    double spread;  // (max - min) / median of the trials' medians
+    std::vector<std::pair<double, std::size_t>> histogram;  // see summarise()
+};
+
+double elapsed_ns(Clock::time_point const start, Clock::time_point const end) {
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+/**
+ * Use a value, as far as the compiler can tell, so that the work which went
+ * into it can't be elided.
+ */
+template<typename V>
+void keep(V const& value) {
+    if (value == V(42)) std::cout << "";
+}
+
+/**
+ * Build an index over points, and hand it back: the build() functions passed
+ * to time_build() return their index in a unique_ptr, so that destroying it
+ * isn't timed along with the build.
+ */
+template<typename Index, typename Points>
+std::unique_ptr<Index> built(
+    std::unique_ptr<Index> index, Points const& points
+) {
+    index->build(points);
+    return index;
+}
+
+/**
+ * Replace every point with one drawn uniformly from [min, max].
+ */
+template<typename Array>
+void make_uniform(
+    std::vector<Array>& points,
+    Array const& min,
+    Array const& max,
+    uint64_t const seed
+) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::uniform_real_distribution<double>> along;
+    for (std::size_t a = 0; a < min.size(); a++) {
+        along.emplace_back(min[a], max[a]);
+    }
+    for (auto& p : points) {
+        for (std::size_t a = 0; a < p.size(); a++) p[a] = along[a](rng);
+    }
+}
+
+/**
+ * Start the counters, if they're being used.
+ */
+void start_counting(Settings const& settings) {
+    if (settings.counters) settings.counters->start();
+}
+
+/**
+ * Stop the counters, and add their counts (and the points or queries they
+ * covered) to the result.
+ */
+void stop_counting(
+    Settings const& settings, Result& result, std::size_t const units
+) {
+    if (!settings.counters) return;
+    auto const counts = settings.counters->stop();
+    for (int e = 0; e < PerfCounters::num_events; e++) {
+        result.counts[e] += counts[e];
+    }
+    result.units += units;
+}
+
+/**
+ * Nearest rank percentile of sorted samples, for q in [0, 1].
+ */
+double percentile(std::vector<double> const& sorted, double const q) {
+    std::size_t const rank = std::ceil(q * sorted.size());
+    return sorted[std::clamp<std::size_t>(rank, 1, sorted.size()) - 1];
+}
+
+/**
+ * Summary statistics, with a histogram in power of two buckets:
+ * (upper bound, count) for every bucket from the smallest sample's
+ * up to the largest's.
+ */
+Summary summarise(Result const& result) {
+    std::vector<double> all;
+    std::vector<double> medians;
+    for (auto trial : result.trials) {
+        all.insert(all.end(), trial.begin(), trial.end());
+        std::sort(trial.begin(), trial.end());
+        medians.push_back(percentile(trial, 0.5));
+    }
+    std::sort(all.begin(), all.end());
+    std::sort(medians.begin(), medians.end());
+
+    Summary s;
+    s.samples = all.size();
+    s.mean = 0;
+    for (double const x : all) s.mean += x / all.size();
+    s.min = all.front();
+    s.p50 = percentile(all, 0.5);
+    s.p99 = percentile(all, 0.99);
+    s.p999 = percentile(all, 0.999);
+    s.max = all.back();
+    s.medians = medians;
+    s.spread = (medians.back() - medians.front()) / percentile(medians, 0.5);
+
+    double bound = 1;
+    while (bound < s.min) bound *= 2;
+    auto sample = all.begin();
+    while (sample != all.end()) {
+        auto const next = std::upper_bound(sample, all.end(), bound);
+        s.histogram.push_back({bound, next - sample});
+        sample = next;
+        bound *= 2;
+    }
+    return s;
+}
+
+/**
+ * Time building an index of num_points points, once per trial, from scratch
+ * each time. build() returns the index in a unique_ptr, so that destroying
+ * it isn't timed along with the build.
+ */
+template<typename Build>
+Result time_build(
+    std::string const& name,
+    Settings const& settings,
+    std::size_t const num_points,
+    Build const& build
+) {
+    Result result = {name, {}, {}, 0, "point", {}};
+    for (unsigned i = 0; i < settings.warmup; i++) build();
+    for (unsigned i = 0; i < settings.trials; i++) {
+        start_counting(settings);
+        auto const start = Clock::now();
+        auto const index = build();
+        auto const end = Clock::now();
+        stop_counting(settings, result, num_points);
+        result.trials.push_back({elapsed_ns(start, end)});
+    }
+    return result;
+}
+
+/**
+ * Time query(p) individually for every point p in queries, over every
+ * trial. It returns the points found, which are only let go of once the
+ * clock's stopped.
+ */
+template<typename Index, typename Query>
+Result time_each_query(
+    std::string const& name,
+    Settings const& settings,
+    Index const& index,
+    std::vector<spatial::Point> const& queries,
+    Query const& query
+) {
+    Result result = {name, {}, {}, 0, "query", {}};
+    std::size_t filler = 0;
+    for (unsigned i = 0; i < settings.warmup; i++) {
+        for (auto const& p : queries) filler += query(p).size();
+    }
+    spatial::QueryStats const before = index.get_stats();
+    for (unsigned i = 0; i < settings.trials; i++) {
+        std::vector<double> latencies;
+        latencies.reserve(queries.size());
+        start_counting(settings);
+        for (auto const& p : queries) {
+            auto const start = Clock::now();
+            auto const found = query(p);
+            auto const end = Clock::now();
+            filler += found.size();
+            latencies.push_back(elapsed_ns(start, end));
+        }
+        stop_counting(settings, result, queries.size());
+        result.trials.push_back(std::move(latencies));
+    }
+    keep(filler);
+
+    spatial::QueryStats const after = index.get_stats();
+    result.stats = {
+        after.queries - before.queries,
+        after.nodes_popped - before.nodes_popped,
+        after.nodes_pushed - before.nodes_pushed,
+        after.leaves_scanned - before.leaves_scanned,
+        after.points_tested - before.points_tested,
+        after.heap_replacements - before.heap_replacements
+    };
+    return result;
+}
+
+/**
+ * Time every k-NN query individually, over every trial.
+ */
+template<typename Index>
+Result time_queries(
+    std::string const& name,
+    Settings const& settings,
+    Index const& index,
+    std::vector<spatial::Point> const& queries,
+    unsigned const k
+) {
+    return time_each_query(name, settings, index, queries,
+        [&] (spatial::Point const& p) { return index.query_knn(k, p); }
+    );
+}
+
+/**
+ * Time every radius query individually, over every trial.
+ */
+template<typename Index>
+Result time_radius_queries(
+    std::string const& name,
+    Settings const& settings,
+    Index const& index,
+    std::vector<spatial::Point> const& queries,
+    spatial::coord_t const radius
+) {
+    return time_each_query(name, settings, index, queries,
+        [&] (spatial::Point const& p) { return index.query_radius(p, radius); }
+    );
+}
+
+/**
+ * One result per line, which keeps read_json() (in benchmark.cpp) trivial.
+ */
+bool write_json(
+    std::string const& path,
+    Settings const& settings,
+    std::vector<Result> const& results
+) {
+    std::ofstream out(path);
+    out << std::setprecision(10);
+    out << "{\n  \"trials\": " << settings.trials
+        << ",\n  \"warmup\": " << settings.warmup
+        << ",\n  \"unit\": \"ns\",\n  \"results\": [\n";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        Summary const s = summarise(results[i]);
+        out << "    {\"name\": \"" << results[i].name << "\""
+            << ", \"samples\": " << s.samples
+            << ", \"mean\": " << s.mean
+            << ", \"min\": " << s.min
+            << ", \"p50\": " << s.p50
+            << ", \"p99\": " << s.p99
+            << ", \"p999\": " << s.p999
+            << ", \"max\": " << s.max
+            << ", \"spread\": " << s.spread
+            << ", \"trial_p50s\": [";
+        for (std::size_t t = 0; t < s.medians.size(); t++) {
+            out << (t ? ", " : "") << s.medians[t];
+        }
+        out << "]"
+            << ", \"histogram\": [";
+        for (std::size_t b = 0; b < s.histogram.size(); b++) {
+            out << (b ? ", " : "") << "[" << s.histogram[b].first
+                << ", " << s.histogram[b].second << "]";
+        }
+        out << "]";
+        if (results[i].units) {
+            // (per point or query; null where the event wasn't available)
+            out << ", \"counters_per\": \"" << results[i].unit << "\""
+                << ", \"counters\": {";
+            for (int e = 0; e < PerfCounters::num_events; e++) {
+                double const count = results[i].counts[e];
+                out << (e ? ", " : "") << "\"" << PerfCounters::name(e)
+                    << "\": ";
+                if (std::isnan(count)) {
+                    out << "null";
+                } else {
+                    out << count / results[i].units;
+                }
+            }
+            out << "}";
+        }
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return bool(out);
+}
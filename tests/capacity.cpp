@@ -0,0 +1,216 @@
+// capacity.cpp
+/**
+ * Usage: ./capacity [--points n] [--queries n] [--trials n] [--warmup n]
+ *                   [--json path]
+ *
+ * Builds and queries the quadtree at leaf capacities of 4 to 128 points (with
+ * double and float coordinate storage), and the R-tree at fan-outs of 4 to 64
+ * (bulk loaded and packed, and built by insertion), on a synthetic scan of
+ * --points points (default 1M, see lidar_generator.hpp), and on uniformly
+ * random points of the same size and bounds. Both are template parameters,
+ * so every variant is compiled into this one binary.
+ *
+ * Reported per point built (the median over the trials), per k-NN query
+ * (k=8) and per radius query (of about 32 points; both the mean), along with
+ * the index's memory per point, and with --json, in full (see
+ * benchmark_harness.hpp), for ./benchmark --compare. Queries are sampled
+ * from the data. There's one trial and no warm up by default; --compare
+ * needs a few trials to tell a regression from noise.
+ *
+ * Compile with -mavx2 (or -march=native) to enable the SIMD scans, whose
+ * trade-offs differ from the scalar loops'.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <utility>
+#include <memory>
+
+#include "../src/quadtree.cpp"
+#include "../src/rtree.cpp"
+#include "../scripts/lidar_generator.cpp"
+#include "benchmark_harness.hpp"
+
+using coord_t = spatial::coord_t;
+using Array = std::array<coord_t, 3>;
+
+struct Workload {
+    std::string name;  // (which the results' names start with)
+    std::vector<Array> const& points;
+    spatial::Rectangle bounds;
+    std::vector<spatial::Point> queries;
+    coord_t radius;
+};
+
+/**
+ * Time build() (see time_build()), and the queries over the index it builds.
+ */
+template<typename Build>
+void capacity_benchmark(
+    std::vector<Result>& results,
+    Settings const& settings,
+    std::string const& label,
+    Workload const& workload,
+    Build const& build
+) {
+    std::size_t const n = workload.points.size();
+    std::string name = workload.name + "/" + label;
+    std::replace(name.begin(), name.end(), ' ', '/');
+    results.push_back(time_build(name + "/build", settings, n, build));
+    double const build_ns = summarise(results.back()).p50 / n;
+
+    auto const index = build();
+    results.push_back(time_queries(
+        name + "/knn/k=8", settings, *index, workload.queries, 8
+    ));
+    double const knn_us = summarise(results.back()).mean / 1000;
+    results.push_back(time_radius_queries(
+        name + "/radius", settings, *index, workload.queries, workload.radius
+    ));
+    double const radius_us = summarise(results.back()).mean / 1000;
+
+    std::cout << "\t\t" << std::left << std::setw(22) << label << std::right
+              << std::setw(9) << build_ns << " ns/point build"
+              << std::setw(9) << knn_us << " us/k-NN"
+              << std::setw(9) << radius_us << " us/radius"
+              << std::setw(9) << double(index->memory_bytes()) / n
+              << " bytes/point\n";
+}
+
+template<typename S, int... Ls>
+void quadtree_benchmarks(
+    std::vector<Result>& results,
+    Settings const& settings,
+    std::string const& storage,
+    Workload const& workload,
+    std::integer_sequence<int, Ls...>
+) {
+    (capacity_benchmark(
+        results, settings, "quadtree " + storage + " L=" + std::to_string(Ls),
+        workload, [&] () {
+            return built(
+                std::make_unique<spatial::Quadtree<Array, S, 2, Ls>>(
+                    workload.bounds
+                ),
+                workload.points
+            );
+        }
+    ), ...);
+}
+
+template<int... Ms>
+void rtree_benchmarks(
+    std::vector<Result>& results,
+    Settings const& settings,
+    Workload const& workload,
+    std::integer_sequence<int, Ms...>
+) {
+    (capacity_benchmark(
+        results, settings, "rtree packed M=" + std::to_string(Ms),
+        workload, [&] () {
+            auto rtree = std::make_unique<spatial::Rtree<Array, 2, Ms>>();
+            rtree->bulk_load(workload.points);
+            rtree->pack();
+            return rtree;
+        }
+    ), ...);
+    (capacity_benchmark(
+        results, settings, "rtree inserted M=" + std::to_string(Ms),
+        workload, [&] () {
+            auto rtree = std::make_unique<spatial::Rtree<Array, 2, Ms>>();
+            rtree->build(workload.points);
+            rtree->pack();
+            return rtree;
+        }
+    ), ...);
+}
+
+void index_benchmarks(
+    std::vector<Result>& results,
+    Settings const& settings,
+    std::string const& name,
+    std::vector<Array> const& points,
+    Array const& min,
+    Array const& max,
+    std::size_t const num_queries
+) {
+    std::size_t const n = points.size();
+    std::mt19937_64 rng(n);
+    std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+    Workload workload = {
+        name, points, {{min[0], min[1]}, {max[0], max[1]}}, {}, 0
+    };
+    for (std::size_t i = 0; i < num_queries; i++) {
+        Array const& p = points[pick(rng)];
+        workload.queries.push_back({p[0], p[1]});
+    }
+    // (about 32 points on average, were they spread evenly)
+    coord_t const area = (max[0] - min[0]) * (max[1] - min[1]);
+    workload.radius = std::sqrt(32 * area / n / M_PI);
+
+    std::cout << std::fixed << std::setprecision(2);
+    using Capacities = std::integer_sequence<int, 4, 8, 16, 32, 64, 128>;
+    quadtree_benchmarks<coord_t>(
+        results, settings, "double", workload, Capacities()
+    );
+    quadtree_benchmarks<float>(
+        results, settings, "float", workload, Capacities()
+    );
+    rtree_benchmarks(
+        results, settings, workload,
+        std::integer_sequence<int, 4, 8, 16, 32, 64>()
+    );
+}
+
+int main(int argc, char** argv) {
+
+    std::size_t num_points = 1000000;
+    std::size_t num_queries = 10000;
+    Settings settings;
+    settings.trials = 1;
+    settings.warmup = 0;
+    std::string json_path;
+    for (int i=1; i<argc; i++) {
+        std::string const arg = argv[i];
+        if (arg == "--points" && i+1 < argc) {
+            num_points = std::max(1ull, std::strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--queries" && i+1 < argc) {
+            num_queries = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--trials" && i+1 < argc) {
+            settings.trials = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && i+1 < argc) {
+            settings.warmup = std::atoi(argv[++i]);
+        } else if (arg == "--json" && i+1 < argc) {
+            json_path = argv[++i];
+        }
+    }
+
+    LidarScene scene;
+    scene.num_points = num_points;
+    std::vector<Array> points = generate_lidar(scene);
+    LidarGenerator const generator(scene);
+    Array const min = generator.get_min();
+    Array const max = generator.get_max();
+    std::vector<Result> results;
+    std::cout << "\n" << num_points << " points, lidar-like:\n";
+    index_benchmarks(
+        results, settings, "lidar", points, min, max, num_queries
+    );
+
+    make_uniform(points, min, max, scene.seed);
+    std::cout << "\n" << num_points << " points, uniform:\n";
+    index_benchmarks(
+        results, settings, "uniform", points, min, max, num_queries
+    );
+
+    if (!json_path.empty() && !write_json(json_path, settings, results)) {
+        std::cout << "Unable to write \"" << json_path << "\"\n";
+        return 2;
+    }
+
+    return 0;
+}
@@ -1,17 +1,29 @@
 // memusage.cpp
 /**
  * Usage: ./memusage <data1.txt> <data2.txt> ...
- * 
- * Note that this testing program uses windows-specific header files,
- * and as such will not work on Linux machines. Requires -lpsapi when compiling
+ *
+ * For each index and data file, reports:
+ *  - the change in resident set size over the build (from /proc/self/statm
+ *    on Linux, or the working set size on Windows, which needs -lpsapi),
+ *  - the process' peak resident set size so far (from getrusage),
+ *  - the exact heap bytes and allocations made by the build, and the peak
+ *    heap usage during it, from the counting operator new below,
+ *  - the heap bytes per point, which is the most comparable figure.
+ * The indexes keep copies of the data, so those are included throughout.
+ * Memory freed by one benchmark is reused by the next without going back to
+ * the OS, so later RSS deltas understate (often to 0) what the index uses.
  */
 
 #include <iostream>
 #include <iomanip>
-
-#include "windows.h"
-#include "psapi.h"
-
+#include <fstream>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <memory>
+#include <algorithm>
+
+#include "process_memory.hpp"
 #include "../src/quadtree.cpp"
 #include "../src/rtree.cpp"
 #include "../src/zgrid.cpp"
@@ -19,81 +31,189 @@
 
 using coord_t = spatial::coord_t;
 
-size_t process_memusage() {
-    PROCESS_MEMORY_COUNTERS_EX pmc;
-    GetProcessMemoryInfo(
-        GetCurrentProcess(), 
-        (PROCESS_MEMORY_COUNTERS*)&pmc, 
-        sizeof(pmc)
-    );
-    return pmc.WorkingSetSize;
-} 
-
-void quadtree_benchmark(std::string const filename) {
-    std::cout << "\nRunning quadtree memory benchmark for \'" 
-              << filename << "\':\n";
-
-    // Parsing the data & header
-    LidarReader reader(filename);
-    auto const& min = reader.get_min();
-    auto const& max = reader.get_max();
-
-    // Record a memory baseline here
-    // The space usage of reading the data isn't relevant 
-    auto mem_baseline = process_memusage();
+/**
+ * Every global allocation is prefixed with its size, so that the live heap
+ * bytes can be tracked exactly (the sized deletes aren't always called).
+ */
+namespace {
+
+    std::atomic<std::size_t> heap_bytes{0};
+    std::atomic<std::size_t> heap_peak{0};
+    std::atomic<std::size_t> heap_allocations{0};
+
+    std::size_t const header = alignof(std::max_align_t);
+
+    void* counted_allocate(std::size_t const size, std::size_t const align) {
+        std::size_t const offset = std::max(header, align);
+        std::size_t total = offset + (size ? size : 1);
+        void* base;
+        if (align > header) {
+            total = (total + align - 1) / align * align;
+#if defined(_WIN32)
+            base = _aligned_malloc(total, align);
+#else
+            base = std::aligned_alloc(align, total);
+#endif
+        } else {
+            base = std::malloc(total);
+        }
+        if (!base) throw std::bad_alloc();
+
+        char* const p = static_cast<char*>(base) + offset;
+        reinterpret_cast<std::size_t*>(p)[-1] = size;
+        heap_allocations++;
+        std::size_t const now = (heap_bytes += size);
+        std::size_t peak = heap_peak;
+        while (now > peak && !heap_peak.compare_exchange_weak(peak, now)) { }
+        return p;
+    }
 
-    spatial::Quadtree<std::vector<coord_t>> qt(
-        min[0], max[0], min[1], max[1]
-    );
+    void counted_free(void* const p, std::size_t const align) noexcept {
+        if (!p) return;
+        heap_bytes -= reinterpret_cast<std::size_t*>(p)[-1];
+        void* const base = static_cast<char*>(p) - std::max(header, align);
+#if defined(_WIN32)
+        if (align > header) return _aligned_free(base);
+#endif
+        std::free(base);
+    }
 
-    std::cout << "\tBuilding the quadtree... \t";
-    qt.build(reader.get_point_data());
-    std::cout << process_memusage() - mem_baseline << " bytes used\n";
 }
 
-void rtree_benchmark(std::string filename) {
-    std::cout << "\nRunning R-tree memory benchmark for \'" 
-              << filename << "\':\n";
-
-    LidarReader reader = LidarReader(filename);
-
-    auto mem_baseline = process_memusage();
+void* operator new(std::size_t size) { return counted_allocate(size, 0); }
+void* operator new[](std::size_t size) { return counted_allocate(size, 0); }
+void* operator new(std::size_t size, std::align_val_t align) {
+    return counted_allocate(size, std::size_t(align));
+}
+void* operator new[](std::size_t size, std::align_val_t align) {
+    return counted_allocate(size, std::size_t(align));
+}
 
-    std::cout << "\tBuilding the R-tree...   \t";
-    spatial::Rtree<std::vector<double>> rtree;
-    rtree.build(reader.get_point_data());
+void operator delete(void* p) noexcept { counted_free(p, 0); }
+void operator delete[](void* p) noexcept { counted_free(p, 0); }
+void operator delete(void* p, std::size_t) noexcept { counted_free(p, 0); }
+void operator delete[](void* p, std::size_t) noexcept { counted_free(p, 0); }
+void operator delete(void* p, std::align_val_t align) noexcept {
+    counted_free(p, std::size_t(align));
+}
+void operator delete[](void* p, std::align_val_t align) noexcept {
+    counted_free(p, std::size_t(align));
+}
+void operator delete(void* p, std::size_t, std::align_val_t align) noexcept {
+    counted_free(p, std::size_t(align));
+}
+void operator delete[](void* p, std::size_t, std::align_val_t align) noexcept {
+    counted_free(p, std::size_t(align));
+}
 
-    std::cout << process_memusage() - mem_baseline << " bytes used\n";
+/**
+ * Build an index with build(), which returns it in a unique_ptr, and report
+ * the memory it took. The index is kept alive until everything's measured.
+ */
+template<typename Build>
+void memory_benchmark(
+    std::string const& name, std::size_t const num_points, Build const& build
+) {
+    std::size_t const rss_baseline = process_memusage();
+    std::size_t const heap_baseline = heap_bytes;
+    std::size_t const allocations_baseline = heap_allocations;
+    heap_peak = heap_baseline;
+
+    auto index = build();
+
+    std::size_t const rss_now = process_memusage();
+    std::size_t const rss = (
+        (rss_now > rss_baseline) ? rss_now - rss_baseline : 0
+    );
+    std::size_t const heap = heap_bytes - heap_baseline;
+    std::cout << "\t" << std::left << std::setw(24) << name << std::right
+              << std::setw(12) << rss << " RSS bytes"
+              << std::setw(12) << heap << " heap bytes"
+              << std::setw(12) << heap_peak - heap_baseline << " peak heap"
+              << std::setw(10) << heap_allocations - allocations_baseline
+              << " allocations"
+              << std::setw(8) << std::fixed << std::setprecision(1)
+              << double(heap) / num_points << " bytes/point\n";
+
+    index.reset();
+    if (heap_bytes != heap_baseline) {
+        std::cout << "\t\t(" << heap_bytes - heap_baseline
+                  << " bytes still allocated after destruction)\n";
+    }
 }
 
-void zgrid_benchmark(std::string const filename) {
-    std::cout << "\nRunning z-grid memory benchmark for \'" 
-              << filename << "\':\n";
+void index_benchmarks(std::string const filename) {
+    std::cout << "\nRunning memory benchmarks for \'" << filename << "\':\n";
 
-    // Parsing the data & header
+    // The space used by reading the data isn't relevant, so the baselines
+    // are all taken after it's been read
     LidarReader reader(filename);
     auto const& min = reader.get_min();
     auto const& max = reader.get_max();
-
-    // Record a memory baseline here
-    // The space usage of reading the data isn't relevant 
-    auto mem_baseline = process_memusage();
-
-    spatial::Zgrid<std::vector<coord_t>> zgrid(
-        min[0], max[0], min[1], max[1]
-    );
-
-    std::cout << "\tBuilding the Z-grid...   \t";
-    zgrid.build(reader.get_point_data(), 7);
-    std::cout << process_memusage() - mem_baseline << " bytes used\n";
+    auto const& point_data = reader.get_point_data();
+    std::size_t const n = point_data.size();
+
+    using Raw = std::vector<coord_t>;
+    memory_benchmark("quadtree", n, [&] () {
+        auto qt = std::make_unique<spatial::Quadtree<Raw>>(
+            min[0], max[0], min[1], max[1]
+        );
+        qt->build(point_data);
+        return qt;
+    });
+    memory_benchmark("quadtree (uint16)", n, [&] () {
+        auto qt = std::make_unique<spatial::Quadtree<Raw, uint16_t>>(
+            min[0], max[0], min[1], max[1]
+        );
+        qt->build(point_data);
+        return qt;
+    });
+    memory_benchmark("R-tree", n, [&] () {
+        auto rtree = std::make_unique<spatial::Rtree<Raw>>();
+        rtree->build(point_data);
+        return rtree;
+    });
+    memory_benchmark("R-tree (bulk, packed)", n, [&] () {
+        auto rtree = std::make_unique<spatial::Rtree<Raw>>();
+        rtree->bulk_load(point_data);
+        rtree->pack();
+        return rtree;
+    });
+    memory_benchmark("Z-grid", n, [&] () {
+        auto zgrid = std::make_unique<spatial::Zgrid<Raw>>(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid->build(point_data, 7);
+        return zgrid;
+    });
+
+    // Without the per-point heap allocations of std::vector data
+    using Array = std::array<coord_t, 3>;
+    std::vector<Array> array_data;
+    for (auto const& p : point_data) array_data.push_back({p[0], p[1], p[2]});
+    memory_benchmark("quadtree (array data)", n, [&] () {
+        auto qt = std::make_unique<spatial::Quadtree<Array>>(
+            min[0], max[0], min[1], max[1]
+        );
+        qt->build(array_data);
+        return qt;
+    });
+    memory_benchmark("Z-grid (array data)", n, [&] () {
+        auto zgrid = std::make_unique<spatial::Zgrid<Array>>(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid->build(array_data, 7);
+        return zgrid;
+    });
+
+    std::cout << "\tPeak RSS of the process so far: "
+              << process_peak_memusage() << " bytes\n";
 }
 
 int main(int argc, char** argv) {
 
     for (int i=1; i<argc; i++) {
-        quadtree_benchmark(argv[i]);
-        rtree_benchmark(argv[i]);
-        zgrid_benchmark(argv[i]);
+        index_benchmarks(argv[i]);
     }
 
     return 0;
@@ -0,0 +1,141 @@
+// perf_counters.hpp
+/**
+ * Hardware (and a couple of software) performance counters for the current
+ * thread, via perf_event_open on Linux. Each event is opened on its own
+ * rather than as a group, so that one the CPU (or VM, or perf_event_paranoid
+ * setting) doesn't support doesn't take the others down with it. If there
+ * are more events than hardware counters, the kernel multiplexes them, and
+ * the counts are scaled up by the fraction of the time each was counting.
+ *
+ * Anywhere else, or if nothing could be opened, available() is false and
+ * every count reads as NaN.
+ */
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#pragma once
+
+class PerfCounters {
+    public:
+        static int const num_events = 8;
+        using Counts = std::array<double, num_events>;
+
+        static char const* name(int const event) {
+            static char const* const names[num_events] = {
+                "cycles", "instructions", "l1d_misses", "llc_misses",
+                "branch_misses", "dtlb_misses", "page_faults", "task_clock_ns"
+            };
+            return names[event];
+        }
+
+    private:
+        std::array<int, num_events> fds;
+
+#if defined(__linux__)
+        static int open_event(uint32_t const type, uint64_t const config) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = (
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING
+            );
+            return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+
+        static uint64_t cache_miss(uint64_t const cache) {
+            return cache
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        }
+#endif
+
+    public:
+        PerfCounters() {
+            fds.fill(-1);
+#if defined(__linux__)
+            fds = {
+                open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+                open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+                open_event(
+                    PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)
+                ),
+                open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+                open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES),
+                open_event(
+                    PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)
+                ),
+                open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS),
+                open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK)
+            };
+#endif
+        }
+
+        PerfCounters(PerfCounters const&) = delete;
+        PerfCounters& operator=(PerfCounters const&) = delete;
+
+        ~PerfCounters() {
+#if defined(__linux__)
+            for (int const fd : fds) {
+                if (fd >= 0) close(fd);
+            }
+#endif
+        }
+
+        bool available() const {
+            for (int const fd : fds) {
+                if (fd >= 0) return true;
+            }
+            return false;
+        }
+
+        bool available(int const event) const { return (fds[event] >= 0); }
+
+        void start() {
+#if defined(__linux__)
+            for (int const fd : fds) {
+                if (fd < 0) continue;
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        /**
+         * The counts since start(), with NaN for unavailable events.
+         */
+        Counts stop() {
+            Counts counts;
+            counts.fill(NAN);
+#if defined(__linux__)
+            for (int const fd : fds) {
+                if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+            for (int e = 0; e < num_events; e++) {
+                uint64_t values[3];  // (count, time enabled, time running)
+                if (fds[e] < 0
+                    || read(fds[e], values, sizeof(values)) != sizeof(values)
+                ) {
+                    continue;
+                }
+                counts[e] = values[2]
+                    ? double(values[0]) * values[1] / values[2] : 0;
+            }
+#endif
+            return counts;
+        }
+};
@@ -0,0 +1,64 @@
+// process_memory.hpp
+/**
+ * The process' resident set size, now and at its peak, from /proc/self/statm
+ * and getrusage on Linux (and macOS, peak only), or the working set size on
+ * Windows (which needs -lpsapi).
+ */
+
+#include <cstddef>
+#include <fstream>
+
+#if defined(_WIN32)
+#include "windows.h"
+#include "psapi.h"
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+#pragma once
+
+/**
+ * Current resident set size, in bytes.
+ */
+std::size_t process_memusage() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    GetProcessMemoryInfo(
+        GetCurrentProcess(),
+        (PROCESS_MEMORY_COUNTERS*)&pmc,
+        sizeof(pmc)
+    );
+    return pmc.WorkingSetSize;
+#else
+    // (total program size, then resident set size, in pages)
+    std::ifstream statm("/proc/self/statm");
+    std::size_t pages = 0;
+    std::size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/**
+ * Peak resident set size over the life of the process, in bytes.
+ */
+std::size_t process_peak_memusage() {
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS_EX pmc;
+    GetProcessMemoryInfo(
+        GetCurrentProcess(),
+        (PROCESS_MEMORY_COUNTERS*)&pmc,
+        sizeof(pmc)
+    );
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss;  // (bytes on macOS...)
+#else
+    return usage.ru_maxrss * 1024;  // (...and kilobytes on Linux)
+#endif
+#endif
+}
@@ -0,0 +1,175 @@
+// scaling.cpp
+/**
+ * Usage: ./scaling [--max n] [--queries n] [--trials n] [--warmup n]
+ *                  [--json path]
+ *
+ * Builds and queries every index on synthetic scans of 1k, 10k, ... points,
+ * up to --max (default 100M), and on uniformly random points of the same
+ * sizes and bounds for comparison. The scans (see lidar_generator.hpp) cover
+ * the same scene at every size, just sampled more densely, so the clustering,
+ * empty water, coincident returns and duplicates stay in proportion while the
+ * trees get deeper. Everything is generated in memory, with no files.
+ *
+ * Queries are half sampled from the data (where the points are dense), and
+ * half uniform over the bounds (often far from any points, e.g. over water),
+ * since the two stress an index differently. Reported per point built (the
+ * median over the trials) and per query (the mean), and with --json, in
+ * full (see benchmark_harness.hpp), for ./benchmark --compare. There's one
+ * trial and no warm up by default, since the largest sizes take a while;
+ * --compare needs a few trials to tell a regression from noise.
+ *
+ * Budget about 100 bytes of memory per point: the data, plus one index at a
+ * time (each is freed before the next is built), so 100M needs ~10GB.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+
+#include "../src/quadtree.cpp"
+#include "../src/rtree.cpp"
+#include "../src/zgrid.cpp"
+#include "../src/any_index.cpp"
+#include "../scripts/lidar_generator.cpp"
+#include "benchmark_harness.hpp"
+
+using coord_t = spatial::coord_t;
+using Array = std::array<coord_t, 3>;
+
+/**
+ * Time build() (see time_build()), and k-NN queries on data and anywhere
+ * over the index it builds, and report them per point and per query.
+ */
+template<typename Build>
+void scaling_benchmark(
+    std::vector<Result>& results,
+    Settings const& settings,
+    std::string const& name,
+    std::string const& label,
+    std::size_t const num_points,
+    std::vector<spatial::Point> const& data_queries,
+    std::vector<spatial::Point> const& bounds_queries,
+    Build const& build
+) {
+    results.push_back(time_build(name + "/build", settings, num_points, build));
+    double const build_ns = summarise(results.back()).p50 / num_points;
+    auto const index = build();
+    results.push_back(time_queries(
+        name + "/knn/data", settings, *index, data_queries, 8
+    ));
+    double const data_us = summarise(results.back()).mean / 1000;
+    results.push_back(time_queries(
+        name + "/knn/anywhere", settings, *index, bounds_queries, 8
+    ));
+    double const bounds_us = summarise(results.back()).mean / 1000;
+
+    std::cout << "\t\t" << std::left << std::setw(10) << label << std::right
+              << std::setw(10) << build_ns << " ns/point build"
+              << std::setw(10) << data_us << " us/query (on data)"
+              << std::setw(10) << bounds_us << " us/query (anywhere)\n";
+}
+
+void index_benchmarks(
+    std::vector<Result>& results,
+    Settings const& settings,
+    std::string const& prefix,
+    std::vector<Array> const& points,
+    Array const& min,
+    Array const& max,
+    std::size_t const num_queries
+) {
+    std::size_t const n = points.size();
+    std::mt19937_64 rng(n);
+    std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+    std::uniform_real_distribution<coord_t> along_x(min[0], max[0]);
+    std::uniform_real_distribution<coord_t> along_y(min[1], max[1]);
+    std::vector<spatial::Point> data_queries;
+    std::vector<spatial::Point> bounds_queries;
+    for (std::size_t i = 0; i < num_queries / 2; i++) {
+        Array const& p = points[pick(rng)];
+        data_queries.push_back({p[0], p[1]});
+        bounds_queries.push_back({along_x(rng), along_y(rng)});
+    }
+
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+    std::cout << std::fixed << std::setprecision(2);
+    for (std::string const name : spatial::index_names) {
+        std::string label = name;
+        if (name == "zgrid") {
+            label += " r=" + std::to_string(
+                spatial::Zgrid<Array>::resolution(n)
+            );
+        }
+        scaling_benchmark(
+            results, settings, prefix + name, label,
+            n, data_queries, bounds_queries,
+            [&] () {
+                return built(spatial::make_index<Array>(name, bounds), points);
+            }
+        );
+    }
+}
+
+int main(int argc, char** argv) {
+
+    std::size_t max_points = 100000000;
+    std::size_t num_queries = 10000;
+    Settings settings;
+    settings.trials = 1;
+    settings.warmup = 0;
+    std::string json_path;
+    for (int i=1; i<argc; i++) {
+        std::string const arg = argv[i];
+        if (arg == "--max" && i+1 < argc) {
+            max_points = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--queries" && i+1 < argc) {
+            num_queries = std::max(2, std::atoi(argv[++i]));
+        } else if (arg == "--trials" && i+1 < argc) {
+            settings.trials = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && i+1 < argc) {
+            settings.warmup = std::atoi(argv[++i]);
+        } else if (arg == "--json" && i+1 < argc) {
+            json_path = argv[++i];
+        }
+    }
+
+    std::vector<Result> results;
+    for (std::size_t n = 1000; n <= max_points; n *= 10) {
+        LidarScene scene;
+        scene.num_points = n;
+
+        std::cout << "\n" << n << " points:\n";
+        std::vector<Array> points;
+        {
+            auto const start = Clock::now();
+            points = generate_lidar(scene);
+            auto const end = Clock::now();
+            std::cout << "\tlidar-like (generated at " << std::fixed
+                      << std::setprecision(2) << elapsed_ns(start, end) / n
+                      << " ns/point):\n";
+        }
+        LidarGenerator const generator(scene);
+        Array const min = generator.get_min();
+        Array const max = generator.get_max();
+        std::string const size = std::to_string(n) + "/";
+        index_benchmarks(
+            results, settings, "lidar/" + size, points, min, max, num_queries
+        );
+
+        make_uniform(points, min, max, scene.seed);
+        std::cout << "\tuniform:\n";
+        index_benchmarks(
+            results, settings, "uniform/" + size, points, min, max, num_queries
+        );
+    }
+
+    if (!json_path.empty() && !write_json(json_path, settings, results)) {
+        std::cout << "Unable to write \"" << json_path << "\"\n";
+        return 2;
+    }
+
+    return 0;
+}
@@ -10,6 +10,12 @@
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
+#include <memory_resource>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+#include <optional>
 
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
@@ -17,7 +23,11 @@
 #include "../src/quadtree.cpp"
 #include "../src/rtree.cpp"
 #include "../src/zgrid.cpp"
+#include "../src/any_index.cpp"
+#include "../src/tuner.cpp"
+#include "../src/tiled.cpp"
 #include "../scripts/lidar_reader.cpp"
+#include "../scripts/lidar_generator.cpp"
 
 /**
  * reg2048.txt is artificially generated in a 16x16 grid,
@@ -35,8 +45,43 @@ std::string const reg2048 = "data/reg2048.txt";
  */
 std::string const rand100k = "data/rand100k.txt";
 
+/**
+ * rand1k.txt is a much smaller uniform point cloud, small enough that
+ * we can afford to exhaust an entire index with a browsing query.
+ */
+std::string const rand1k = "data/rand1k.txt";
+
 using coord_t = spatial::coord_t;
 
+/**
+ * A memory resource which keeps track of how much of its memory is in use,
+ * passing the actual allocation on to the global heap.
+ */
+class CountingResource : public std::pmr::memory_resource {
+    public:
+        std::size_t bytes = 0, allocations = 0;
+
+    private:
+        void* do_allocate(std::size_t size, std::size_t align) override {
+            bytes += size;
+            allocations++;
+            return std::pmr::new_delete_resource()->allocate(size, align);
+        }
+
+        void do_deallocate(
+            void* p, std::size_t size, std::size_t align
+        ) override {
+            bytes -= size;
+            std::pmr::new_delete_resource()->deallocate(p, size, align);
+        }
+
+        bool do_is_equal(
+            std::pmr::memory_resource const& other
+        ) const noexcept override {
+            return (this == &other);
+        }
+};
+
 /**
  * Verify that the k-nearest neighbours are ordered far -> close
  * This might seem like a weird property to aim for, but it helps verify
@@ -100,6 +145,191 @@ bool check_knn(
     return true;
 }
 
+/**
+ * Verify that a distance browsing cursor yields the same neighbours as
+ * a k-NN query, but ordered close -> far. Since equidistant points can come
+ * out in either order, we compare distances rather than the points themselves.
+ */
+template<typename Cursor>
+bool check_browsing(
+    Cursor cursor,
+    std::vector<std::vector<coord_t>> const& knn,
+    spatial::Point const& query_point
+) {
+    for (auto it = knn.rbegin(); it != knn.rend(); it++) {
+        if (cursor.empty()) return false;
+        coord_t const expected_dist = spatial::distance(
+            query_point, (spatial::Point){(*it)[0], (*it)[1]}
+        );
+        if (cursor.peek_dist() != expected_dist) return false;
+        auto const next = cursor.next();
+        coord_t const actual_dist = spatial::distance(
+            query_point, (spatial::Point){next[0], next[1]}
+        );
+        if (actual_dist != expected_dist) return false;
+    }
+    return true;
+}
+
+/**
+ * Verify that an approximate k-NN query result is no more than (1+epsilon)
+ * times farther away than the exact result. Both are ordered far -> close,
+ * so we only need to compare the first (furthest) neighbour of each.
+ */
+bool check_approx(
+    std::vector<std::vector<coord_t>> const& approx_knn,
+    std::vector<std::vector<coord_t>> const& exact_knn,
+    spatial::Point const& query_point,
+    coord_t const epsilon
+) {
+    if (approx_knn.size() != exact_knn.size()) return false;
+    coord_t const approx_dist = spatial::distance(
+        query_point, (spatial::Point){approx_knn[0][0], approx_knn[0][1]}
+    );
+    coord_t const exact_dist = spatial::distance(
+        query_point, (spatial::Point){exact_knn[0][0], exact_knn[0][1]}
+    );
+    return (approx_dist <= (1 + epsilon) * exact_dist);
+}
+
+/**
+ * Run the usual battery of k-NN queries against an index, and verify that
+ * they match the brute-force results. Used for indexes whose coordinates are
+ * stored as narrower types, where the distance filtering is only approximate.
+ */
+template<typename Index>
+bool check_exact_queries(
+    Index const& index,
+    std::vector<std::vector<coord_t>> const& point_data
+) {
+    std::vector<std::pair<unsigned, spatial::Point>> const queries = {
+        {1, {100, 150}}, {16, {300, 450}}, {32, {250, 250}},
+        {8, {0, 0}}, {8, {500, 500}}, {16, {250, 750}}
+    };
+    for (auto const& [k, p] : queries) {
+        auto const knn = index.query_knn(k, p[0], p[1]);
+        if (knn.size() != k
+            || !check_ordering(knn, p)
+            || !check_knn(knn, p, point_data)
+        ) { return false; }
+    }
+    return true;
+}
+
+/**
+ * Verify that a batch of queries gives exactly the same results as running
+ * each query on its own, in the original query order, whatever the curve.
+ */
+template<typename Index>
+bool check_batch_queries(
+    Index const& index,
+    std::vector<std::vector<coord_t>> const& query_data
+) {
+    std::vector<spatial::Point> query_points;
+    for (auto const& q : query_data) query_points.push_back({q[0], q[1]});
+
+    using spatial::Curve;
+    for (auto const curve : {Curve::zorder, Curve::hilbert}) {
+        auto const batch = index.query_knn_batch(8, query_points, curve);
+        if (batch.size() != query_points.size()) return false;
+        for (unsigned i=0; i<query_points.size(); i++) {
+            if (batch[i] != index.query_knn(8, query_points[i])) return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Verify that, once a QueryContext has been through one pass of the queries,
+ * a second pass with the same k doesn't allocate any scratch space from its
+ * resource, and hands back its results in the same vector each time.
+ */
+template<typename Index>
+bool check_context_queries(
+    Index const& index,
+    std::vector<std::vector<coord_t>> const& query_data
+) {
+    std::vector<spatial::Point> query_points;
+    for (auto const& q : query_data) query_points.push_back({q[0], q[1]});
+
+    CountingResource resource;
+    typename Index::QueryContext context(&resource);
+    for (auto const& p : query_points) index.query_knn(context, 8, p);
+
+    std::size_t const before = resource.allocations;
+    auto const* const storage = index.query_knn(
+        context, 8, query_points.front()
+    ).data();
+    std::size_t found = 0;
+    for (auto const& p : query_points) {
+        auto const& knn = index.query_knn(context, 8, p);
+        if (knn.data() != storage) return false;
+        found += knn.size();
+    }
+    return (resource.allocations == before && found == 8*query_points.size());
+}
+
+/**
+ * Verify a k-NN query result in D dimensions against a brute-force scan.
+ * Sorting every distance in the point cloud sidesteps the ambiguity noted
+ * above for check_knn(): ties at the k'th distance are fine, since we only
+ * compare the multisets of distances rather than the points themselves.
+ */
+template<int D>
+bool check_knn_brute_force(
+    std::vector<std::vector<coord_t>> const& knn,
+    spatial::PointND<D> const& query_point,
+    std::vector<std::vector<coord_t>> const& point_data
+) {
+    auto const dist = [&query_point] (std::vector<coord_t> const& raw) {
+        spatial::PointND<D> p;
+        for (int a = 0; a < D; a++) p[a] = raw[a];
+        return spatial::distance(query_point, p);
+    };
+
+    std::vector<coord_t> all_dists;
+    for (auto const& point : point_data) all_dists.push_back(dist(point));
+    std::sort(all_dists.begin(), all_dists.end());
+
+    // The query result is ordered far -> close
+    if (knn.size() > all_dists.size()) return false;
+    for (unsigned i=0; i<knn.size(); i++) {
+        if (dist(knn[knn.size()-1-i]) != all_dists[i]) return false;
+    }
+    return true;
+}
+
+/**
+ * Verify radius queries against a brute-force scan. The results come in no
+ * particular order, so both are sorted before they're compared. One of the
+ * queries has a data point exactly on its boundary, which should be found.
+ */
+template<typename Index>
+bool check_radius_queries(
+    Index const& index,
+    std::vector<std::vector<coord_t>> const& point_data
+) {
+    spatial::Point const first = {point_data[0][0], point_data[0][1]};
+    spatial::Point const second = {point_data[1][0], point_data[1][1]};
+    std::vector<std::pair<spatial::Point, coord_t>> const queries = {
+        {{100, 150}, 5}, {{300, 450}, 20}, {{250, 250}, 0}, {{0, 0}, 30},
+        {{500, 500}, 12.5}, {{250, 750}, 100}, {{-1000, -1000}, 1},
+        {first, 0}, {first, spatial::distance(first, second)}
+    };
+    for (auto const& [p, radius] : queries) {
+        auto found = index.query_radius(p[0], p[1], radius);
+        std::vector<std::vector<coord_t>> expected;
+        for (auto const& point : point_data) {
+            spatial::Point const q = {point[0], point[1]};
+            if (spatial::distance(p, q) <= radius) expected.push_back(point);
+        }
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        if (found != expected) return false;
+    }
+    return true;
+}
+
 TEST_CASE("Make sure all this quadtree code actually works", "[quadtree]") {
 
     SECTION("construction (point partitioning & recursion)") {
@@ -149,6 +379,219 @@ TEST_CASE("Make sure all this quadtree code actually works", "[quadtree]") {
         REQUIRE(check_knn(knnSE, {500, 500}, point_data));
         REQUIRE(check_knn(knnXX, {250, 750}, point_data));
     }
+
+    SECTION("incremental browsing") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+        auto const& point_data = reader.get_point_data();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1]
+        );
+        qt.build(point_data);
+
+        auto const knn32 = qt.query_knn(32, 250, 250);
+        auto const knnNW = qt.query_knn(8, 0, 0);
+        REQUIRE(check_browsing(qt.browse(250, 250), knn32, {250, 250}));
+        REQUIRE(check_browsing(qt.browse(0, 0), knnNW, {0, 0}));
+
+        // Browsing past the end of the data should exhaust the cursor
+        LidarReader small_reader(rand1k);
+        auto const small_data = small_reader.get_point_data();
+        spatial::Quadtree<std::vector<coord_t>> small(
+            small_reader.get_min()[0], small_reader.get_max()[0],
+            small_reader.get_min()[1], small_reader.get_max()[1]
+        );
+        small.build(small_data);
+        auto cursor = small.browse(100, 100);
+        coord_t last_dist = 0;
+        for (unsigned i=0; i<small_data.size(); i++) {
+            REQUIRE(!cursor.empty());
+            REQUIRE(cursor.peek_dist() >= last_dist);
+            last_dist = cursor.peek_dist();
+            cursor.next();
+        }
+        REQUIRE(cursor.empty());
+    }
+
+    SECTION("narrow coordinate storage") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+        auto const& point_data = reader.get_point_data();
+
+        spatial::Quadtree<std::vector<coord_t>, float> qt_float(
+            min[0], max[0], min[1], max[1]
+        );
+        qt_float.build(point_data);
+        REQUIRE(check_exact_queries(qt_float, point_data));
+
+        spatial::Quadtree<std::vector<coord_t>, uint32_t> qt_uint32(
+            min[0], max[0], min[1], max[1]
+        );
+        qt_uint32.build(point_data);
+        REQUIRE(check_exact_queries(qt_uint32, point_data));
+
+        spatial::Quadtree<std::vector<coord_t>, uint16_t> qt_uint16(
+            min[0], max[0], min[1], max[1]
+        );
+        qt_uint16.build(point_data);
+        REQUIRE(check_exact_queries(qt_uint16, point_data));
+    }
+
+    SECTION("radius querying") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+        auto const& point_data = reader.get_point_data();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1]
+        );
+        qt.build(point_data);
+        REQUIRE(check_radius_queries(qt, point_data));
+
+        spatial::Quadtree<std::vector<coord_t>, uint16_t> qt_uint16(
+            min[0], max[0], min[1], max[1]
+        );
+        qt_uint16.build(point_data);
+        REQUIRE(check_radius_queries(qt_uint16, point_data));
+    }
+
+    SECTION("approximate querying") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1]
+        );
+        qt.build(reader.get_point_data());
+
+        for (coord_t const epsilon : {0.0, 0.5, 2.0}) {
+            auto const exact = qt.query_knn(16, 300, 450);
+            auto const approx = qt.query_knn(16, 300, 450, epsilon);
+            REQUIRE(check_ordering(approx, {300, 450}));
+            REQUIRE(check_approx(approx, exact, {300, 450}, epsilon));
+        }
+
+        // A node visit budget may cut the query short, but never overfills
+        auto const capped = qt.query_knn(16, 300, 450, 0, 32);
+        REQUIRE(!capped.empty());
+        REQUIRE(capped.size() <= 16);
+        REQUIRE(check_ordering(capped, {300, 450}));
+    }
+
+    SECTION("Hilbert leaf order") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+        auto const& point_data = reader.get_point_data();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1], spatial::Curve::hilbert
+        );
+        qt.build(point_data);
+        REQUIRE(check_exact_queries(qt, point_data));
+    }
+
+    SECTION("batch querying") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1]
+        );
+        qt.build(reader.get_point_data());
+        auto const query_data = LidarReader(rand1k).get_point_data();
+        REQUIRE(check_batch_queries(qt, query_data));
+    }
+
+    SECTION("allocation-free querying") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1]
+        );
+        qt.build(reader.get_point_data());
+        auto const query_data = LidarReader(rand1k).get_point_data();
+        REQUIRE(check_context_queries(qt, query_data));
+    }
+
+    SECTION("warm-started querying") {
+        LidarReader reader(rand100k);
+        auto const& min = reader.get_min();
+        auto const& max = reader.get_max();
+
+        spatial::Quadtree<std::vector<coord_t>> qt(
+            min[0], max[0], min[1], max[1]
+        );
+        qt.build(reader.get_point_data());
+
+        // A scanline, with a few jumps, changes of k and points outside
+        std::vector<std::pair<unsigned, spatial::Point>> queries;
+        for (coord_t x = -10; x <= 510; x += 2.5) {
+            queries.push_back({8, {x, 250}});
+        }
+        queries.push_back({8, {0, 0}});
+        queries.push_back({32, {1, 1}});
+        queries.push_back({1, {2, 2}});
+        queries.push_back({16, {250, 750}});
+
+        spatial::Quadtree<std::vector<coord_t>>::QueryContext context;
+        for (auto const& [k, p] : queries) {
+            auto const warm = qt.query_knn(context, k, p);
+            auto const cold = qt.query_knn(k, p);
+            REQUIRE(warm.size() == cold.size());
+            for (unsigned i=0; i<warm.size(); i++) {
+                coord_t const warm_dist = spatial::distance(
+                    p, (spatial::Point){warm[i][0], warm[i][1]}
+                );
+                coord_t const cold_dist = spatial::distance(
+                    p, (spatial::Point){cold[i][0], cold[i][1]}
+                );
+                REQUIRE(warm_dist == cold_dist);
+            }
+        }
+
+        // A new tree in the old one's place mustn't look like the old tree
+        std::optional<spatial::Quadtree<std::vector<coord_t>>> reused;
+        reused.emplace(min[0], max[0], min[1], max[1]);
+        reused->build(reader.get_point_data());
+        reused->query_knn(context, 8, {250, 250});
+        auto const* const address = &*reused;
+        reused.reset();
+        reused.emplace(0, 10, 0, 10);
+        reused->build(std::vector<std::vector<coord_t>>{
+            {1, 1, 0}, {2, 2, 0}, {9, 9, 0}
+        });
+        REQUIRE(&*reused == address);
+        REQUIRE(reused->query_knn(context, 2, {250, 250}).size() == 2);
+    }
+}
+
+TEST_CASE("Bounding box enlargement", "[spatial]") {
+    // Widths chosen so their products are inexact: a contracted fma
+    // would otherwise leave rounding noise for covered boxes
+    spatial::Rectangle const rect = {{0.1, 0.3}, {0.7, 0.9}};
+
+    REQUIRE(spatial::enlargement(rect, spatial::Point{0.4, 0.5}) == 0);
+    REQUIRE(spatial::enlargement(rect, spatial::Point{0.1, 0.9}) == 0);
+    REQUIRE(spatial::enlargement(rect, rect) == 0);
+    REQUIRE(spatial::enlargement(
+        rect, spatial::Rectangle{{0.2, 0.4}, {0.3, 0.5}}
+    ) == 0);
+
+    spatial::Rectangle const unit = {{0, 0}, {1, 1}};
+    REQUIRE(spatial::enlargement(unit, spatial::Point{2, 0.5}) == 1);
+    REQUIRE(spatial::enlargement(
+        unit, spatial::Rectangle{{0, 0}, {1, 3}}
+    ) == 2);
+    REQUIRE(spatial::enlargement(unit, spatial::Point{-1, -1}) == 3);
 }
 
 TEST_CASE("R-tree correctness testing!", "R-tree") {
@@ -185,6 +628,129 @@ TEST_CASE("R-tree correctness testing!", "R-tree") {
         REQUIRE(check_knn(knnSE, {500, 500}, point_data));
         REQUIRE(check_knn(knnXX, {250, 750}, point_data));
     }
+
+    SECTION("insertion with coincident points") {
+        // Every covered point ties at zero enlargement, so the splits
+        // must still pick valid seeds and keep the tree balanced
+        LidarReader small_reader(rand1k);
+        auto const& small_data = small_reader.get_point_data();
+        std::vector<std::vector<double>> repeated;
+        for (int copy=0; copy<4; copy++) {
+            repeated.insert(
+                repeated.end(), small_data.begin(), small_data.end()
+            );
+        }
+        spatial::Rtree<std::vector<double>> dense;
+        dense.build(repeated);
+
+        REQUIRE(dense.check_load());
+        REQUIRE(dense.check_mbbs());
+        auto const knn = dense.query_knn(16, 300, 450);
+        REQUIRE(knn.size() == 16);
+        REQUIRE(check_ordering(knn, {300, 450}));
+        REQUIRE(check_knn(knn, {300, 450}, repeated));
+    }
+
+    SECTION("packed k-NN queries") {
+        auto const unpacked_knn16 = rtree.query_knn(16, 300, 450);
+        rtree.pack();
+
+        auto const knn1 = rtree.query_knn(1, 100, 150);
+        auto const knn16 = rtree.query_knn(16, 300, 450);
+        auto const knn32 = rtree.query_knn(32, 250, 250);
+        auto const knnNW = rtree.query_knn(8, 0, 0);
+        auto const knnSE = rtree.query_knn(8, 500, 500);
+        auto const knnXX = rtree.query_knn(16, 250, 750);
+
+        REQUIRE(knn16 == unpacked_knn16);
+
+        REQUIRE(check_ordering(knn1, {100, 150}));
+        REQUIRE(check_ordering(knn16, {300, 450}));
+        REQUIRE(check_ordering(knn32, {250, 250}));
+        REQUIRE(check_ordering(knnNW, {0, 0}));
+        REQUIRE(check_ordering(knnSE, {500, 500}));
+        REQUIRE(check_ordering(knnXX, {250, 750}));
+
+        REQUIRE(check_knn(knn1, {100, 150}, point_data));
+        REQUIRE(check_knn(knn16, {300, 450}, point_data));
+        REQUIRE(check_knn(knn32, {250, 250}, point_data));
+        REQUIRE(check_knn(knnNW, {0, 0}, point_data));
+        REQUIRE(check_knn(knnSE, {500, 500}, point_data));
+        REQUIRE(check_knn(knnXX, {250, 750}, point_data));
+
+        auto const approx = rtree.query_knn(16, 300, 450, 0.5);
+        REQUIRE(check_approx(approx, knn16, {300, 450}, 0.5));
+    }
+
+    SECTION("incremental browsing") {
+        auto const knn32 = rtree.query_knn(32, 250, 250);
+        auto const knnNW = rtree.query_knn(8, 0, 0);
+        REQUIRE(check_browsing(rtree.browse(250, 250), knn32, {250, 250}));
+        REQUIRE(check_browsing(rtree.browse(0, 0), knnNW, {0, 0}));
+
+        // Browsing past the end of the data should exhaust the cursor
+        LidarReader small_reader(rand1k);
+        auto const small_data = small_reader.get_point_data();
+        spatial::Rtree<std::vector<coord_t>> small;
+        small.build(small_data);
+        auto cursor = small.browse(100, 100);
+        coord_t last_dist = 0;
+        for (unsigned i=0; i<small_data.size(); i++) {
+            REQUIRE(!cursor.empty());
+            REQUIRE(cursor.peek_dist() >= last_dist);
+            last_dist = cursor.peek_dist();
+            cursor.next();
+        }
+        REQUIRE(cursor.empty());
+    }
+
+    SECTION("approximate querying") {
+        for (coord_t const epsilon : {0.0, 0.5, 2.0}) {
+            auto const exact = rtree.query_knn(16, 300, 450);
+            auto const approx = rtree.query_knn(16, 300, 450, epsilon);
+            REQUIRE(check_ordering(approx, {300, 450}));
+            REQUIRE(check_approx(approx, exact, {300, 450}, epsilon));
+        }
+
+        // A node visit budget may cut the query short, but never overfills
+        auto const capped = rtree.query_knn(16, 300, 450, 0, 32);
+        REQUIRE(!capped.empty());
+        REQUIRE(capped.size() <= 16);
+        REQUIRE(check_ordering(capped, {300, 450}));
+    }
+
+    SECTION("curve-packed bulk loading") {
+        using spatial::Curve;
+        for (auto const curve : {Curve::hilbert, Curve::zorder}) {
+            spatial::Rtree<std::vector<coord_t>> bulk;
+            bulk.bulk_load(point_data, curve);
+            REQUIRE(bulk.get_load() == point_data.size());
+            REQUIRE(bulk.check_load());
+            REQUIRE(bulk.check_mbbs());
+            REQUIRE(check_exact_queries(bulk, point_data));
+
+            bulk.pack();
+            REQUIRE(check_exact_queries(bulk, point_data));
+        }
+    }
+
+    SECTION("radius querying") {
+        REQUIRE(check_radius_queries(rtree, point_data));
+        rtree.pack();
+        REQUIRE(check_radius_queries(rtree, point_data));
+    }
+
+    SECTION("batch querying") {
+        auto const query_data = LidarReader(rand1k).get_point_data();
+        REQUIRE(check_batch_queries(rtree, query_data));
+    }
+
+    SECTION("allocation-free querying") {
+        auto const query_data = LidarReader(rand1k).get_point_data();
+        REQUIRE(check_context_queries(rtree, query_data));
+        rtree.pack();
+        REQUIRE(check_context_queries(rtree, query_data));
+    }
 }
 
 TEST_CASE("Z-grid correctness testing", "Z-grid") {
@@ -222,4 +788,1183 @@ TEST_CASE("Z-grid correctness testing", "Z-grid") {
         REQUIRE(check_knn(knnXX, {250, 750}, point_data));
     }
 
+    SECTION("incremental browsing") {
+        auto const knn32 = zgrid.query_knn(32, 250, 250);
+        auto const knnNW = zgrid.query_knn(8, 0, 0);
+        REQUIRE(check_browsing(zgrid.browse(250, 250), knn32, {250, 250}));
+        REQUIRE(check_browsing(zgrid.browse(0, 0), knnNW, {0, 0}));
+
+        // Browsing past the end of the data should exhaust the cursor
+        LidarReader small_reader(rand1k);
+        auto const small_data = small_reader.get_point_data();
+        spatial::Zgrid<std::vector<coord_t>> small(
+            small_reader.get_min()[0], small_reader.get_max()[0],
+            small_reader.get_min()[1], small_reader.get_max()[1]
+        );
+        small.build(small_data, 4);
+        auto cursor = small.browse(100, 100);
+        coord_t last_dist = 0;
+        for (unsigned i=0; i<small_data.size(); i++) {
+            REQUIRE(!cursor.empty());
+            REQUIRE(cursor.peek_dist() >= last_dist);
+            last_dist = cursor.peek_dist();
+            cursor.next();
+        }
+        REQUIRE(cursor.empty());
+    }
+
+    SECTION("narrow coordinate storage") {
+        spatial::Zgrid<std::vector<coord_t>, float> zgrid_float(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid_float.build(point_data, 6);
+        REQUIRE(check_exact_queries(zgrid_float, point_data));
+
+        spatial::Zgrid<std::vector<coord_t>, uint32_t> zgrid_uint32(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid_uint32.build(point_data, 6);
+        REQUIRE(check_exact_queries(zgrid_uint32, point_data));
+
+        spatial::Zgrid<std::vector<coord_t>, uint16_t> zgrid_uint16(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid_uint16.build(point_data, 6);
+        REQUIRE(check_exact_queries(zgrid_uint16, point_data));
+    }
+
+    SECTION("radius querying") {
+        REQUIRE(check_radius_queries(zgrid, point_data));
+
+        spatial::Zgrid<std::vector<coord_t>, uint16_t> zgrid_uint16(
+            min[0], max[0], min[1], max[1]
+        );
+        zgrid_uint16.build(point_data);
+        REQUIRE(check_radius_queries(zgrid_uint16, point_data));
+    }
+
+    SECTION("approximate querying") {
+        for (coord_t const epsilon : {0.0, 0.5, 2.0}) {
+            auto const exact = zgrid.query_knn(16, 300, 450);
+            auto const approx = zgrid.query_knn(16, 300, 450, epsilon);
+            REQUIRE(check_ordering(approx, {300, 450}));
+            REQUIRE(check_approx(approx, exact, {300, 450}, epsilon));
+        }
+
+        // A node visit budget may cut the query short, but never overfills
+        auto const capped = zgrid.query_knn(16, 300, 450, 0, 32);
+        REQUIRE(!capped.empty());
+        REQUIRE(capped.size() <= 16);
+        REQUIRE(check_ordering(capped, {300, 450}));
+    }
+
+    SECTION("Hilbert cell order") {
+        spatial::Zgrid<std::vector<coord_t>> zgrid_hilbert(
+            min[0], max[0], min[1], max[1], spatial::Curve::hilbert
+        );
+        zgrid_hilbert.build(point_data, 6);
+        REQUIRE(check_exact_queries(zgrid_hilbert, point_data));
+    }
+
+    SECTION("batch querying") {
+        auto const query_data = LidarReader(rand1k).get_point_data();
+        REQUIRE(check_batch_queries(zgrid, query_data));
+    }
+
+    SECTION("allocation-free querying") {
+        auto const query_data = LidarReader(rand1k).get_point_data();
+        REQUIRE(check_context_queries(zgrid, query_data));
+    }
+
+}
+
+TEST_CASE("Three dimensional indexes", "[3d]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+
+    spatial::RectangleND<3> const bounds = {
+        {min[0], min[1], min[2]}, {max[0], max[1], max[2]}
+    };
+    std::vector<std::pair<unsigned, spatial::PointND<3>>> const queries = {
+        {1, {100, 150, 50}}, {16, {300, 450, 0}}, {32, {250, 250, 50}},
+        {8, {0, 0, 0}}, {8, {500, 500, 100}}, {16, {250, 750, 200}}
+    };
+
+    SECTION("octree") {
+        spatial::Octree<std::vector<coord_t>> octree(bounds);
+        octree.build(point_data);
+        for (auto const& [k, p] : queries) {
+            auto const knn = octree.query_knn(k, p);
+            REQUIRE(knn.size() == k);
+            REQUIRE(check_knn_brute_force(knn, p, point_data));
+        }
+
+        // Narrow storage should still give exact results in 3d
+        spatial::Octree<std::vector<coord_t>, uint16_t> octree_uint16(bounds);
+        octree_uint16.build(point_data);
+        for (auto const& [k, p] : queries) {
+            auto const knn = octree_uint16.query_knn(k, p);
+            REQUIRE(knn.size() == k);
+            REQUIRE(check_knn_brute_force(knn, p, point_data));
+        }
+
+        auto cursor = octree.browse(queries[2].second);
+        coord_t last_dist = 0;
+        for (unsigned i=0; i<64; i++) {
+            REQUIRE(cursor.peek_dist() >= last_dist);
+            last_dist = cursor.peek_dist();
+            cursor.next();
+        }
+    }
+
+    SECTION("Z-grid") {
+        spatial::Zgrid<std::vector<coord_t>, coord_t, 3> zgrid(bounds);
+        zgrid.build(point_data, 4);
+        REQUIRE(zgrid.size() == (1 << (3*4)));
+        for (auto const& [k, p] : queries) {
+            auto const knn = zgrid.query_knn(k, p);
+            REQUIRE(knn.size() == k);
+            REQUIRE(check_knn_brute_force(knn, p, point_data));
+        }
+    }
+
+    SECTION("R-tree") {
+        spatial::Rtree<std::vector<coord_t>, 3> rtree;
+        rtree.build(point_data);
+        REQUIRE(rtree.check_load());
+        REQUIRE(rtree.check_mbbs());
+        for (auto const& [k, p] : queries) {
+            auto const knn = rtree.query_knn(k, p);
+            REQUIRE(knn.size() == k);
+            REQUIRE(check_knn_brute_force(knn, p, point_data));
+        }
+
+        rtree.pack();
+        for (auto const& [k, p] : queries) {
+            auto const knn = rtree.query_knn(k, p);
+            REQUIRE(knn.size() == k);
+            REQUIRE(check_knn_brute_force(knn, p, point_data));
+        }
+    }
+
+}
+
+TEST_CASE("Leaf capacity and fan-out", "[capacity]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+
+    SECTION("quadtree") {
+        spatial::Quadtree<std::vector<coord_t>, coord_t, 2, 4> small(bounds);
+        spatial::Quadtree<std::vector<coord_t>, coord_t, 2, 64> large(bounds);
+        small.build(point_data);
+        large.build(point_data);
+        REQUIRE(small.num_leaves() > large.num_leaves());
+        REQUIRE(check_exact_queries(small, point_data));
+        REQUIRE(check_exact_queries(large, point_data));
+        REQUIRE(check_radius_queries(small, point_data));
+        REQUIRE(check_radius_queries(large, point_data));
+
+        // Every leaf holds no more than its capacity
+        REQUIRE(small.check_leaves());
+        REQUIRE(large.check_leaves());
+
+        // ...unless it's too deep to split, as points this close end up
+        std::vector<std::vector<coord_t>> close;
+        for (int i = 0; i < 40; i++) close.push_back({1 + i * 1e-12, 1});
+        spatial::Quadtree<std::vector<coord_t>> deep({{0, 0}, {10, 10}});
+        deep.build(close);
+        REQUIRE(deep.check_leaves());
+        REQUIRE(check_exact_queries(deep, close));
+    }
+
+    SECTION("R-tree") {
+        spatial::Rtree<std::vector<coord_t>, 2, 3> small;
+        spatial::Rtree<std::vector<coord_t>, 2, 32> large;
+        small.build(point_data);
+        large.build(point_data);
+        REQUIRE(small.check_load());
+        REQUIRE(small.check_mbbs());
+        REQUIRE(large.check_load());
+        REQUIRE(large.check_mbbs());
+        REQUIRE(check_exact_queries(small, point_data));
+        REQUIRE(check_exact_queries(large, point_data));
+        small.pack();
+        large.pack();
+        REQUIRE(check_exact_queries(small, point_data));
+        REQUIRE(check_exact_queries(large, point_data));
+        REQUIRE(check_radius_queries(small, point_data));
+        REQUIRE(check_radius_queries(large, point_data));
+
+        // Bulk loaded nodes are full, so a wider tree has fewer of them
+        spatial::Rtree<std::vector<coord_t>, 2, 5> odd;
+        odd.bulk_load(point_data);
+        odd.pack();
+        REQUIRE(odd.check_load());
+        REQUIRE(check_exact_queries(odd, point_data));
+        large.bulk_load(point_data);
+        REQUIRE(large.memory_bytes() < odd.memory_bytes());
+    }
+
+    SECTION("packed rectangles") {
+        spatial::RectangleBlock<2, 4> block;
+        block.push_back({{0, 0}, {1, 1}});
+        block.push_back({{2, 0}, {3, 1}});
+        REQUIRE(block.size() == 2);
+        std::vector<std::pair<spatial::index_t, coord_t>> visited;
+        coord_t bound2 = std::numeric_limits<coord_t>::infinity();
+        spatial::mindist_block(spatial::Point{{0, 2}}, block, bound2,
+            [&] (spatial::index_t const i, coord_t const dist2) {
+                visited.push_back({i, dist2});
+            }
+        );
+        // (the two padding slots are never closer than anything)
+        REQUIRE(visited.size() == 2);
+        REQUIRE(visited[0].first == 0);
+        REQUIRE(visited[0].second == 1);
+        REQUIRE(visited[1].first == 1);
+        REQUIRE(visited[1].second == 5);
+        block.clear();
+        REQUIRE(block.size() == 0);
+    }
+
+}
+
+/**
+ * Walk the whole grid in curve order, and verify that every cell is visited
+ * exactly once, with each step moving to a cell adjacent to the last one.
+ */
+template<int D>
+bool check_hilbert_curve(int const order) {
+    long const num_cells = 1L << (D * order);
+    std::vector<std::array<uint32_t, D>> cell_at(num_cells);
+    std::vector<bool> visited(num_cells, false);
+    for (long i = 0; i < num_cells; i++) {
+        std::array<uint32_t, D> cells;
+        for (int a = 0; a < D; a++) {
+            cells[a] = (i >> (a * order)) & ((1 << order) - 1);
+        }
+        spatial::code_t const key = spatial::hilbert_key<D>(cells, order);
+        if (key < 0 || key >= num_cells || visited[key]) return false;
+        visited[key] = true;
+        cell_at[key] = cells;
+    }
+    for (long key = 1; key < num_cells; key++) {
+        int steps = 0;
+        for (int a = 0; a < D; a++) {
+            steps += std::abs(
+                (int)cell_at[key][a] - (int)cell_at[key-1][a]
+            );
+        }
+        if (steps != 1) return false;
+    }
+    return true;
+}
+
+TEST_CASE("Space filling curves", "[curves]") {
+
+    SECTION("Hilbert keys") {
+        REQUIRE(check_hilbert_curve<2>(1));
+        REQUIRE(check_hilbert_curve<2>(6));
+        REQUIRE(check_hilbert_curve<3>(4));
+        REQUIRE(check_hilbert_curve<4>(3));
+    }
+
+    SECTION("Morton keys") {
+        REQUIRE(spatial::interleave<2>({3, 0}) == 5);
+        REQUIRE(spatial::interleave<2>({0, 3}) == 10);
+        REQUIRE(spatial::interleave<3>({1, 1, 1}) == 7);
+        REQUIRE(spatial::interleave<3>({2, 0, 1}) == 12);
+        REQUIRE(spatial::interleave<4>({0, 0, 0, 3}) == 136);
+    }
+
+}
+
+TEST_CASE("Memory resources", "[pmr]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+    std::size_t const data_bytes = point_data.size() * sizeof(
+        spatial::Datum<std::vector<coord_t>>
+    );
+
+    // Each index should keep (at least) its data in the resource, give all
+    // of it back when it's destroyed, and answer queries just the same
+    CountingResource resource;
+
+    SECTION("quadtree") {
+        {
+            spatial::Quadtree<std::vector<coord_t>> qt(
+                min[0], max[0], min[1], max[1],
+                spatial::Curve::zorder, &resource
+            );
+            qt.build(point_data);
+            REQUIRE(resource.bytes >= data_bytes);
+            REQUIRE(qt.get_resource() == &resource);
+            REQUIRE(check_exact_queries(qt, point_data));
+        }
+        REQUIRE(resource.bytes == 0);
+    }
+
+    SECTION("R-tree") {
+        {
+            spatial::Rtree<std::vector<coord_t>> rtree(&resource);
+            rtree.build(point_data);
+            REQUIRE(resource.bytes >= 2*data_bytes);  // (data and entries)
+            REQUIRE(check_exact_queries(rtree, point_data));
+
+            std::size_t const allocations = resource.allocations;
+            rtree.pack();
+            REQUIRE(resource.allocations > allocations);
+            REQUIRE(check_exact_queries(rtree, point_data));
+
+            // (packing again reuses each node's block)
+            std::size_t const packed_allocations = resource.allocations;
+            rtree.pack();
+            REQUIRE(resource.allocations == packed_allocations);
+
+            rtree.bulk_load(point_data);
+            REQUIRE(check_exact_queries(rtree, point_data));
+        }
+        REQUIRE(resource.bytes == 0);
+    }
+
+    SECTION("Z-grid") {
+        {
+            spatial::Zgrid<std::vector<coord_t>> zgrid(
+                min[0], max[0], min[1], max[1],
+                spatial::Curve::zorder, &resource
+            );
+            zgrid.build(point_data, 6);
+            REQUIRE(resource.bytes >= data_bytes);
+            REQUIRE(check_exact_queries(zgrid, point_data));
+        }
+        REQUIRE(resource.bytes == 0);
+    }
+
+    SECTION("node arena") {
+        {
+            using Slot = std::array<coord_t, 4>;
+            spatial::Arena<Slot> arena(&resource, 4, 64);
+            REQUIRE(resource.allocations == 0);
+
+            // Blocks double from 4 up to 64 slots, so the runs of adjacent
+            // groups get longer and longer, up to a point
+            std::vector<int> runs;
+            Slot* previous = nullptr;
+            for (int i = 0; i < 1 + 2 + 4 + 8 + 16 + 16; i++) {
+                Slot* const group = arena.allocate(4);
+                if (previous && group == previous + 4) runs.back()++;
+                else runs.push_back(1);
+                previous = group;
+            }
+            REQUIRE(runs == std::vector<int>{1, 2, 4, 8, 16, 16});
+
+            // A group too big for a block gets its own, without wasting
+            // the room that's left in the current one
+            Slot* const next = arena.allocate(4);
+            arena.allocate(100);
+            REQUIRE(arena.allocate(4) == next + 4);
+            REQUIRE(arena.bytes() >= (4 + 8 + 16 + 32 + 3*64 + 100) * sizeof(Slot));
+        }
+        REQUIRE(resource.bytes == 0);
+
+        // An empty index holds no more than its root's small first block
+        {
+            spatial::Quadtree<std::vector<coord_t>> qt(
+                (spatial::Rectangle){{0, 0}, {1, 1}},
+                spatial::Curve::zorder, &resource
+            );
+            REQUIRE(qt.memory_bytes() < 4096);
+        }
+        REQUIRE(resource.bytes == 0);
+    }
+
+}
+
+/**
+ * Verify that two indexes (e.g., one saved and one loaded) give exactly the
+ * same answers to the usual battery of queries.
+ */
+template<typename IndexA, typename IndexB>
+bool check_same_queries(IndexA const& a, IndexB const& b) {
+    std::vector<std::pair<unsigned, spatial::Point>> const queries = {
+        {1, {100, 150}}, {16, {300, 450}}, {32, {250, 250}},
+        {8, {0, 0}}, {8, {500, 500}}, {16, {250, 750}}
+    };
+    for (auto const& [k, p] : queries) {
+        auto const knn = a.query_knn(k, p);
+        if (knn.size() != k || knn != b.query_knn(k, p)) return false;
+    }
+    return true;
+}
+
+/**
+ * Copy a file, with one byte overwritten somewhere past the header.
+ * (A copy, since the original may still be mapped by an index.)
+ */
+void corrupt_copy(std::string const& path, std::string const& copy_path) {
+    std::filesystem::copy_file(
+        path, copy_path, std::filesystem::copy_options::overwrite_existing
+    );
+    std::fstream file(
+        copy_path, std::ios::in | std::ios::out | std::ios::binary
+    );
+    file.seekg(-1, std::ios::end);
+    char const byte = file.get() ^ 0x5a;
+    file.seekp(-1, std::ios::end);
+    file.put(byte);
+}
+
+TEST_CASE("Saving and loading indexes", "[storage]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+
+    // Only trivially copyable data can be saved, so no std::vectors
+    using Raw = std::array<coord_t, 3>;
+    std::vector<Raw> point_data;
+    for (auto const& p : reader.get_point_data()) {
+        point_data.push_back({p[0], p[1], p[2]});
+    }
+    std::string const path = (
+        std::filesystem::temp_directory_path() / "spatial_test.idx"
+    ).string();
+    std::string const corrupt_path = path + ".corrupt";
+
+    SECTION("quadtree") {
+        spatial::Quadtree<Raw> qt(min[0], max[0], min[1], max[1]);
+        qt.build(point_data);
+        REQUIRE(qt.save(path));
+
+        spatial::Quadtree<Raw> loaded(0, 1, 0, 1);
+        REQUIRE(loaded.load(path));
+        REQUIRE(loaded.num_leaves() == qt.num_leaves());
+        REQUIRE(check_same_queries(qt, loaded));
+
+        // A context warmed up on the old nodes mustn't be reused afterwards
+        spatial::Quadtree<Raw>::QueryContext context;
+        auto const knn = loaded.query_knn(context, 8, {250, 250});
+        REQUIRE(loaded.load(path, true));
+        REQUIRE(loaded.query_knn(context, 8, {250, 250}) == knn);
+
+        // The wrong type of index, or a corrupt file, should be refused
+        spatial::Quadtree<Raw, float> narrow(0, 1, 0, 1);
+        REQUIRE(!narrow.load(path));
+        corrupt_copy(path, corrupt_path);
+        REQUIRE(!loaded.load(corrupt_path, true));
+        REQUIRE(!loaded.load(path + ".missing"));
+        REQUIRE(check_same_queries(qt, loaded));
+    }
+
+    SECTION("R-tree") {
+        spatial::Rtree<Raw> rtree;
+        rtree.build(point_data);
+        REQUIRE(rtree.save(path));
+
+        spatial::Rtree<Raw> loaded;
+        REQUIRE(loaded.load(path, true));
+        REQUIRE(loaded.get_load() == point_data.size());
+        REQUIRE(loaded.check_load());
+        REQUIRE(loaded.check_mbbs());
+        REQUIRE(check_same_queries(rtree, loaded));
+
+        rtree.bulk_load(point_data);
+        rtree.pack();
+        REQUIRE(rtree.save(path));
+        REQUIRE(loaded.load(path));
+        REQUIRE(check_same_queries(rtree, loaded));
+
+        spatial::Quadtree<Raw> qt(0, 1, 0, 1);
+        REQUIRE(!qt.load(path));
+        corrupt_copy(path, corrupt_path);
+        REQUIRE(!loaded.load(corrupt_path, true));
+        REQUIRE(check_same_queries(rtree, loaded));
+    }
+
+    SECTION("Z-grid") {
+        spatial::Zgrid<Raw> zgrid(min[0], max[0], min[1], max[1]);
+        zgrid.build(point_data, 6);
+        REQUIRE(zgrid.save(path));
+
+        spatial::Zgrid<Raw> loaded(0, 1, 0, 1, spatial::Curve::hilbert);
+        REQUIRE(loaded.load(path, true));
+        REQUIRE(loaded.size() == zgrid.size());
+        REQUIRE(check_same_queries(zgrid, loaded));
+
+        spatial::Zgrid<Raw, coord_t, 3> zgrid3(
+            spatial::RectangleND<3>{{0, 0, 0}, {1, 1, 1}}
+        );
+        REQUIRE(!zgrid3.load(path));
+        corrupt_copy(path, corrupt_path);
+        REQUIRE(!loaded.load(corrupt_path, true));
+        REQUIRE(check_same_queries(zgrid, loaded));
+    }
+
+    std::remove(path.c_str());
+    std::remove(corrupt_path.c_str());
+}
+
+TEST_CASE("Tiled indexes", "[tiled]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+
+    using Raw = std::array<coord_t, 3>;
+    std::vector<Raw> raw_data;
+    for (auto const& p : point_data) raw_data.push_back({p[0], p[1], p[2]});
+
+    // With 4x4 tiles, these are right on (or near) tile borders and corners
+    std::vector<std::pair<unsigned, spatial::Point>> const queries = {
+        {1, {100, 150}}, {16, {125, 300}}, {32, {250, 250}},
+        {8, {0, 0}}, {8, {500, 500}}, {64, {375.5, 124.5}}
+    };
+    auto const check_tiled_queries = [&] (auto& tiled) {
+        for (auto const& [k, p] : queries) {
+            std::vector<std::vector<coord_t>> knn;
+            for (auto const& raw : tiled.query_knn(k, p)) {
+                knn.push_back({raw[0], raw[1], raw[2]});
+            }
+            if (knn.size() != k || !check_knn_brute_force(knn, p, point_data)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::string const directory = (
+        std::filesystem::temp_directory_path() / "spatial_test_tiles"
+    ).string();
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+
+    // Small enough that the points have to be spilled several times over,
+    // and only a handful of tiles can be resident at once
+    std::size_t const budget = 1 << 20;
+
+    SECTION("quadtree tiles") {
+        spatial::TiledIndex<Raw, spatial::Quadtree<Raw>> tiled(
+            directory, bounds, 2, budget
+        );
+        for (std::size_t start = 0; start < raw_data.size(); start += 10000) {
+            REQUIRE(tiled.add(std::vector<Raw>(
+                raw_data.begin() + start,
+                raw_data.begin() + std::min(start + 10000, raw_data.size())
+            )));
+        }
+        REQUIRE(tiled.finish([] (auto& qt, auto const& points) {
+            qt.build(points);
+        }));
+        REQUIRE(tiled.size() == raw_data.size());
+        REQUIRE(tiled.num_tiles() == 16);
+        REQUIRE(check_tiled_queries(tiled));
+        REQUIRE(tiled.num_resident() < 16);
+        REQUIRE(tiled.get_resident_bytes() <= budget);
+
+        // The finished tiles can be reopened without the points
+        spatial::TiledIndex<Raw, spatial::Quadtree<Raw>> reopened(
+            directory, (spatial::Rectangle){{0, 0}, {1, 1}}, 1, budget
+        );
+        REQUIRE(reopened.load());
+        REQUIRE(reopened.size() == raw_data.size());
+        REQUIRE(check_tiled_queries(reopened));
+
+        // A resident tile is charged for its rebuilt nodes as well as its
+        // mapped file, i.e., what the loaded index reports it's using
+        std::string const whole_directory = directory + "/whole";
+        spatial::TiledIndex<Raw, spatial::Quadtree<Raw>> whole(
+            whole_directory, bounds, 0, std::size_t(1) << 30
+        );
+        REQUIRE(whole.add(raw_data));
+        REQUIRE(whole.finish([] (auto& qt, auto const& points) {
+            qt.build(points);
+        }));
+        REQUIRE(whole.query_knn(8, 250, 250).size() == 8);
+        spatial::Quadtree<Raw> tile(bounds);
+        REQUIRE(tile.load(whole_directory + "/tile_0.idx"));
+        REQUIRE(whole.get_resident_bytes() == tile.memory_bytes());
+        REQUIRE(whole.get_resident_bytes() > std::filesystem::file_size(
+            whole_directory + "/tile_0.idx"
+        ));
+    }
+
+    SECTION("Z-grid tiles") {
+        spatial::TiledIndex<Raw, spatial::Zgrid<Raw>> tiled(
+            directory, bounds, 2, budget
+        );
+        REQUIRE(tiled.add(raw_data));
+        REQUIRE(tiled.finish([] (auto& zgrid, auto const& points) {
+            zgrid.build(points, 4);
+        }));
+        REQUIRE(check_tiled_queries(tiled));
+
+        spatial::TiledIndex<Raw, spatial::Quadtree<Raw>> wrong_type(
+            directory, bounds, 2, budget
+        );
+        REQUIRE(!wrong_type.load());  // (the tile list is fine, the tiles not)
+        REQUIRE(wrong_type.size() == 0);
+
+        // A query which needs a missing tile says so, rather than answering
+        // from the tiles around it
+        std::filesystem::remove(directory + "/tile_12.idx");  // (250, 250)
+        spatial::TiledIndex<Raw, spatial::Zgrid<Raw>> missing(
+            directory, bounds, 2, budget
+        );
+        REQUIRE(missing.load());
+        REQUIRE(missing.query_knn(8, 250, 250).empty());
+        REQUIRE(missing.query_knn(8, 50, 50).size() == 8);
+    }
+
+    SECTION("fine grid") {
+        // Leftover point files are cleared out, but nothing else
+        std::filesystem::create_directories(directory);
+        std::ofstream(directory + "/tile_12345.pts") << "stale";
+        std::ofstream(directory + "/notes.txt") << "keep";
+        spatial::TiledIndex<Raw, spatial::Zgrid<Raw>> tiled(
+            directory, bounds, 4, budget
+        );
+        REQUIRE(!std::filesystem::exists(directory + "/tile_12345.pts"));
+        REQUIRE(std::filesystem::exists(directory + "/notes.txt"));
+
+        REQUIRE(tiled.add(raw_data));
+        REQUIRE(tiled.finish([] (auto& zgrid, auto const& points) {
+            zgrid.build(points, 3);
+        }));
+        REQUIRE(tiled.num_tiles() == 256);
+
+        // A small query only needs the tiles around it
+        REQUIRE(tiled.query_knn(8, 250, 250).size() == 8);
+        REQUIRE(tiled.num_resident() <= 9);
+
+        // Larger queries spread over several rings of tiles, and queries
+        // from outside of the bounds start from the nearest edge tile
+        REQUIRE(check_tiled_queries(tiled));
+        std::vector<std::pair<unsigned, spatial::Point>> const far = {
+            {500, {250, 250}}, {16, {-100, 250}}, {16, {600, 700}},
+            {200, {0, 500}}
+        };
+        for (auto const& [k, p] : far) {
+            std::vector<std::vector<coord_t>> knn;
+            for (auto const& raw : tiled.query_knn(k, p)) {
+                knn.push_back({raw[0], raw[1], raw[2]});
+            }
+            REQUIRE(knn.size() == k);
+            REQUIRE(check_knn_brute_force(knn, p, point_data));
+        }
+    }
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Streaming lidar reader", "[reader]") {
+
+    LidarReader reader(rand100k);
+    auto const& point_data = reader.get_point_data();
+
+    for (bool const prefetch : {false, true}) {
+        LidarChunkReader chunk_reader(rand100k, 4096, prefetch);
+        REQUIRE(chunk_reader.get_min() == reader.get_min());
+        REQUIRE(chunk_reader.get_max() == reader.get_max());
+
+        std::vector<std::vector<coord_t>> chunk;
+        std::size_t total = 0;
+        bool matches = true;
+        while (chunk_reader.next_chunk(chunk)) {
+            REQUIRE(chunk.size() <= 4096);
+            for (auto const& point : chunk) {
+                matches = matches && (point == point_data[total++]);
+            }
+        }
+        REQUIRE(matches);
+        REQUIRE(total == point_data.size());
+        REQUIRE(chunk.empty());
+        REQUIRE(!chunk_reader.next_chunk(chunk));
+    }
+
+    // Without prefetching, the same buffer is reused chunk after chunk
+    LidarChunkReader chunk_reader(rand100k, 1000);
+    std::vector<std::vector<coord_t>> chunk;
+    chunk_reader.next_chunk(chunk);
+    coord_t const* const first = chunk[0].data();
+    chunk_reader.next_chunk(chunk);
+    REQUIRE(chunk[0].data() == first);
+
+    // Stopping early shouldn't hang the prefetching thread
+    {
+        LidarChunkReader abandoned(rand100k, 1000, true);
+        REQUIRE(abandoned.next_chunk(chunk));
+    }
+
+    // Broken or short lines are skipped, rather than handed out
+    std::string const path = (
+        std::filesystem::temp_directory_path() / "spatial_test_chunks.txt"
+    ).string();
+    {
+        std::ofstream out(path);
+        out << "% min x y z 0 0 0\n% max x y z 1 1 1\n"
+            << "0.5 0.25 1e-3\r\n"
+            << "0.1 garbage 0.3\n\n"
+            << "1 2\n"
+            << "  4\t5 6  \n"
+            << "7 8 9x\n"
+            << "10 11 12";
+    }
+    for (bool const prefetch : {false, true}) {
+        LidarChunkReader broken(path, 2, prefetch);
+        std::vector<std::vector<coord_t>> points;
+        while (broken.next_chunk(chunk)) {
+            points.insert(points.end(), chunk.begin(), chunk.end());
+        }
+        REQUIRE(broken.get_skipped() == 3);
+        REQUIRE(points == std::vector<std::vector<coord_t>>{
+            {0.5, 0.25, 1e-3}, {4, 5, 6}, {10, 11, 12}
+        });
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Parallel text parser", "[reader]") {
+
+    LidarReader reader(rand100k);
+    auto const& point_data = reader.get_point_data();
+
+    for (unsigned const num_threads : {1, 3, 8}) {
+        LidarParser parser(rand100k, num_threads);
+        REQUIRE(parser.get_min() == reader.get_min());
+        REQUIRE(parser.get_max() == reader.get_max());
+        REQUIRE(parser.get_columns() == 3);
+        REQUIRE(parser.get_skipped() == 0);
+        REQUIRE(parser.size() == point_data.size());
+        REQUIRE(parser.get_point_data() == point_data);
+    }
+
+    // Any number of columns, with the odd blank, broken or short line
+    std::string const path = (
+        std::filesystem::temp_directory_path() / "spatial_test_columns.txt"
+    ).string();
+    {
+        std::ofstream out(path);
+        out << "% min x y z 0 0 0\n% max x y z 1 1 1\n"
+            << "\n0.5 0.25 1e-3 -4 17\r\n"
+            << "0.5 0.5 0.5 0.5 0.5\n\n"
+            << "0.1 garbage 0.3 0.4 0.5\n"
+            << "  1\t2 3 4 5   \n"
+            << "1 2 3\n"
+            << "0.75 0.125 8 9 10";
+    }
+    for (unsigned const num_threads : {1, 4, 64}) {
+        LidarParser parser(path, num_threads);
+        REQUIRE(parser.get_columns() == 5);
+        REQUIRE(parser.get_skipped() == 2);
+        REQUIRE(parser.get_coords() == std::vector<coord_t>{
+            0.5, 0.25, 1e-3, -4, 17,
+            0.5, 0.5, 0.5, 0.5, 0.5,
+            1, 2, 3, 4, 5,
+            0.75, 0.125, 8, 9, 10
+        });
+    }
+
+    // A broken first line mustn't leave its leading values behind
+    {
+        std::ofstream out(path);
+        out << "0.1 garbage 0.3\n1 2 3\n4 5 6\n";
+    }
+    for (unsigned const num_threads : {1, 2}) {
+        LidarParser parser(path, num_threads);
+        REQUIRE(parser.get_columns() == 3);
+        REQUIRE(parser.get_skipped() == 1);
+        REQUIRE(parser.size() == 2);
+        REQUIRE(parser.get_coords() == std::vector<coord_t>{1, 2, 3, 4, 5, 6});
+    }
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Synthetic lidar generator", "[generator]") {
+
+    LidarScene scene;
+    scene.num_points = 50000;
+    scene.seed = 7;
+    auto const points = generate_lidar(scene);
+    LidarGenerator const generator(scene);
+    auto const min = generator.get_min();
+    auto const max = generator.get_max();
+
+    SECTION("points") {
+        REQUIRE(points.size() == scene.num_points);
+        REQUIRE(std::all_of(points.begin(), points.end(), [&] (auto const& p) {
+            for (int a = 0; a < 3; a++) {
+                if (p[a] < min[a] || p[a] > max[a]) return false;
+            }
+            return true;
+        }));
+        REQUIRE(generate_lidar(scene) == points);
+        scene.seed++;
+        REQUIRE(generate_lidar(scene) != points);
+    }
+
+    SECTION("density") {
+        // Nothing like uniform: some 10x10 cells are (nearly) empty water,
+        // others are overlapping strips and vegetation, and some returns
+        // share their x and y, or are outright duplicates
+        std::vector<std::size_t> cells(50 * 50);
+        for (auto const& p : points) {
+            int const x = std::min(49, int(p[0] / 10));
+            int const y = std::min(49, int(p[1] / 10));
+            cells[y*50 + x]++;
+        }
+        std::sort(cells.begin(), cells.end());
+        REQUIRE(cells.front() * 10 < cells[cells.size() / 2]);
+        REQUIRE(cells.back() > 2 * cells[cells.size() / 2]);
+
+        auto sorted = points;
+        std::sort(sorted.begin(), sorted.end());
+        std::size_t duplicates = 0;
+        std::size_t coincident = 0;
+        for (std::size_t i = 1; i < sorted.size(); i++) {
+            duplicates += (sorted[i] == sorted[i-1]);
+            coincident += (sorted[i][0] == sorted[i-1][0]
+                && sorted[i][1] == sorted[i-1][1]);
+        }
+        REQUIRE(duplicates > 0);
+        REQUIRE(coincident > duplicates);
+    }
+
+    SECTION("files") {
+        std::string const base = (
+            std::filesystem::temp_directory_path() / "spatial_test_generated"
+        ).string();
+        REQUIRE(write_lidar_binary(base + ".bin", scene));
+        REQUIRE(write_lidar_text(base + ".txt", scene));
+
+        std::vector<coord_t> coords;
+        for (auto const& p : points) {
+            coords.insert(coords.end(), p.begin(), p.end());
+        }
+
+        LidarParser binary(base + ".bin");
+        REQUIRE(binary.get_columns() == 3);
+        REQUIRE(binary.get_coords() == coords);
+        REQUIRE(binary.get_min() == min);
+        REQUIRE(binary.get_max() == max);
+
+        // (the text is only to the centimetre, which is all there is)
+        LidarParser text(base + ".txt");
+        REQUIRE(text.get_skipped() == 0);
+        REQUIRE(text.get_coords() == coords);
+        REQUIRE(text.get_min() == min);
+        REQUIRE(text.get_max() == max);
+
+        std::remove((base + ".bin").c_str());
+        std::remove((base + ".txt").c_str());
+    }
+
+}
+
+/**
+ * Check that the stats of a few queries add up (or, when stats aren't
+ * being collected, that they're all zero).
+ */
+template<typename Index>
+void check_query_stats(Index& index) {
+    using spatial::QueryStats;
+    unsigned const k = 16;
+    std::vector<spatial::Point> const queries = {
+        {100, 150}, {300, 450}, {0, 0}, {250, 750}
+    };
+    index.reset_stats();
+    typename Index::QueryContext context;
+    QueryStats totals;
+    for (auto const& p : queries) {
+        index.query_knn(context, k, p);
+        QueryStats const& stats = context.get_stats();
+        if constexpr (spatial::collect_stats) {
+            REQUIRE(stats.queries == 1);
+            REQUIRE(stats.nodes_popped <= stats.nodes_pushed);
+            REQUIRE(stats.leaves_scanned >= 1);
+            REQUIRE(stats.leaves_scanned <= stats.nodes_popped);
+            REQUIRE(stats.points_tested >= k);
+            REQUIRE(stats.heap_replacements <= stats.points_tested - k);
+        } else {
+            REQUIRE(stats.queries == 0);
+            REQUIRE(stats.nodes_popped == 0);
+            REQUIRE(stats.points_tested == 0);
+        }
+        totals += stats;
+    }
+    QueryStats const all = index.get_stats();
+    REQUIRE(all.queries == totals.queries);
+    REQUIRE(all.nodes_pushed == totals.nodes_pushed);
+    REQUIRE(all.points_tested == totals.points_tested);
+    REQUIRE(all.heap_replacements == totals.heap_replacements);
+
+    // Queries without a context count towards the totals too
+    index.query_knn(k, queries[0]);
+    REQUIRE(
+        index.get_stats().queries == totals.queries + spatial::collect_stats
+    );
+
+    // Capped queries stop popping nodes at the cap
+    index.query_knn(context, k, queries[1], 0, 3);
+    REQUIRE(context.get_stats().nodes_popped == 3 * spatial::collect_stats);
+
+    index.reset_stats();
+    REQUIRE(index.get_stats().queries == 0);
+}
+
+TEST_CASE("Query statistics", "[stats]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+    using Raw = std::vector<coord_t>;
+
+    SECTION("quadtree") {
+        spatial::Quadtree<Raw> qt(min[0], max[0], min[1], max[1]);
+        qt.build(point_data);
+        check_query_stats(qt);
+    }
+
+    SECTION("R-tree") {
+        spatial::Rtree<Raw> rtree;
+        rtree.build(point_data);
+        check_query_stats(rtree);
+        rtree.pack();
+        check_query_stats(rtree);
+    }
+
+    SECTION("Z-grid") {
+        spatial::Zgrid<Raw> zgrid(min[0], max[0], min[1], max[1]);
+        zgrid.build(point_data, 6);
+        check_query_stats(zgrid);
+    }
+
+}
+
+#if defined(__cpp_concepts) && __cpp_concepts >= 201907L
+static_assert(spatial::SpatialIndex<
+    spatial::Quadtree<std::vector<coord_t>>, std::vector<coord_t>
+>);
+static_assert(spatial::SpatialIndex<
+    spatial::Rtree<std::vector<coord_t>>, std::vector<coord_t>
+>);
+static_assert(spatial::SpatialIndex<
+    spatial::Zgrid<std::vector<coord_t>, uint16_t, 3>, std::vector<coord_t>, 3
+>);
+#endif
+
+TEST_CASE("Choosing an index by name", "[any_index]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+    auto const query_data = LidarReader(rand1k).get_point_data();
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+
+    SECTION("every structure") {
+        for (char const* name : spatial::index_names) {
+            CountingResource resource;
+            auto index = spatial::make_index<std::vector<coord_t>>(
+                name, bounds, &resource
+            );
+            REQUIRE(index);
+            std::size_t const empty_bytes = index->memory_bytes();
+            index->build(point_data);
+            REQUIRE(check_exact_queries(*index, point_data));
+            REQUIRE(check_batch_queries(*index, query_data));
+            REQUIRE(check_radius_queries(*index, point_data));
+
+            // Give or take the index object and shared_ptr control blocks
+            std::size_t const bytes = index->memory_bytes();
+            REQUIRE(bytes > empty_bytes);
+            REQUIRE(bytes > resource.bytes / 2);
+            REQUIRE(bytes < resource.bytes + 4096);
+            index.reset();
+            REQUIRE(resource.bytes == 0);
+        }
+        REQUIRE(!spatial::make_index<std::vector<coord_t>>("kd-tree", bounds));
+    }
+
+    SECTION("capacities") {
+        std::vector<spatial::IndexConfig> configs;
+        for (int const L : spatial::quadtree_capacities) {
+            configs.push_back({"quadtree", spatial::Curve::zorder, 0, L});
+        }
+        for (int const M : spatial::rtree_capacities) {
+            configs.push_back({"rtree", spatial::Curve::hilbert, 0, M});
+        }
+        for (auto const& config : configs) {
+            auto index = spatial::make_index<std::vector<coord_t>>(
+                config, bounds
+            );
+            REQUIRE(index);
+            REQUIRE(index->get_config().capacity == config.capacity);
+            index->build(point_data);
+            REQUIRE(check_exact_queries(*index, point_data));
+            REQUIRE(check_radius_queries(*index, point_data));
+        }
+
+        // Only the instantiated capacities are available, and the Z-grid
+        // has none to choose
+        REQUIRE(!spatial::make_index<std::vector<coord_t>>(
+            {"quadtree", spatial::Curve::zorder, 0, 12}, bounds
+        ));
+        REQUIRE(!spatial::make_index<std::vector<coord_t>>(
+            {"rtree", spatial::Curve::hilbert, 0, 64}, bounds
+        ));
+        REQUIRE(!spatial::make_index<std::vector<coord_t>>(
+            {"zgrid", spatial::Curve::zorder, 0, 16}, bounds
+        ));
+    }
+
+    SECTION("three dimensions") {
+        spatial::RectangleND<3> const bounds3 = {
+            {min[0], min[1], min[2]}, {max[0], max[1], max[2]}
+        };
+        spatial::PointND<3> const p = {250, 250, 50};
+        for (char const* name : spatial::index_names) {
+            auto index = spatial::make_index<std::vector<coord_t>, 3>(
+                name, bounds3
+            );
+            index->build(point_data);
+            REQUIRE(check_knn_brute_force<3>(
+                index->query_knn(16, p), p, point_data
+            ));
+            std::size_t expected = 0;
+            for (auto const& point : point_data) {
+                spatial::PointND<3> const q = {point[0], point[1], point[2]};
+                expected += (spatial::distance(p, q) <= 10);
+            }
+            REQUIRE(index->query_radius(p, 10).size() == expected);
+        }
+    }
+
+    SECTION("Z-grid resolution") {
+        using Zgrid = spatial::Zgrid<std::vector<coord_t>>;
+        REQUIRE(Zgrid::resolution(0) == 1);
+        REQUIRE(Zgrid::resolution(64 << 10) == 5);
+        REQUIRE(Zgrid::resolution(100000) == 5);
+        REQUIRE(Zgrid::resolution(spatial::index_t(1) << 40) == 12);
+        REQUIRE(spatial::Zgrid<std::vector<coord_t>, coord_t, 3>::resolution(
+            64 << 12
+        ) == 4);
+    }
+
+}
+
+TEST_CASE("Index tuning", "[tuner]") {
+
+    LidarReader reader(rand100k);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    auto const& point_data = reader.get_point_data();
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+    auto const query_data = LidarReader(rand1k).get_point_data();
+    std::vector<spatial::Point> queries;
+    for (auto const& point : query_data) {
+        queries.push_back({point[0], point[1]});
+    }
+
+    spatial::TuningOptions options;
+    options.sample_size = 20000;
+    options.num_queries = 200;
+    options.radii = {2};
+    options.min_seconds = 0.01;
+
+    auto const profile = spatial::profile_data(point_data, bounds);
+    REQUIRE(profile.dims == 2);
+    REQUIRE(profile.num_points == point_data.size());
+    REQUIRE(profile.occupancy > 0.9);  // (uniformly random points)
+    REQUIRE(profile.similar(profile));
+
+    SECTION("tuning") {
+        auto const results = spatial::tune_index(
+            point_data, queries, bounds, options
+        );
+        REQUIRE(results.size() > 6);
+        for (std::size_t i = 0; i < results.size(); i++) {
+            REQUIRE(results[i].build_ns > 0);
+            REQUIRE(results[i].query_ns > 0);
+            REQUIRE(results[i].bytes > 0);
+            if (i) REQUIRE(results[i-1].cost <= results[i].cost);
+        }
+
+        // Every candidate's configuration works on all of the data
+        for (auto const& result : results) {
+            auto index = spatial::make_index<std::vector<coord_t>>(
+                result.config, bounds
+            );
+            REQUIRE(index);
+            index->build(point_data);
+            REQUIRE(check_exact_queries(*index, point_data));
+            REQUIRE(check_radius_queries(*index, point_data));
+        }
+        REQUIRE(spatial::tune_index(
+            std::vector<std::vector<coord_t>>(), queries, bounds, options
+        ).empty());
+    }
+
+    SECTION("saving and loading") {
+        std::string const path = (
+            std::filesystem::temp_directory_path() / "spatial_test_tuning.txt"
+        ).string();
+        std::remove(path.c_str());
+        spatial::TuningResult result;
+        REQUIRE(!spatial::load_tuning(path, profile, options, result));
+
+        auto const best = spatial::choose_index(
+            point_data, queries, bounds, options, path
+        );
+        REQUIRE(spatial::load_tuning(path, profile, options, result));
+        REQUIRE(result.config.name == best.config.name);
+        REQUIRE(result.config.curve == best.config.curve);
+        REQUIRE(result.config.resolution == best.config.resolution);
+        REQUIRE(result.config.capacity == best.config.capacity);
+        REQUIRE(result.cost == best.cost);
+
+        // Similar data reuses the result, without tuning again
+        spatial::Rectangle const left = {
+            {min[0], min[1]}, {min[0] + (max[0] - min[0]) * 0.75, max[1]}
+        };
+        std::vector<std::vector<coord_t>> most;
+        for (auto const& point : point_data) {
+            if (point[0] <= left.max[0]) most.push_back(point);
+        }
+        auto const cached = spatial::choose_index(
+            most, queries, left, options, path
+        );
+        REQUIRE(cached.cost == best.cost);
+
+        // But not for a different workload, or very different data
+        spatial::TuningOptions other = options;
+        other.ks = {1, 16};
+        REQUIRE(!spatial::load_tuning(path, profile, other, result));
+        other = options;
+        other.radii.clear();
+        REQUIRE(!spatial::load_tuning(path, profile, other, result));
+        spatial::DataProfile sparse = profile;
+        sparse.num_points /= 10;
+        sparse.density /= 10;
+        REQUIRE(!spatial::load_tuning(path, sparse, options, result));
+        spatial::DataProfile clustered = profile;
+        clustered.occupancy /= 2;
+        REQUIRE(!profile.similar(clustered));
+        REQUIRE(result.cost == best.cost);  // (left as it was)
+
+        std::ofstream(path) << "tuning 1\nname zgrid\nspeed fast\n";
+        REQUIRE(!spatial::load_tuning(path, profile, options, result));
+        std::remove(path.c_str());
+    }
+
 }
@@ -0,0 +1,331 @@
+// threads.cpp
+/**
+ * Usage: ./threads [options] <data1.txt> <data2.txt> ...
+ *
+ * Options:
+ *   --threads n     the most threads to sweep up to (default: every core)
+ *   --generated n   also run on a generated scan of n points (default 10M,
+ *                   see lidar_generator.hpp), which may be given repeatedly;
+ *                   0 for none
+ *   --csv path      also write the results as CSV, to diff between versions
+ *   --json path     also write every run's time as JSON, for
+ *                   ./benchmark --compare (see benchmark_harness.hpp)
+ *   --trials n      timed trials of each measurement (default 1)
+ *   --warmup n      untimed runs before those (default 0)
+ *
+ * For each data set and index, and 1, 2, 4, ... threads, times:
+ *  - build: every thread builds its own index, over its share of the data.
+ *    None of the indexes build in parallel, so this measures how well
+ *    independent builds (e.g., of tiles) share the machine's memory system
+ *    and allocator, rather than any one build getting faster.
+ *  - query: the threads share one index, and split the queries between them,
+ *    each querying one point at a time.
+ *  - batch: the same, with each thread's share of the queries answered by
+ *    one call to query_knn_batch().
+ * Throughput is in points built or queries answered per second, and the
+ * parallel efficiency is the throughput over that of one thread, divided by
+ * the number of threads (so 100% is perfect scaling). The memory column is
+ * the process' resident set size once the index(es) are built, which includes
+ * the data, and the peak so far is printed after each data set.
+ *
+ * Each trial of a measurement repeats it until it's taken at least a tenth
+ * of a second, and the best run of any trial is kept.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+
+#include "process_memory.hpp"
+#include "../src/quadtree.cpp"
+#include "../src/rtree.cpp"
+#include "../src/zgrid.cpp"
+#include "../src/any_index.cpp"
+#include "../scripts/lidar_reader.cpp"
+#include "../scripts/lidar_generator.cpp"
+#include "benchmark_harness.hpp"
+
+using coord_t = spatial::coord_t;
+using Array = std::array<coord_t, 3>;
+
+struct Dataset {
+    std::string name;
+    std::vector<Array> points;
+    Array min, max;
+};
+
+/**
+ * One row of the results, for the CSV file.
+ */
+struct Row {
+    std::string dataset, index, operation;
+    unsigned threads;
+    double throughput, efficiency;
+    std::size_t rss;
+};
+
+/**
+ * Time every thread t < num_threads running work(t), all at once, from
+ * launching the first until the last has finished, as many times as fit in
+ * a tenth of a second, per trial.
+ */
+template<typename Work>
+Result time_parallel(
+    std::string const& name,
+    Settings const& settings,
+    unsigned const num_threads,
+    Work const& work
+) {
+    auto const run = [&] () {
+        auto const start = Clock::now();
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < num_threads; t++) {
+            threads.emplace_back(work, t);
+        }
+        for (auto& thread : threads) thread.join();
+        return elapsed_ns(start, Clock::now());
+    };
+    Result result = {name, {}, {}, 0, "run", {}};
+    for (unsigned i = 0; i < settings.warmup; i++) run();
+    for (unsigned i = 0; i < settings.trials; i++) {
+        std::vector<double> runs;
+        double total = 0;
+        while (total < 1e8) {
+            runs.push_back(run());
+            total += runs.back();
+        }
+        result.trials.push_back(std::move(runs));
+    }
+    return result;
+}
+
+/**
+ * Split a vector into num_parts contiguous parts, as evenly as possible.
+ */
+template<typename T>
+std::vector<std::vector<T>> split(
+    std::vector<T> const& all, unsigned const num_parts
+) {
+    std::vector<std::vector<T>> parts(num_parts);
+    for (unsigned i = 0; i < num_parts; i++) {
+        parts[i].assign(
+            all.begin() + all.size() * i / num_parts,
+            all.begin() + all.size() * (i + 1) / num_parts
+        );
+    }
+    return parts;
+}
+
+/**
+ * Run every operation, for every thread count, on an index built by
+ * build(points), which returns it in a unique_ptr.
+ */
+template<typename Build>
+void thread_benchmarks(
+    std::vector<Row>& rows,
+    std::vector<Result>& results,
+    Settings const& settings,
+    Dataset const& dataset,
+    std::string const& name,
+    std::vector<unsigned> const& thread_counts,
+    std::vector<spatial::Point> const& queries,
+    Build const& build
+) {
+    std::size_t const n = dataset.points.size();
+    double base_build = 0, base_query = 0, base_batch = 0;
+    for (unsigned const t : thread_counts) {
+        std::string const prefix = (
+            dataset.name + "/" + name + "/threads=" + std::to_string(t) + "/"
+        );
+        auto const parts = split(dataset.points, t);
+        results.push_back(time_parallel(prefix + "build", settings, t,
+            [&] (unsigned const i) { build(parts[i]); }
+        ));
+        double const build_time = summarise(results.back()).min / 1e9;
+
+        // (keeping every thread's index, to see how much they all take)
+        std::vector<decltype(build(parts[0]))> indexes(t);
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < t; i++) {
+            threads.emplace_back([&, i] () { indexes[i] = build(parts[i]); });
+        }
+        for (auto& thread : threads) thread.join();
+        std::size_t const rss = process_memusage();
+        indexes.clear();
+
+        auto const index = build(dataset.points);
+        auto const shares = split(queries, t);
+        results.push_back(time_parallel(prefix + "query", settings, t,
+            [&] (unsigned const i) {
+                coord_t filler = 0;
+                for (auto const& p : shares[i]) {
+                    filler += index->query_knn(8, p)[0][2];
+                }
+                keep(filler);
+            }
+        ));
+        double const query_time = summarise(results.back()).min / 1e9;
+        results.push_back(time_parallel(prefix + "batch", settings, t,
+            [&] (unsigned const i) {
+                keep(index->query_knn_batch(8, shares[i]).size());
+            }
+        ));
+        double const batch_time = summarise(results.back()).min / 1e9;
+
+        double const build_rate = n / build_time;
+        double const query_rate = queries.size() / query_time;
+        double const batch_rate = queries.size() / batch_time;
+        if (t == thread_counts.front()) {
+            base_build = build_rate / t;
+            base_query = query_rate / t;
+            base_batch = batch_rate / t;
+        }
+        rows.push_back({
+            dataset.name, name, "build", t,
+            build_rate, build_rate / (t * base_build), rss
+        });
+        rows.push_back({
+            dataset.name, name, "query", t,
+            query_rate, query_rate / (t * base_query), rss
+        });
+        rows.push_back({
+            dataset.name, name, "batch", t,
+            batch_rate, batch_rate / (t * base_batch), rss
+        });
+        for (auto const* row = &rows.back() - 2; row <= &rows.back(); row++) {
+            std::cout << "\t" << std::left << std::setw(10) << name
+                      << std::setw(7) << row->operation << std::right
+                      << std::setw(4) << t << " thread(s)"
+                      << std::setw(12) << row->throughput / 1e6 << " M/s"
+                      << std::setw(9) << row->efficiency * 100 << "%"
+                      << std::setw(10) << row->rss / (1 << 20) << " MB RSS\n";
+        }
+    }
+}
+
+void dataset_benchmarks(
+    std::vector<Row>& rows,
+    std::vector<Result>& results,
+    Settings const& settings,
+    Dataset const& dataset,
+    std::vector<unsigned> const& thread_counts
+) {
+    std::size_t const n = dataset.points.size();
+    std::cout << "\nRunning thread scaling benchmarks for \'" << dataset.name
+              << "\' (" << n << " points):\n" << std::fixed
+              << std::setprecision(2);
+
+    // Queries at (a little off) data points
+    std::mt19937_64 rng(n);
+    std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+    std::normal_distribution<coord_t> jitter(0, 0.5);
+    std::vector<spatial::Point> queries;
+    for (int i = 0; i < 10000; i++) {
+        Array const& p = dataset.points[pick(rng)];
+        queries.push_back({p[0] + jitter(rng), p[1] + jitter(rng)});
+    }
+
+    Array const& min = dataset.min;
+    Array const& max = dataset.max;
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+    for (char const* name : spatial::index_names) {
+        thread_benchmarks(
+            rows, results, settings, dataset, name, thread_counts, queries,
+            [&] (std::vector<Array> const& points) {
+                return built(spatial::make_index<Array>(name, bounds), points);
+            }
+        );
+    }
+
+    std::cout << "\tPeak RSS of the process so far: "
+              << process_peak_memusage() / (1 << 20) << " MB\n";
+}
+
+int main(int argc, char** argv) {
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::size_t> generated;
+    bool default_generated = true;
+    std::string csv_path;
+    std::string json_path;
+    Settings settings;
+    settings.trials = 1;
+    settings.warmup = 0;
+    std::vector<std::string> files;
+    for (int i=1; i<argc; i++) {
+        std::string const arg = argv[i];
+        if (arg == "--threads" && i+1 < argc) {
+            max_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--generated" && i+1 < argc) {
+            default_generated = false;
+            std::size_t const n = std::strtoull(argv[++i], nullptr, 10);
+            if (n) generated.push_back(n);
+        } else if (arg == "--csv" && i+1 < argc) {
+            csv_path = argv[++i];
+        } else if (arg == "--json" && i+1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--trials" && i+1 < argc) {
+            settings.trials = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--warmup" && i+1 < argc) {
+            settings.warmup = std::atoi(argv[++i]);
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (default_generated) generated.push_back(10000000);
+
+    std::vector<unsigned> thread_counts;
+    for (unsigned t = 1; t < max_threads; t *= 2) thread_counts.push_back(t);
+    thread_counts.push_back(max_threads);
+
+    std::vector<Row> rows;
+    std::vector<Result> results;
+    for (auto const& file : files) {
+        LidarParser parser(file);
+        Dataset dataset = {
+            file.substr(file.rfind('/') + 1), {},
+            parser.get_min(), parser.get_max()
+        };
+        auto const& coords = parser.get_coords();
+        std::size_t const columns = parser.get_columns();
+        for (std::size_t i = 0; i + 2 < coords.size(); i += columns) {
+            dataset.points.push_back({coords[i], coords[i+1], coords[i+2]});
+        }
+        dataset_benchmarks(rows, results, settings, dataset, thread_counts);
+    }
+    for (std::size_t const n : generated) {
+        LidarScene scene;
+        scene.num_points = n;
+        LidarGenerator const generator(scene);
+        Dataset const dataset = {
+            "generated" + std::to_string(n), generate_lidar(scene),
+            generator.get_min(), generator.get_max()
+        };
+        dataset_benchmarks(rows, results, settings, dataset, thread_counts);
+    }
+
+    if (!csv_path.empty()) {
+        std::ofstream csv(csv_path);
+        csv << "dataset,index,operation,threads,throughput,efficiency,rss\n";
+        for (auto const& row : rows) {
+            csv << row.dataset << "," << row.index << "," << row.operation
+                << "," << row.threads << "," << row.throughput
+                << "," << row.efficiency << "," << row.rss << "\n";
+        }
+        if (!csv) {
+            std::cout << "Unable to write \"" << csv_path << "\"\n";
+            return 1;
+        }
+    }
+    if (!json_path.empty() && !write_json(json_path, settings, results)) {
+        std::cout << "Unable to write \"" << json_path << "\"\n";
+        return 1;
+    }
+
+    return 0;
+}
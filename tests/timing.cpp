@@ -3,140 +3,528 @@
  * Usage: ./timing <data1.txt> <query1.txt> <data2.txt> <query2.txt> ...
  * Where 'data_.txt' contains the point data for the tree constructions,
  * and 'query_.txt' contains the points which we will query around.
+ *
+ * Compile with -mavx2 (or -march=native) to enable the SIMD leaf scans.
  */
 
 #include <iostream>
 #include <iomanip>
 #include <chrono>
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <filesystem>
 
 #include "../src/quadtree.cpp"
 #include "../src/rtree.cpp"
 #include "../src/zgrid.cpp"
+#include "../src/any_index.cpp"
 #include "../scripts/lidar_reader.cpp"
 
 using coord_t = spatial::coord_t;
+using index_t = spatial::index_t;
 
-void quadtree_benchmark(std::string data_file, std::string query_file) {
-    std::cout << "\nRunning quadtree timing benchmark for \'" << data_file << "\',\n"
-              << "using " << query_file << " for query points.\n";
-
-    // Parsing the data & header
-    LidarReader reader(data_file);
-    auto const& min = reader.get_min();
-    auto const& max = reader.get_max();
+/**
+ * Time approximate k-NN queries for a range of epsilons and node visit
+ * budgets, and report the recall against the exact results
+ * (i.e., the fraction of true k-nearest neighbours that were found).
+ */
+template<typename Index>
+void approx_benchmark(
+    Index const& index, std::vector<std::vector<coord_t>> const& queries
+) {
+    unsigned const k = 8;
+    std::vector<std::vector<std::vector<coord_t>>> exact;
+    for (auto const& p : queries) {
+        exact.push_back(index.query_knn(k, p[0], p[1]));
+    }
 
-    spatial::Quadtree<std::vector<coord_t>> qt(
-        min[0], max[0], min[1], max[1]
-    );
+    std::cout << "\tApproximate querying, k=" << k << "...\n";
+    std::vector<std::pair<coord_t, index_t>> const settings = {
+        {0.25, 0}, {0.5, 0}, {1.0, 0}, {2.0, 0}, {0, 64}, {0, 16}
+    };
+    for (auto const& [epsilon, max_visits] : settings) {
+        std::cout << "\t\teps=" << epsilon << " visits=" << max_visits << ":\t";
+        std::vector<std::vector<std::vector<coord_t>>> approx;
+        approx.reserve(queries.size());
+        auto start = std::chrono::system_clock::now();
+        for (auto const& p : queries) {
+            approx.push_back(
+                index.query_knn(k, p[0], p[1], epsilon, max_visits)
+            );
+        }
+        auto end = std::chrono::system_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+            (end - start).count();
 
-    // Quadtree construction
-    std::cout << "\tBuilding the quadtree... ";
-    auto start = std::chrono::system_clock::now();
-    qt.build(reader.get_point_data());
-    auto end = std::chrono::system_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
-        (end - start).count();
-    std::cout << elapsed << " milliseconds\n";
+        unsigned found = 0, total = 0;
+        for (unsigned i=0; i<queries.size(); i++) {
+            for (auto const& p : approx[i]) {
+                if (std::find(exact[i].begin(), exact[i].end(), p)
+                    != exact[i].end()) { found++; }
+            }
+            total += exact[i].size();
+        }
+        std::cout << elapsed << " milliseconds";
+        std::cout << "  \t(recall: " << std::setprecision(3)
+                  << (double)found / total << std::setprecision(6) << ")\n";
+    }
+}
 
-    // k-nn queries
-    LidarReader query_reader(query_file);
-    std::cout << "\tQuerying k-nearest neighbours x1000...\n";
+/**
+ * Time k-NN queries against an already built index, labelled with whatever
+ * sets it apart from the others (e.g., narrower coordinate storage).
+ */
+template<typename Index>
+void query_benchmark(
+    Index const& index,
+    std::vector<std::vector<coord_t>> const& queries,
+    std::string const label
+) {
+    std::cout << "\tQuerying k-nearest neighbours x1000"
+              << (label.empty() ? "" : " (" + label + ")") << "...\n";
     for (auto const k : {1, 8, 32}) {
         std::cout << "\t\tk=" << k << ":\t";
         coord_t filler = 0;
-        start = std::chrono::system_clock::now();
-        for (auto const& p : query_reader.get_point_data()) {
-            auto const knn = qt.query_knn(k, p[0], p[1]);
+        auto start = std::chrono::system_clock::now();
+        for (auto const& p : queries) {
+            auto const knn = index.query_knn(k, p[0], p[1]);
             filler += knn[0][2];
         }
-        end = std::chrono::system_clock::now();
-        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+        auto end = std::chrono::system_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
             (end - start).count();
         std::cout << elapsed << " milliseconds";
         std::cout << "  \t(filler: " << filler << ")\n";
     }
-    std::cout << "\n";
 }
 
-void rtree_benchmark(std::string data_file, std::string query_file) {
-    std::cout << "\nRunning R-tree timing benchmark for \'" << data_file << "\',\n"
-              << "using " << query_file << " for query points.\n";
+/**
+ * Time a batch of k-NN queries run one by one in file order, against the
+ * same batch reordered along a curve by query_knn_batch(). The first set is
+ * the usual query file, and the second is a denser sample of the data itself
+ * (every 10th point), which is closer to an all-points k-NN workload.
+ */
+template<typename Index>
+void batch_benchmark(
+    Index const& index,
+    std::vector<std::vector<coord_t>> const& queries,
+    std::vector<std::vector<coord_t>> const& data
+) {
+    unsigned const k = 8;
+    std::vector<spatial::Point> sparse, dense;
+    for (auto const& p : queries) sparse.push_back({p[0], p[1]});
+    for (index_t i = 0; i < data.size(); i += 10) {
+        dense.push_back({data[i][0], data[i][1]});
+    }
 
-    LidarReader data_reader(data_file);
-    spatial::Rtree<std::vector<double>> rtree;
+    std::vector<std::pair<std::vector<spatial::Point> const*, std::string>>
+        const query_sets = {{&sparse, "query file"}, {&dense, "data sample"}};
+    for (auto const& [points, name] : query_sets) {
+        std::cout << "\tBatch querying, k=" << k << ", " << name
+                  << " x" << points->size() << "...\n";
 
-    std::cout << "\tBuilding the R-tree... ";
-    auto start = std::chrono::system_clock::now();
-    rtree.build(data_reader.get_point_data());
-    auto end = std::chrono::system_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
-        (end - start).count();
-    std::cout << elapsed << " milliseconds\n";
+        std::cout << "\t\tfile order:\t";
+        coord_t filler = 0;
+        auto start = std::chrono::system_clock::now();
+        for (auto const& p : *points) {
+            filler += index.query_knn(k, p)[0][2];
+        }
+        auto end = std::chrono::system_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+            (end - start).count();
+        std::cout << elapsed << " milliseconds";
+        std::cout << "  \t(filler: " << filler << ")\n";
 
-    LidarReader query_reader(query_file);
-    std::cout << "\tQuerying k-nearest neighbours x1000...\n";
+        std::vector<std::pair<spatial::Curve, std::string>> const curves = {
+            {spatial::Curve::zorder, "morton order"},
+            {spatial::Curve::hilbert, "hilbert order"}
+        };
+        for (auto const& [curve, label] : curves) {
+            std::cout << "\t\t" << label << ":\t";
+            filler = 0;
+            start = std::chrono::system_clock::now();
+            auto const results = index.query_knn_batch(k, *points, curve);
+            end = std::chrono::system_clock::now();
+            for (auto const& knn : results) filler += knn[0][2];
+            elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+                (end - start).count();
+            std::cout << elapsed << " milliseconds";
+            std::cout << "  \t(filler: " << filler << ")\n";
+        }
+    }
+}
+
+/**
+ * Time an all-points style k-NN workload (every 10th data point, visited in
+ * Hilbert order) with and without warm starting from the previous query.
+ */
+template<typename Index>
+void warm_start_benchmark(
+    Index const& index, std::vector<std::vector<coord_t>> const& data
+) {
+    std::vector<spatial::Point> points;
+    for (index_t i = 0; i < data.size(); i += 10) {
+        points.push_back({data[i][0], data[i][1]});
+    }
+    auto const order = spatial::curve_sort(points, spatial::Curve::hilbert);
+
+    std::cout << "\tWarm-started querying, data sample x" << points.size()
+              << " in hilbert order...\n";
     for (auto const k : {1, 8, 32}) {
         std::cout << "\t\tk=" << k << ":\t";
         coord_t filler = 0;
+        auto start = std::chrono::system_clock::now();
+        for (index_t const i : order) {
+            filler += index.query_knn(k, points[i])[0][2];
+        }
+        auto end = std::chrono::system_clock::now();
+        auto cold = std::chrono::duration_cast<std::chrono::milliseconds>
+            (end - start).count();
+
+        typename Index::QueryContext context;
         start = std::chrono::system_clock::now();
-        for (auto const& p : query_reader.get_point_data()) {
-            auto const knn = rtree.query_knn(k, p[0], p[1]);
-            filler += knn[0][2];
+        for (index_t const i : order) {
+            filler += index.query_knn(context, k, points[i])[0][2];
         }
         end = std::chrono::system_clock::now();
-        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+        auto warm = std::chrono::duration_cast<std::chrono::milliseconds>
             (end - start).count();
-        std::cout << elapsed << " milliseconds";
+        std::cout << cold << " -> " << warm << " milliseconds";
         std::cout << "  \t(filler: " << filler << ")\n";
     }
-    std::cout << "\n";
 }
 
-void zgrid_benchmark(std::string data_file, std::string query_file) {
-    std::cout << "\nRunning Z-grid timing benchmark for \'" << data_file << "\',\n"
-              << "using " << query_file << " for query points.\n";
+/**
+ * Time k-NN queries which allocate their own heaps and results, against the
+ * same queries reusing a single QueryContext (no allocation once it's warm).
+ */
+template<typename Index>
+void context_benchmark(
+    Index const& index, std::vector<std::vector<coord_t>> const& data
+) {
+    std::vector<spatial::Point> points;
+    for (index_t i = 0; i < data.size(); i += 10) {
+        points.push_back({data[i][0], data[i][1]});
+    }
 
-    LidarReader data_reader(data_file);
-    auto const& min = data_reader.get_min();
-    auto const& max = data_reader.get_max();
+    std::cout << "\tQuerying with a reused context, data sample x"
+              << points.size() << "...\n";
+    for (auto const k : {1, 8, 32}) {
+        std::cout << "\t\tk=" << k << ":\t";
+        coord_t filler = 0;
+        auto start = std::chrono::system_clock::now();
+        for (auto const& p : points) {
+            filler += index.query_knn(k, p)[0][2];
+        }
+        auto end = std::chrono::system_clock::now();
+        auto fresh = std::chrono::duration_cast<std::chrono::milliseconds>
+            (end - start).count();
+
+        typename Index::QueryContext context;
+        start = std::chrono::system_clock::now();
+        for (auto const& p : points) {
+            filler += index.query_knn(context, k, p)[0][2];
+        }
+        end = std::chrono::system_clock::now();
+        auto reused = std::chrono::duration_cast<std::chrono::milliseconds>
+            (end - start).count();
+        std::cout << fresh << " -> " << reused << " milliseconds";
+        std::cout << "  \t(filler: " << filler << ")\n";
+    }
+}
 
-    spatial::Zgrid<std::vector<double>> zgrid(
-        min[0], max[0], min[1], max[1]
+/**
+ * Time tearing down a freshly built index (its nodes as well as its data).
+ */
+template<typename Index>
+void teardown_benchmark(std::unique_ptr<Index> index) {
+    std::cout << "\tDestroying the index... ";
+    auto const start = std::chrono::system_clock::now();
+    index.reset();
+    auto const end = std::chrono::system_clock::now();
+    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+        (end - start).count();
+    std::cout << elapsed << " milliseconds\n";
+}
+
+/**
+ * Time radius queries around the query points, for a few radii (in the
+ * data's units, so metres for real lidar).
+ */
+template<typename Index>
+void radius_benchmark(
+    Index const& index, std::vector<std::vector<coord_t>> const& queries
+) {
+    std::cout << "\tRadius querying x" << queries.size() << "...\n";
+    for (coord_t const radius : {1.0, 2.0, 5.0, 10.0}) {
+        std::cout << "\t\tr=" << radius << ":\t";
+        std::size_t found = 0;
+        auto const start = std::chrono::system_clock::now();
+        for (auto const& p : queries) {
+            found += index.query_radius(p[0], p[1], radius).size();
+        }
+        auto const end = std::chrono::system_clock::now();
+        auto const elapsed = std::chrono::duration_cast<
+            std::chrono::milliseconds
+        >(end - start).count();
+        std::cout << elapsed << " milliseconds";
+        std::cout << "  \t(found: " << found << ")\n";
+    }
+}
+
+/**
+ * Time queries against a quadtree or Z-grid (which take the same template
+ * and constructor arguments) storing its coordinates as narrower types, and
+ * with its data laid out along a Hilbert curve.
+ */
+template<template<typename, typename, int> typename Index>
+void variant_benchmark(
+    std::vector<std::vector<coord_t>> const& data,
+    std::vector<std::vector<coord_t>> const& queries,
+    spatial::Rectangle const bounds
+) {
+    Index<std::vector<coord_t>, float, 2> index_float(bounds);
+    index_float.build(data);
+    query_benchmark(index_float, queries, "float");
+
+    Index<std::vector<coord_t>, uint16_t, 2> index_uint16(bounds);
+    index_uint16.build(data);
+    query_benchmark(index_uint16, queries, "uint16");
+
+    Index<std::vector<coord_t>, coord_t, 2> index_hilbert(
+        bounds, spatial::Curve::hilbert
     );
+    index_hilbert.build(data);
+    query_benchmark(index_hilbert, queries, "hilbert");
+}
+
+/**
+ * The benchmarks which every index runs, picked by name from make_index(),
+ * then extras(data, queries, bounds), for anything which is specific to
+ * the structure (and so needs its concrete type).
+ */
+template<typename Extras>
+void index_benchmark(
+    std::string const& name,
+    std::string const& data_file,
+    std::string const& query_file,
+    Extras const& extras
+) {
+    std::cout << "\nRunning " << name << " timing benchmark for \'"
+              << data_file << "\',\n"
+              << "using " << query_file << " for query points.\n";
+
+    LidarReader reader(data_file);
+    auto const& min = reader.get_min();
+    auto const& max = reader.get_max();
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+    auto const& data = reader.get_point_data();
+    auto index = spatial::make_index<std::vector<coord_t>>(name, bounds);
+
+    std::cout << "\tBuilding the " << name << "... ";
+    auto const start = std::chrono::system_clock::now();
+    index->build(data);
+    auto const end = std::chrono::system_clock::now();
+    auto const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+        (end - start).count();
+    std::cout << elapsed << " milliseconds  \t("
+              << index->memory_bytes() / data.size() << " bytes/point)\n";
+
+    LidarReader query_reader(query_file);
+    auto const& queries = query_reader.get_point_data();
+    query_benchmark(*index, queries, "");
+    approx_benchmark(*index, queries);
+    batch_benchmark(*index, queries, data);
+    radius_benchmark(*index, queries);
+    extras(data, queries, bounds);
+    teardown_benchmark(std::move(index));
+    std::cout << "\n";
+}
 
-    std::cout << "\tBuilding the Z-grid... ";
+void quadtree_extras(
+    std::vector<std::vector<coord_t>> const& data,
+    std::vector<std::vector<coord_t>> const& queries,
+    spatial::Rectangle const bounds
+) {
+    spatial::Quadtree<std::vector<coord_t>> qt(bounds);
+    qt.build(data);
+    warm_start_benchmark(qt, data);
+    variant_benchmark<spatial::Quadtree>(data, queries, bounds);
+}
+
+/**
+ * make_index() bulk loads the R-tree along a Hilbert curve and packs it,
+ * so this covers the other ways of building one.
+ */
+void rtree_extras(
+    std::vector<std::vector<coord_t>> const& data,
+    std::vector<std::vector<coord_t>> const& queries,
+    spatial::Rectangle const
+) {
+    spatial::Rtree<std::vector<coord_t>> rtree;
+    std::cout << "\tBuilding the R-tree by insertion... ";
     auto start = std::chrono::system_clock::now();
-    zgrid.build(data_reader.get_point_data(), 7);
+    rtree.build(data);
     auto end = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
         (end - start).count();
     std::cout << elapsed << " milliseconds\n";
+    query_benchmark(rtree, queries, "inserted");
+    rtree.pack();
+    query_benchmark(rtree, queries, "inserted, packed");
+
+    spatial::Rtree<std::vector<coord_t>> bulk;
+    std::cout << "\tBulk loading the R-tree (zorder)... ";
+    start = std::chrono::system_clock::now();
+    bulk.bulk_load(data, spatial::Curve::zorder);
+    end = std::chrono::system_clock::now();
+    elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
+        (end - start).count();
+    std::cout << elapsed << " milliseconds\n";
+    bulk.pack();
+    query_benchmark(bulk, queries, "zorder, packed");
+
+    bulk.bulk_load(data);
+    bulk.pack();
+    context_benchmark(bulk, data);
+}
+
+void zgrid_extras(
+    std::vector<std::vector<coord_t>> const& data,
+    std::vector<std::vector<coord_t>> const& queries,
+    spatial::Rectangle const bounds
+) {
+    spatial::Zgrid<std::vector<coord_t>> zgrid(bounds);
+    zgrid.build(data);
+    context_benchmark(zgrid, data);
+    variant_benchmark<spatial::Zgrid>(data, queries, bounds);
+}
+
+/**
+ * Time saving an index and loading it back into a fresh one, then the
+ * first queries against the loaded index (which fault its pages in).
+ */
+template<typename Index>
+void reload_benchmark(
+    Index const& index, Index& fresh,
+    std::vector<std::vector<coord_t>> const& queries, std::string const& name
+) {
+    std::string const path = "timing_" + name + ".idx";
+    std::cout << "\t" << name << ": saving... ";
+    auto start = std::chrono::system_clock::now();
+    index.save(path);
+    auto end = std::chrono::system_clock::now();
+    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>
+        (end - start).count() << " ms, loading... ";
+
+    start = std::chrono::system_clock::now();
+    fresh.load(path);
+    end = std::chrono::system_clock::now();
+    std::cout << std::chrono::duration_cast<std::chrono::microseconds>
+        (end - start).count() << " us, querying k=8 x1000... ";
+
+    coord_t filler = 0;
+    start = std::chrono::system_clock::now();
+    for (auto const& p : queries) {
+        filler += fresh.query_knn(8, p[0], p[1])[0][2];
+    }
+    end = std::chrono::system_clock::now();
+    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>
+        (end - start).count() << " ms  \t(filler: " << filler << ")\n";
+    std::remove(path.c_str());
+}
 
+void storage_benchmark(std::string data_file, std::string query_file) {
+    std::cout << "\nRunning save/load timing benchmark for \'" << data_file << "\',\n"
+              << "using " << query_file << " for query points.\n";
+
+    LidarReader data_reader(data_file);
     LidarReader query_reader(query_file);
-    std::cout << "\tQuerying k-nearest neighbours x1000...\n";
-    for (auto const k : {1, 8, 32}) {
-        std::cout << "\t\tk=" << k << ":\t";
-        coord_t filler = 0;
+    auto const& min = data_reader.get_min();
+    auto const& max = data_reader.get_max();
+
+    // Only trivially copyable data can be saved
+    using Raw = std::array<coord_t, 3>;
+    std::vector<Raw> point_data;
+    for (auto const& p : data_reader.get_point_data()) {
+        point_data.push_back({p[0], p[1], p[2]});
+    }
+
+    spatial::Quadtree<Raw> qt(min[0], max[0], min[1], max[1]);
+    qt.build(point_data);
+    spatial::Quadtree<Raw> qt_loaded(0, 1, 0, 1);
+    reload_benchmark(qt, qt_loaded, query_reader.get_point_data(), "quadtree");
+
+    spatial::Rtree<Raw> rtree;
+    rtree.bulk_load(point_data);
+    rtree.pack();
+    spatial::Rtree<Raw> rtree_loaded;
+    reload_benchmark(rtree, rtree_loaded, query_reader.get_point_data(), "rtree");
+
+    spatial::Zgrid<Raw> zgrid(min[0], max[0], min[1], max[1]);
+    zgrid.build(point_data, 7);
+    spatial::Zgrid<Raw> zgrid_loaded(0, 1, 0, 1);
+    reload_benchmark(zgrid, zgrid_loaded, query_reader.get_point_data(), "zgrid");
+    std::cout << "\n";
+}
+
+/**
+ * Time reading a data file whole, against streaming it in chunks (with and
+ * without a prefetching thread) through a little per-chunk work.
+ */
+void reader_benchmark(std::string data_file) {
+    std::cout << "\nRunning reader timing benchmark for \'" << data_file << "\'\n";
+
+    std::cout << "\tReading the whole file... ";
+    auto start = std::chrono::system_clock::now();
+    {
+        LidarReader reader(data_file);
+        std::cout << "(" << reader.get_point_data().size() << " points) ";
+    }
+    auto end = std::chrono::system_clock::now();
+    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>
+        (end - start).count() << " milliseconds\n";
+
+    for (bool const prefetch : {false, true}) {
+        std::cout << "\tStreaming 64k point chunks"
+                  << (prefetch ? ", prefetching... " : "... ");
         start = std::chrono::system_clock::now();
-        for (auto const& p : query_reader.get_point_data()) {
-            auto const knn = zgrid.query_knn(k, p[0], p[1]);
-            filler += knn[0][2];
+        LidarChunkReader reader(data_file, 65536, prefetch);
+        std::vector<std::vector<coord_t>> chunk;
+        coord_t filler = 0;
+        while (reader.next_chunk(chunk)) {
+            for (auto const& p : chunk) filler += std::sqrt(p[0]*p[0] + p[1]*p[1]);
         }
         end = std::chrono::system_clock::now();
-        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
-            (end - start).count();
-        std::cout << elapsed << " milliseconds";
+        std::cout << std::chrono::duration_cast<std::chrono::milliseconds>
+            (end - start).count() << " milliseconds";
         std::cout << "  \t(filler: " << filler << ")\n";
     }
-    std::cout << "\n";
+
+    std::size_t const bytes = std::filesystem::file_size(data_file);
+    unsigned const max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned const threads : {1u, max_threads}) {
+        std::cout << "\tParsing in parallel, " << threads << " thread(s)... ";
+        start = std::chrono::system_clock::now();
+        LidarParser parser(data_file, threads);
+        end = std::chrono::system_clock::now();
+        auto const us = std::chrono::duration_cast<std::chrono::microseconds>
+            (end - start).count();
+        std::cout << us / 1000 << " milliseconds, "
+                  << bytes / std::max<long>(us, 1) << " MB/s"
+                  << "  \t(" << parser.size() << " points)\n";
+    }
 }
 
 int main(int argc, char** argv) {
 
     for (int i=1; i<argc; i+=2) {
-        quadtree_benchmark(argv[i], argv[i+1]);
-        rtree_benchmark(argv[i], argv[i+1]);
-        zgrid_benchmark(argv[i], argv[i+1]);
+        index_benchmark("quadtree", argv[i], argv[i+1], quadtree_extras);
+        index_benchmark("rtree", argv[i], argv[i+1], rtree_extras);
+        index_benchmark("zgrid", argv[i], argv[i+1], zgrid_extras);
+        storage_benchmark(argv[i], argv[i+1]);
+        reader_benchmark(argv[i]);
     }
 
     return 0;
@@ -0,0 +1,112 @@
+// tune.cpp
+/**
+ * Usage: ./tune [options] <data.txt> [query.txt]
+ *
+ * Options:
+ *   --k k                 time k-NN queries for k (default 8), which may be
+ *                         given repeatedly
+ *   --radius r            also time radius queries, likewise
+ *   --queries-per-point q how many queries the index will answer per point
+ *                         it's built on (default 1)
+ *   --sample n            build the candidates on n of the points (default
+ *                         200k)
+ *   --cache path          reuse the result saved here, if it's for similar
+ *                         data, or else save it there
+ *
+ * Tunes an index for the data (see tuner.hpp), querying at the points in
+ * query.txt, or the data's if there isn't one, and prints every candidate,
+ * best first, or with --cache, just the one chosen.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+#include "../src/quadtree.cpp"
+#include "../src/rtree.cpp"
+#include "../src/zgrid.cpp"
+#include "../src/any_index.cpp"
+#include "../src/tuner.cpp"
+#include "../scripts/lidar_reader.cpp"
+
+using coord_t = spatial::coord_t;
+
+void print_result(spatial::TuningResult const& result) {
+    std::string config = result.config.name;
+    config += (result.config.curve == spatial::Curve::hilbert)
+        ? " hilbert" : " zorder";
+    if (result.config.resolution) {
+        config += " r=" + std::to_string(result.config.resolution);
+    }
+    if (result.config.capacity) {
+        config += (result.config.name == "rtree") ? " M=" : " L=";
+        config += std::to_string(result.config.capacity);
+    }
+    std::cout << "\t" << std::left << std::setw(20) << config << std::right
+              << std::setw(10) << result.build_ns << " ns/point build"
+              << std::setw(10) << result.query_ns << " ns/query"
+              << std::setw(8) << result.bytes << " bytes/point"
+              << std::setw(12) << result.cost << " cost\n";
+}
+
+int main(int argc, char** argv) {
+
+    spatial::TuningOptions options;
+    bool default_ks = true;
+    std::string cache_path;
+    std::vector<std::string> files;
+    for (int i=1; i<argc; i++) {
+        std::string const arg = argv[i];
+        if (arg == "--k" && i+1 < argc) {
+            if (default_ks) options.ks.clear();
+            default_ks = false;
+            options.ks.push_back(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--radius" && i+1 < argc) {
+            options.radii.push_back(std::atof(argv[++i]));
+        } else if (arg == "--queries-per-point" && i+1 < argc) {
+            options.queries_per_point = std::atof(argv[++i]);
+        } else if (arg == "--sample" && i+1 < argc) {
+            options.sample_size = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--cache" && i+1 < argc) {
+            cache_path = argv[++i];
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.empty() || files.size() > 2) {
+        std::cout << "Usage: ./tune [options] <data.txt> [query.txt]\n";
+        return 1;
+    }
+
+    LidarReader reader(files[0]);
+    auto const min = reader.get_min();
+    auto const max = reader.get_max();
+    spatial::Rectangle const bounds = {{min[0], min[1]}, {max[0], max[1]}};
+    auto const& data = reader.get_point_data();
+    std::vector<spatial::Point> queries;
+    if (files.size() == 2) {
+        LidarReader const query_reader(files[1]);
+        for (auto const& p : query_reader.get_point_data()) {
+            queries.push_back({p[0], p[1]});
+        }
+    }
+
+    auto const profile = spatial::profile_data(data, bounds);
+    std::cout << std::fixed << std::setprecision(2)
+              << "Tuning for " << profile.num_points << " points, "
+              << profile.density << " per unit area, covering "
+              << profile.occupancy * 100 << "% of the bounds:\n";
+    if (!cache_path.empty()) {
+        print_result(spatial::choose_index(
+            data, queries, bounds, options, cache_path
+        ));
+        return 0;
+    }
+    for (auto const& result : spatial::tune_index(
+        data, queries, bounds, options
+    )) {
+        print_result(result);
+    }
+
+    return 0;
+}